@@ -8,13 +8,29 @@
  */
 
 #include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
 #include <iostream>
+#include <algorithm>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #include "AddrSequence.h"
+#include "AddrSequenceSnapshot.h"
 #include "string.h"
 
 using namespace std;
 
+BufferPool& AddrSequence::get_buf_allocator()
+{
+  // Never destroyed: AddrSequence in globals such as GlobalScan free
+  // their chunks at exit, after the statics of this file are gone.
+  static BufferPool* pool = new BufferPool(BUF_SIZE);
+
+  return *pool;
+}
+
 AddrSequence::AddrSequence()
 {
   addr_size = 0;
@@ -22,9 +38,12 @@ AddrSequence::AddrSequence()
   pageshift = 0;
   pagesize = 0;
   user_flags = 0;
-  //set this to froce alloc buffer when add cluster
-  buf_used_count = MAX_ITEM_COUNT;
+  payload_bytes = 1;
+  max_payload = UINT8_MAX;
+  dirty_bytes = 0;
   clear_location_count();
+  //this also forces alloc buffer when add cluster
+  set_layout(LAYOUT_AOS);
 }
 
 AddrSequence::~AddrSequence()
@@ -37,6 +56,8 @@ void AddrSequence::clear()
   addr_size = 0;
   nr_walks = 0;
   addr_clusters.clear();
+  skip_table.clear();
+  far_deltas.clear();
   free_all_buf();
 
   reset_iterator(find_iter, 0);
@@ -47,6 +68,60 @@ void AddrSequence::clear()
   clear_location_count();
 }
 
+int AddrSequence::set_layout(int new_layout)
+{
+  if (!addr_clusters.empty())
+    return -EBUSY;
+
+  layout = new_layout;
+  if (layout == LAYOUT_SOA) {
+    // keep each array SKIP_STRIDE aligned
+    max_item_count = BUF_SIZE / (ITEM_SIZE + payload_bytes - 1 + dirty_bytes)
+                     / SKIP_STRIDE * SKIP_STRIDE;
+    item_stride = 1;
+    for (int i = 0; i < FIELD_DIRTY; ++i)
+      field_offset[i] = i * max_item_count;
+    field_offset[FIELD_DIRTY] = (ITEM_SIZE + payload_bytes - 1) * max_item_count;
+  } else {
+    // the high byte and dirty score follow the DeltaPayload fields
+    item_stride = ITEM_SIZE + payload_bytes - 1 + dirty_bytes;
+    max_item_count = BUF_SIZE / item_stride;
+    field_offset[FIELD_DELTA] = offsetof(DeltaPayload, delta);
+    field_offset[FIELD_PAYLOAD] = offsetof(DeltaPayload, payload);
+    field_offset[FIELD_NID] = offsetof(DeltaPayload, nid);
+    field_offset[FIELD_LOCATION] = offsetof(DeltaPayload, location);
+    field_offset[FIELD_PAYLOAD_HI] = ITEM_SIZE;
+    field_offset[FIELD_DIRTY] = ITEM_SIZE + payload_bytes - 1;
+  }
+  buf_used_count = max_item_count;
+
+  return 0;
+}
+
+int AddrSequence::set_payload_width(int bits)
+{
+  if (bits != 8 && bits != 16)
+    return -EINVAL;
+
+  if (!addr_clusters.empty())
+    return -EBUSY;
+
+  payload_bytes = bits / 8;
+  max_payload = (1 << bits) - 1;
+
+  return set_layout(layout);
+}
+
+int AddrSequence::set_dirty_tracking(bool on)
+{
+  if (!addr_clusters.empty())
+    return -EBUSY;
+
+  dirty_bytes = on;
+
+  return set_layout(layout);
+}
+
 void AddrSequence::set_pageshift(int shift)
 {
   pageshift = shift;
@@ -73,18 +148,30 @@ int AddrSequence::prepare_update()
   return 0;
 }
 
-int AddrSequence::inc_payload(unsigned long addr, int n)
+int AddrSequence::inc_payload(unsigned long addr, int n, bool dirty)
 {
   int ret_value;
 
   if (in_append_period())
-    ret_value = append_addr(addr, n);
+    ret_value = append_addr(addr, n, dirty);
   else
-    ret_value = update_addr(addr, n, true);
+    ret_value = update_addr(addr, n, true, dirty);
 
   return ret_value;
 }
 
+int AddrSequence::inc_payload_range(unsigned long addr,
+                                    unsigned long nr_pages, int n, bool dirty)
+{
+  if (!nr_pages)
+    return 0;
+
+  if (in_append_period())
+    return append_addr_range(addr, nr_pages, n, dirty);
+  else
+    return update_addr_range(addr, nr_pages, n, dirty);
+}
+
 int AddrSequence::set_payload(unsigned long addr, int n)
 {
   // set the payload to a direct val is NOT
@@ -98,31 +185,60 @@ int AddrSequence::set_payload(unsigned long addr, int n)
 int AddrSequence::update_nodeid(unsigned long addr, int8_t nid,
                                 int8_t location)
 {
-  int rc = 0;
+  int rc;
+
+  // nid and location leave the addrs as they are, so they may be
+  // updated after the append stage, e.g. for pages migrated since
+  rc = do_find(find_iter, addr);
+  if (!rc)
+    do_walk_update_nid(find_iter, addr, nid, location);
+
+  return rc;
+}
+
+int AddrSequence::update_addr(unsigned long addr, int n,
+                              bool is_inc_payload, bool dirty)
+{
+  int rc;
+
+  rc = do_find(find_iter, addr);
+  if (!rc)
+    do_walk_update_payload(find_iter, addr, n, is_inc_payload, dirty);
+
+  return rc;
+}
+
+// position iter at addr
+int AddrSequence::do_find(walk_iterator& iter, unsigned long addr)
+{
+  int rc;
   unsigned long next_addr;
-  uint8_t unused_payload;
+  payload_t unused_payload;
   int8_t unused_nid;
 
-  // only allow to update nid and location
-  // in append stage
-  if (!in_append_period())
-    return -1;
+  // fast path for sequential updates: addr is current or next item
+  rc = do_walk(iter, next_addr, unused_payload, unused_nid);
+  if (!rc && next_addr < addr) {
+    do_walk_move_next(iter);
+    rc = do_walk(iter, next_addr, unused_payload, unused_nid);
+  }
+  if (!rc && next_addr == addr)
+    return 0;
+
+  seek_iterator(iter, addr);
 
   for (;;) {
-      rc = do_walk(find_iter, next_addr,
-                   unused_payload, unused_nid);
+      rc = do_walk(iter, next_addr, unused_payload, unused_nid);
 
       if (!do_walk_continue(rc))
           break;
 
-      if (next_addr == addr) {
-          do_walk_update_nid(find_iter, addr, nid, location);
+      if (next_addr == addr)
           return 0;
-      } else if (next_addr > addr) {
+      else if (next_addr > addr)
           return ADDR_NOT_FOUND;
-      }
 
-      do_walk_move_next(find_iter);
+      do_walk_move_next(iter);
   }
 
   //in update stage, the addr not exist is a graceful error
@@ -133,36 +249,109 @@ int AddrSequence::update_nodeid(unsigned long addr, int8_t nid,
   return rc;
 }
 
-int AddrSequence::update_addr(unsigned long addr, int n,
-                              bool is_inc_payload)
+int AddrSequence::update_addr_range(unsigned long addr,
+                                    unsigned long nr_pages, int n, bool dirty)
 {
-  int rc = 0;
+  unsigned long end = addr + (nr_pages << pageshift);
   unsigned long next_addr;
-  uint8_t unused_payload;
+  payload_t unused_payload;
   int8_t unused_nid;
 
-  for (;;) {
-      rc = do_walk(find_iter, next_addr, unused_payload, unused_nid);
+  // same as do_walk_update_payload(): inc by 0 changes nothing
+  if (!n)
+    return 0;
 
-      if (!do_walk_continue(rc))
-          break;
+  seek_iterator(find_iter, addr);
 
-      if (next_addr == addr) {
-          do_walk_update_payload(find_iter, addr, n, is_inc_payload);
-          return 0;
-      } else if (next_addr > addr) {
-          return ADDR_NOT_FOUND;
-      }
+  while (do_walk_continue(do_walk(find_iter, next_addr,
+                                  unused_payload, unused_nid))) {
+    if (next_addr >= end)
+      break;
+    if (next_addr >= addr)
+      do_walk_update_payload(find_iter, next_addr, n, true, dirty);
 
-      do_walk_move_next(find_iter);
+    do_walk_move_next(find_iter);
   }
 
-  //in update stage, the addr not exist is a graceful error
-  //so we change to return positive ADDR_NOT_FOUND
-  if (rc == END_OF_SEQUENCE)
-    rc = ADDR_NOT_FOUND;
+  return 0;
+}
 
-  return rc;
+// Move iter to a position not after addr, close enough for the following
+// linear walk to reach addr within SKIP_STRIDE steps.
+void AddrSequence::seek_iterator(walk_iterator& iter, unsigned long addr) const
+{
+  if (addr_clusters.empty())
+    return;
+
+  if (iter.cluster_iter < iter.cluster_iter_end && addr >= current_addr(iter)) {
+    unsigned long next_cluster = iter.cluster_iter + 1;
+
+    // the common sequential case: addr is within current cluster
+    if (next_cluster >= iter.cluster_iter_end
+        || addr < addr_clusters[next_cluster].start) {
+      const AddrCluster& cluster = *iter.cur_cluster_ptr;
+      int next_skip = iter.delta_index / SKIP_STRIDE + 1;
+
+      if (next_skip * SKIP_STRIDE >= cluster.size)
+        return;
+      if (addr < cluster.start +
+                 (skip_table[cluster.skip_index + next_skip] << pageshift))
+        return;
+
+      seek_in_cluster(iter, addr);
+      return;
+    }
+
+    // addr is within next cluster
+    if (next_cluster + 1 >= iter.cluster_iter_end
+        || addr < addr_clusters[next_cluster + 1].start) {
+      reset_iterator(iter, next_cluster);
+      seek_in_cluster(iter, addr);
+      return;
+    }
+  }
+
+  auto it = std::upper_bound(addr_clusters.begin(), addr_clusters.end(), addr,
+                             [](unsigned long a, const AddrCluster& c) {
+                               return a < c.start;
+                             });
+  if (it != addr_clusters.begin())
+    --it;
+
+  reset_iterator(iter, it - addr_clusters.begin());
+  seek_in_cluster(iter, addr);
+}
+
+void AddrSequence::seek_in_cluster(walk_iterator& iter, unsigned long addr) const
+{
+  const AddrCluster& cluster = *iter.cur_cluster_ptr;
+  const unsigned long* skip = &skip_table[cluster.skip_index];
+  int nr_skip = (cluster.size + SKIP_STRIDE - 1) / SKIP_STRIDE;
+  unsigned long dist;
+  int i;
+
+  if (addr <= cluster.start)
+    return;
+
+  dist = (addr - cluster.start) >> pageshift;
+  i = std::upper_bound(skip, skip + nr_skip, dist) - skip - 1;
+
+  iter.delta_index = i * SKIP_STRIDE;
+  iter.far_index = std::lower_bound(far_deltas.begin() + cluster.far_index,
+                                    far_deltas.begin() + far_end(iter.cluster_iter),
+                                    iter.delta_index,
+                                    [](const FarDelta& f, int index) {
+                                      return f.index < index;
+                                    }) - far_deltas.begin();
+  iter.delta_sum = skip[i] - current_delta(iter);
+}
+
+unsigned long AddrSequence::far_end(unsigned long cluster_index) const
+{
+  if (cluster_index + 1 < addr_clusters.size())
+    return addr_clusters[cluster_index + 1].far_index;
+
+  return far_deltas.size();
 }
 
 int AddrSequence::smooth_payloads()
@@ -173,17 +362,147 @@ int AddrSequence::smooth_payloads()
     //    AddrCluster& ac = kv;
     for (int i = 0; i < ac.size; ++i)
     {
-      if (!i || ac.deltas[i].delta > 3)
-        runavg = ac.deltas[i].payload;
+      // delta 0 escapes a far delta
+      if (!i || !delta_at(ac.deltas, i) || delta_at(ac.deltas, i) > 3)
+        runavg = load_payload(ac.deltas, i);
       else {
-        runavg = (7 + runavg * 7 + ac.deltas[i].payload) / 8;
-        ac.deltas[i].payload = runavg;
+        runavg = (7 + runavg * 7 + load_payload(ac.deltas, i)) / 8;
+        store_payload(ac.deltas, i, runavg);
       }
     }
   }
   return 0;
 }
 
+void AddrSequence::count_payloads(std::vector<unsigned long>& counts,
+                                  int max_value)
+{
+#ifdef __x86_64__
+  static bool has_avx2 = __builtin_cpu_supports("avx2");
+#else
+  static bool has_avx2 = false;
+#endif
+
+  count_payloads(counts, max_value, has_avx2);
+}
+
+void AddrSequence::count_payloads(std::vector<unsigned long>& counts,
+                                  int max_value, bool use_simd)
+{
+  int hist_size = HIST_NIDS * (max_value + 1);
+  std::vector<unsigned long> sub_hist(NR_SUB_HIST * hist_size, 0);
+
+  counts.resize(hist_size, 0);
+
+  // the SIMD kernel compares 8 bit payloads only, in AOS 4 byte items
+  if (payload_bytes > 1 || (layout == LAYOUT_AOS && item_stride != ITEM_SIZE))
+    use_simd = false;
+
+  for (auto& cluster: addr_clusters) {
+    if (use_simd)
+      count_cluster_avx2(cluster, &sub_hist[0], max_value);
+    else
+      count_cluster_scalar(cluster, &sub_hist[0], 0, cluster.size, max_value);
+  }
+
+  for (int i = 0; i < NR_SUB_HIST; ++i)
+    for (int j = 0; j < hist_size; ++j)
+      counts[j] += sub_hist[i * hist_size + j];
+}
+
+void AddrSequence::count_dirty(std::vector<unsigned long>& counts,
+                               int max_dirty) const
+{
+  counts.resize(max_dirty + 1, 0);
+
+  if (!dirty_bytes) {
+    counts[0] += addr_size;
+    return;
+  }
+
+  for (auto& cluster: addr_clusters) {
+    const uint8_t* dirty = item_field(cluster.deltas, FIELD_DIRTY, 0);
+
+    for (int i = 0; i < cluster.size; ++i)
+      ++counts[std::min((int)dirty[i * item_stride], max_dirty)];
+  }
+}
+
+void AddrSequence::count_cluster_scalar(AddrCluster& cluster,
+                                        unsigned long* sub_hist,
+                                        int from, int to, int max_value)
+{
+  int cols = max_value + 1;
+  int hist_size = HIST_NIDS * cols;
+
+  for (int i = from; i < to; ++i) {
+    int payload = std::min((int)load_payload(cluster.deltas, i), max_value);
+    int nid = nid_at(cluster.deltas, i);
+
+    if (nid < 0 || nid >= HIST_NIDS - 1)
+      nid = HIST_NIDS - 1;
+
+    ++sub_hist[(i & (NR_SUB_HIST - 1)) * hist_size + nid * cols + payload];
+  }
+}
+
+// Scanned pages usually come in long runs of same refs count on same node,
+// e.g. a fully idle 2M region. Check 32 bytes at a time for such runs and
+// account them at once; mixed chunks fall back to per item accounting.
+#ifdef __x86_64__
+__attribute__((target("avx2")))
+void AddrSequence::count_cluster_avx2(AddrCluster& cluster,
+                                      unsigned long* sub_hist,
+                                      int max_value)
+{
+  const int chunk = 32 / item_stride;
+  int i;
+
+  for (i = 0; i + chunk <= cluster.size; i += chunk) {
+    __m256i eq;
+
+    if (layout == LAYOUT_SOA) {
+      const uint8_t* payload = &payload_at(cluster.deltas, i);
+      const uint8_t* nid = (const uint8_t*)&nid_at(cluster.deltas, i);
+      __m256i vp = _mm256_loadu_si256((const __m256i*)payload);
+      __m256i vn = _mm256_loadu_si256((const __m256i*)nid);
+
+      eq = _mm256_and_si256(_mm256_cmpeq_epi8(vp, _mm256_set1_epi8(*payload)),
+                            _mm256_cmpeq_epi8(vn, _mm256_set1_epi8(*nid)));
+    } else {
+      const uint32_t* items = (const uint32_t*)(cluster.deltas + i * item_stride);
+      uint32_t mask = (0xffU << (8 * field_offset[FIELD_PAYLOAD]))
+                    | (0xffU << (8 * field_offset[FIELD_NID]));
+      __m256i vmask = _mm256_set1_epi32(mask);
+      __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)items),
+                                   vmask);
+
+      eq = _mm256_cmpeq_epi32(v, _mm256_set1_epi32(*items & mask));
+    }
+
+    if (_mm256_movemask_epi8(eq) == -1) {
+      int payload = std::min((int)payload_at(cluster.deltas, i), max_value);
+      int nid = nid_at(cluster.deltas, i);
+
+      if (nid < 0 || nid >= HIST_NIDS - 1)
+        nid = HIST_NIDS - 1;
+
+      sub_hist[nid * (max_value + 1) + payload] += chunk;
+    } else
+      count_cluster_scalar(cluster, sub_hist, i, i + chunk, max_value);
+  }
+
+  count_cluster_scalar(cluster, sub_hist, i, cluster.size, max_value);
+}
+#else
+void AddrSequence::count_cluster_avx2(AddrCluster& cluster,
+                                      unsigned long* sub_hist,
+                                      int max_value)
+{
+  count_cluster_scalar(cluster, sub_hist, 0, cluster.size, max_value);
+}
+#endif
+
 bool AddrSequence::prepare_get()
 {
   bool is_empty = addr_clusters.empty();
@@ -194,14 +513,14 @@ bool AddrSequence::prepare_get()
   return !is_empty;
 }
 
-int AddrSequence::get_first(unsigned long& addr, uint8_t& payload, int8_t& nid)
+int AddrSequence::get_first(unsigned long& addr, payload_t& payload, int8_t& nid)
 {
   if (!prepare_get())
     return -1;
   return get_next(addr, payload, nid);
 }
 
-int AddrSequence::get_next(unsigned long& addr, uint8_t& payload, int8_t& nid)
+int AddrSequence::get_next(unsigned long& addr, payload_t& payload, int8_t& nid)
 {
   int rc;
 
@@ -212,25 +531,245 @@ int AddrSequence::get_next(unsigned long& addr, uint8_t& payload, int8_t& nid)
   return rc;
 }
 
-int AddrSequence::do_walk(walk_iterator& iter,
-                          unsigned long& addr, uint8_t& payload, int8_t& nid)
+AddrSequence::const_iterator AddrSequence::begin() const
+{
+  return const_iterator(this, 0, addr_clusters.size());
+}
+
+AddrSequence::const_iterator AddrSequence::end() const
+{
+  return const_iterator(this, addr_clusters.size(), addr_clusters.size());
+}
+
+AddrSequence::const_iterator AddrSequence::seek(unsigned long addr) const
+{
+  const_iterator it = begin();
+
+  if (addr_clusters.empty())
+    return it;
+
+  seek_iterator(it.iter, addr);
+  while (it.iter.cluster_iter < it.iter.cluster_iter_end
+         && current_addr(it.iter) < addr)
+    do_walk_move_next(it.iter);
+
+  it.load();
+  return it;
+}
+
+std::vector<AddrSequence::Shard> AddrSequence::split(int n) const
+{
+  std::vector<Shard> shards;
+  unsigned long nr_clusters = addr_clusters.size();
+  unsigned long remain = 0;
+  unsigned long start = 0;
+  unsigned long nr = 0;
+
+  for (auto& cluster: addr_clusters)
+    remain += cluster.size;
+
+  if (n < 1)
+    n = 1;
+
+  for (unsigned long i = 0; i < nr_clusters; ++i) {
+    nr += addr_clusters[i].size;
+
+    // cut once this shard has its share of the remaining addrs
+    if (nr * (n - shards.size()) >= remain || i + 1 == nr_clusters) {
+      shards.push_back(Shard(const_iterator(this, start, i + 1),
+                             const_iterator(this, i + 1, i + 1),
+                             nr));
+      remain -= nr;
+      nr = 0;
+      start = i + 1;
+    }
+  }
+
+  return shards;
+}
+
+static int write_all(int fd, const void* buf, size_t count)
+{
+  const uint8_t* p = (const uint8_t*)buf;
+  ssize_t ret;
+
+  while (count) {
+    ret = write(fd, p, count);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    p += ret;
+    count -= ret;
+  }
+
+  return 0;
+}
+
+long AddrSequence::save_snapshot(int fd) const
+{
+  SnapshotHeader header;
+  std::vector<uint8_t> staging;
+  uint64_t offset;
+  uint64_t written = 0;
+  uint64_t nr_items = 0;
+  int err = 0;
+
+  auto align = [](uint64_t n) { return (n + 7) & ~7UL; };
+
+  // batch the small per cluster pieces into large writes
+  auto flush = [&]() {
+    if (!err)
+      err = write_all(fd, staging.data(), staging.size());
+    staging.clear();
+  };
+  auto emit = [&](const void* buf, size_t count) {
+    if (staging.size() + count > BUF_SIZE)
+      flush();
+    if (count > BUF_SIZE) {
+      if (!err)
+        err = write_all(fd, buf, count);
+    } else
+      staging.insert(staging.end(), (const uint8_t*)buf,
+                     (const uint8_t*)buf + count);
+    written += count;
+  };
+  auto pad = [&]() {
+    static const uint8_t zeros[8] = {};
+    emit(zeros, align(written) - written);
+  };
+
+  for (auto& cluster: addr_clusters)
+    nr_items += cluster.size;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.header_size = sizeof(header);
+  header.pageshift = pageshift;
+  header.nr_walks = nr_walks;
+  header.payload_bits = get_payload_width();
+  header.nr_clusters = addr_clusters.size();
+  header.nr_items = nr_items;
+  header.nr_far_deltas = far_deltas.size();
+
+  offset = align(sizeof(header));
+  header.clusters_offset = offset;
+  offset = align(offset + header.nr_clusters * sizeof(SnapshotCluster));
+  header.far_deltas_offset = offset;
+  offset = align(offset + header.nr_far_deltas * sizeof(FarDelta));
+  header.deltas_offset = offset;
+  offset = align(offset + nr_items);
+  header.payloads_offset = offset;
+  offset = align(offset + nr_items);
+  header.nids_offset = offset;
+  offset = align(offset + nr_items);
+  header.locations_offset = offset;
+  offset = align(offset + nr_items);
+  header.payloads_hi_offset = offset;
+  if (payload_bytes > 1)
+    offset = align(offset + nr_items);
+  header.image_size = offset;
+
+  staging.reserve(BUF_SIZE);
+  emit(&header, sizeof(header));
+  pad();
+
+  nr_items = 0;
+  for (auto& cluster: addr_clusters) {
+    SnapshotCluster c;
+
+    c.start = cluster.start;
+    c.first_item = nr_items;
+    c.size = cluster.size;
+    c.far_index = cluster.far_index;
+    emit(&c, sizeof(c));
+    nr_items += cluster.size;
+  }
+  pad();
+
+  emit(far_deltas.data(), far_deltas.size() * sizeof(FarDelta));
+  pad();
+
+  for (int field = FIELD_DELTA;
+       field < (payload_bytes > 1 ? FIELD_DIRTY : FIELD_PAYLOAD_HI); ++field) {
+    for (auto& cluster: addr_clusters) {
+      if (layout == LAYOUT_SOA) {
+        emit(item_field(cluster.deltas, field, 0), cluster.size);
+        continue;
+      }
+      if (staging.size() + cluster.size > BUF_SIZE)
+        flush();
+      for (int i = 0; i < cluster.size; ++i)
+        staging.push_back(*item_field(cluster.deltas, field, i));
+      written += cluster.size;
+    }
+    pad();
+  }
+
+  flush();
+
+  return err ? err : (long)header.image_size;
+}
+
+int AddrSequence::load_snapshot(const AddrSequenceSnapshot& snapshot)
+{
+  int rc = 0;
+
+  clear();
+  set_pageshift(snapshot.get_pageshift());
+  rc = set_payload_width(snapshot.get_payload_width());
+  if (rc)
+    return rc;
+
+  snapshot.for_each([&](unsigned long addr, payload_t payload,
+                        int8_t nid, int8_t location) {
+    if (rc)
+      return;
+
+    rc = append_addr(addr, payload);
+    if (rc) {
+      rc = rc < 0 ? rc : -EINVAL;
+      return;
+    }
+
+    AddrCluster& cluster = addr_clusters.back();
+    nid_at(cluster.deltas, cluster.size - 1) = nid;
+    location_at(cluster.deltas, cluster.size - 1) = location;
+  });
+
+  nr_walks = snapshot.get_nr_walks();
+  if (rc)
+    clear();
+
+  return rc;
+}
+
+int AddrSequence::do_walk(const walk_iterator& iter,
+                          unsigned long& addr, payload_t& payload, int8_t& nid) const
 {
   if (iter.cluster_iter == iter.cluster_iter_end)
     return END_OF_SEQUENCE;
 
   unsigned long delta_sum;
 
-  delta_sum = iter.delta_sum + iter.cur_delta_ptr[iter.delta_index].delta;
+  delta_sum = iter.delta_sum + current_delta(iter);
   addr = iter.cur_cluster_ptr->start + (delta_sum << pageshift);
-  payload = iter.cur_delta_ptr[iter.delta_index].payload;
-  nid = iter.cur_delta_ptr[iter.delta_index].nid;
+  payload = load_payload(iter.cur_delta_ptr, iter.delta_index);
+  nid = nid_at(iter.cur_delta_ptr, iter.delta_index);
 
   return 0;
 }
 
-void AddrSequence::do_walk_move_next(walk_iterator& iter)
+void AddrSequence::do_walk_move_next(walk_iterator& iter) const
 {
-  iter.delta_sum += iter.cur_delta_ptr[iter.delta_index].delta;
+  uint8_t delta = delta_at(iter.cur_delta_ptr, iter.delta_index);
+
+  if (!delta && iter.delta_index)
+    iter.delta_sum += far_deltas[iter.far_index++].delta;
+  else
+    iter.delta_sum += delta;
 
   ++iter.delta_index;
   if (iter.delta_index >= iter.cur_cluster_ptr->size) {
@@ -245,15 +784,25 @@ void AddrSequence::do_walk_move_next(walk_iterator& iter)
 }
 
 void AddrSequence::do_walk_update_payload(walk_iterator& iter,
-                                          unsigned addr, uint8_t payload,
-                                          bool is_inc_payload)
+                                          unsigned addr, payload_t payload,
+                                          bool is_inc_payload, bool dirty)
 {
   if (is_inc_payload) {
+    payload_t old = load_payload(iter.cur_delta_ptr, iter.delta_index);
+
     if (!payload)
       return;
-    ++iter.cur_delta_ptr[iter.delta_index].payload;
+    if (dirty && dirty_bytes) {
+      uint8_t* score = item_field(iter.cur_delta_ptr, FIELD_DIRTY, iter.delta_index);
+
+      if (*score < UINT8_MAX)
+        ++*score;
+    }
+    if (old >= max_payload)
+      return;
+    store_payload(iter.cur_delta_ptr, iter.delta_index, old + 1);
   } else {
-    iter.cur_delta_ptr[iter.delta_index].payload = payload;
+    store_payload(iter.cur_delta_ptr, iter.delta_index, payload);
   }
 
   update_addr_location_count(iter);
@@ -263,17 +812,17 @@ void AddrSequence::do_walk_update_nid(walk_iterator& iter,
                                       unsigned addr,
                                       int8_t nid, int8_t location)
 {
-  iter.cur_delta_ptr[iter.delta_index].nid = nid;
-  iter.cur_delta_ptr[iter.delta_index].location = location;
+  nid_at(iter.cur_delta_ptr, iter.delta_index) = nid;
+  location_at(iter.cur_delta_ptr, iter.delta_index) = location;
 
   update_addr_location_count(iter);
 }
 
 
-int AddrSequence::append_addr(unsigned long addr, int n)
+int AddrSequence::append_addr(unsigned long addr, int n, bool dirty)
 {
   if (addr_clusters.empty())
-    return create_cluster(addr, n);
+    return create_cluster(addr, n, dirty);
 
   // the addr in append stage should grow from low to high
   // and never duplicated or rollback, so here we
@@ -285,13 +834,53 @@ int AddrSequence::append_addr(unsigned long addr, int n)
 
   AddrCluster& cluster = addr_clusters.back();
   if (can_merge_into_cluster(cluster, addr))
-    return save_into_cluster(cluster, addr, n);
+    return save_into_cluster(cluster, addr, n, dirty);
   else
-    return create_cluster(addr, n);
+    return create_cluster(addr, n, dirty);
 }
 
 
-int AddrSequence::create_cluster(unsigned long addr, int n)
+int AddrSequence::append_addr_range(unsigned long addr,
+                                    unsigned long nr_pages, int n, bool dirty)
+{
+  unsigned long count;
+  int rc;
+
+  // skip the part overlapping with already appended addrs
+  if (!addr_clusters.empty() && addr <= last_cluster_end) {
+    count = ((last_cluster_end - addr) >> pageshift) + 1;
+    if (count >= nr_pages) {
+      printf("ignore overlapped addr %lx <= %lx\n", addr, last_cluster_end);
+      return IGNORE_DUPLICATED_ADDR;
+    }
+    addr += count << pageshift;
+    nr_pages -= count;
+  }
+
+  // the first page may start a new cluster, the others are
+  // consecutive and only need a new cluster when buffer is full
+  while (nr_pages) {
+    rc = append_addr(addr, n, dirty);
+    if (rc)
+      return rc;
+
+    addr += pagesize;
+    --nr_pages;
+
+    count = std::min(nr_pages,
+                     (unsigned long)(max_item_count - buf_used_count));
+    rc = save_range_into_cluster(addr_clusters.back(), count, n, dirty);
+    if (rc)
+      return rc;
+
+    addr += count << pageshift;
+    nr_pages -= count;
+  }
+
+  return 0;
+}
+
+int AddrSequence::create_cluster(unsigned long addr, int n, bool dirty)
 {
   void* new_buf_ptr;
   int rc;
@@ -312,7 +901,7 @@ int AddrSequence::create_cluster(unsigned long addr, int n)
   //set the find iterator because we added new cluster
   reset_iterator(find_iter, addr_clusters.size() - 1);
 
-  return save_into_cluster(addr_clusters.back(), addr, n);
+  return save_into_cluster(addr_clusters.back(), addr, n, dirty);
 }
 
 
@@ -322,7 +911,9 @@ AddrCluster AddrSequence::new_cluster(unsigned long addr, void* buffer)
 
   new_item.start = addr;
   new_item.size = 0;
-  new_item.deltas = (DeltaPayload*)buffer;
+  new_item.skip_index = skip_table.size();
+  new_item.deltas = (uint8_t*)buffer;
+  new_item.far_index = far_deltas.size();
 
   return new_item;
 }
@@ -336,9 +927,9 @@ int AddrSequence::get_free_buffer(void** free_ptr)
     rc = allocate_buf();
 
   if (rc >= 0) {
-    DeltaPayload* ptr;
+    uint8_t* ptr;
     ptr = buf_pool.back();
-    *free_ptr = &ptr[buf_used_count];
+    *free_ptr = ptr + buf_used_count * item_stride;
   }
 
   return rc;
@@ -346,17 +937,36 @@ int AddrSequence::get_free_buffer(void** free_ptr)
 
 
 int AddrSequence::save_into_cluster(AddrCluster& cluster,
-                                    unsigned long addr, int n)
+                                    unsigned long addr, int n, bool dirty)
 {
   unsigned long delta = (addr - last_cluster_end) >> pageshift;
   int index = cluster.size;
 
-  cluster.deltas[index].delta = (uint8_t)delta;
-  cluster.deltas[index].payload = n;
-  cluster.deltas[index].nid = -1;
+  if (index % SKIP_STRIDE == 0) {
+    try {
+      skip_table.push_back((addr - cluster.start) >> pageshift);
+    } catch(std::bad_alloc& e) {
+      return -ENOMEM;
+    }
+  }
+
+  if (delta > MAX_DELTA_DIST) {
+    try {
+      far_deltas.push_back({index, (uint32_t)delta});
+    } catch(std::bad_alloc& e) {
+      return -ENOMEM;
+    }
+    delta = 0;
+  }
+
+  delta_at(cluster.deltas, index) = (uint8_t)delta;
+  store_payload(cluster.deltas, index, n);
+  nid_at(cluster.deltas, index) = -1;
+  if (dirty_bytes)
+    *item_field(cluster.deltas, FIELD_DIRTY, index) = n && dirty;
 
   // default to DRAM, will be updated in update_nodeid() later
-  cluster.deltas[index].location = LOC_DRAM;
+  location_at(cluster.deltas, index) = LOC_DRAM;
 
   ++cluster.size;
   ++buf_used_count;
@@ -368,13 +978,66 @@ int AddrSequence::save_into_cluster(AddrCluster& cluster,
   return 0;
 }
 
+// append count pages right after last_cluster_end
+int AddrSequence::save_range_into_cluster(AddrCluster& cluster,
+                                          unsigned long count, int n,
+                                          bool dirty)
+{
+  DeltaPayload item;
+  unsigned long offset;
+  int index = cluster.size;
+
+  if (!count)
+    return 0;
+
+  offset = ((last_cluster_end - cluster.start) >> pageshift) + 1;
+  try {
+    for (int i = (index + SKIP_STRIDE - 1) / SKIP_STRIDE * SKIP_STRIDE;
+         i < index + (int)count; i += SKIP_STRIDE)
+      skip_table.push_back(offset + i - index);
+  } catch(std::bad_alloc& e) {
+    return -ENOMEM;
+  }
+
+  item.delta = 1;
+  item.payload = n;
+  item.nid = -1;
+  item.location = LOC_DRAM;
+  if (layout == LAYOUT_SOA) {
+    memset(&delta_at(cluster.deltas, index), item.delta, count);
+    memset(&payload_at(cluster.deltas, index), item.payload, count);
+    memset(&nid_at(cluster.deltas, index), item.nid, count);
+    memset(&location_at(cluster.deltas, index), item.location, count);
+    if (payload_bytes > 1)
+      memset(item_field(cluster.deltas, FIELD_PAYLOAD_HI, index), n >> 8, count);
+    if (dirty_bytes)
+      memset(item_field(cluster.deltas, FIELD_DIRTY, index), n && dirty, count);
+  } else if (item_stride != ITEM_SIZE) {
+    for (unsigned long i = index; i < index + count; ++i) {
+      memcpy(item_field(cluster.deltas, FIELD_DELTA, i), &item, ITEM_SIZE);
+      if (payload_bytes > 1)
+        *item_field(cluster.deltas, FIELD_PAYLOAD_HI, i) = n >> 8;
+      if (dirty_bytes)
+        *item_field(cluster.deltas, FIELD_DIRTY, i) = n && dirty;
+    }
+  } else
+    std::fill_n((DeltaPayload*)cluster.deltas + index, count, item);
+
+  cluster.size += count;
+  buf_used_count += count;
+  addr_size += count;
+  last_cluster_end += count << pageshift;
+
+  return 0;
+}
+
 bool AddrSequence::can_merge_into_cluster(AddrCluster& cluster, unsigned long addr)
 {
   unsigned long addr_delta = addr - last_cluster_end;
   unsigned long delta_distance = addr_delta >> pageshift;
   int is_not_align = addr_delta & (pagesize - 1);
 
-  if (delta_distance > MAX_DELTA_DIST
+  if (delta_distance > MAX_FAR_DELTA_DIST
       || is_buffer_full()
       || is_not_align)
     return false;
@@ -384,11 +1047,13 @@ bool AddrSequence::can_merge_into_cluster(AddrCluster& cluster, unsigned long ad
 
 int AddrSequence::allocate_buf()
 {
-  DeltaPayload* new_buf_ptr = NULL;
+  uint8_t* new_buf_ptr = NULL;
 
-  try {
-    new_buf_ptr = buf_allocator.allocate(MAX_ITEM_COUNT);
+  new_buf_ptr = get_buf_allocator().allocate();
+  if (!new_buf_ptr)
+    return -ENOMEM;
 
+  try {
     //new free buffer saved to back of pool
     //users will always use back() to get it later
     buf_pool.push_back(new_buf_ptr);
@@ -398,8 +1063,7 @@ int AddrSequence::allocate_buf()
     buf_used_count = 0;
 
   } catch(std::bad_alloc& e) {
-    if (new_buf_ptr)
-      buf_allocator.deallocate(new_buf_ptr, MAX_ITEM_COUNT);
+    get_buf_allocator().deallocate(new_buf_ptr);
 
     return -ENOMEM;
   }
@@ -410,10 +1074,10 @@ int AddrSequence::allocate_buf()
 void AddrSequence::free_all_buf()
 {
   for (auto& i : buf_pool)
-    buf_allocator.deallocate(i, MAX_ITEM_COUNT);
+    get_buf_allocator().deallocate(i);
 
   buf_pool.clear();
-  buf_used_count = MAX_ITEM_COUNT;
+  buf_used_count = max_item_count;
 }
 
 //self-testing
@@ -422,7 +1086,7 @@ void AddrSequence::free_all_buf()
 int AddrSequence::do_self_test_compare(unsigned long pagesize, bool is_perf)
 {
   unsigned long addr = 0;
-  uint8_t payload = 0;
+  payload_t payload = 0;
   int8_t nid;
 
   cout << "addr_clusters.size = " << addr_clusters.size() << endl;
@@ -506,6 +1170,303 @@ int AddrSequence::do_self_test_walk(unsigned long pagesize, bool is_perf)
   return 0;
 }
 
+// update all known addresses in random order, plus some absent ones
+int AddrSequence::do_self_test_random_update()
+{
+  std::vector<unsigned long> addrs;
+  int err;
+
+  for (auto& kv: test_map) {
+    addrs.push_back(kv.first);
+    if (test_map.find(kv.first + pagesize) == test_map.end())
+      addrs.push_back(kv.first + pagesize);
+  }
+  random_shuffle(addrs.begin(), addrs.end());
+
+  rewind();
+  for (auto& addr: addrs) {
+    bool exist = test_map.find(addr) != test_map.end();
+
+    err = inc_payload(addr, 1);
+    if (err < 0 || (exist && err) || (!exist && err != ADDR_NOT_FOUND)) {
+      fprintf(stderr, "random update error %d: addr=%lx exist=%d\n",
+              err, addr, (int)exist);
+      return -1;
+    }
+    if (exist)
+      ++test_map[addr];
+  }
+
+  return do_self_test_compare(pagesize, false);
+}
+
+// mix per-page and ranged appends/updates
+int AddrSequence::do_self_test_range(int max_loop)
+{
+  unsigned long addr;
+  unsigned long nr;
+  int val;
+  int err;
+
+  clear();
+  set_pageshift(12);
+
+  for (int loop = 0; loop < max_loop; ++loop) {
+    bool is_first_walk = !loop;
+
+    // same layout for each walk, while later walks may cover more pages
+    unsigned int seed = 1;
+
+    rewind();
+    addr = 0x100000;
+    for (int i = 0; i < 1<<14; ++i) {
+      unsigned long extra = is_first_walk ? 0 : rand() & 3;
+
+      addr += ((rand_r(&seed) & 0x1ff) + 1) * pagesize;
+      nr = (rand_r(&seed) & 1) ? 1 : (rand_r(&seed) & 0x3ff) + 1;
+      nr += extra;
+      val = rand() & 1;
+
+      if (nr == 1)
+        err = inc_payload(addr, val);
+      else
+        err = inc_payload_range(addr, nr, val);
+      if (err < 0) {
+        fprintf(stderr, "inc_payload_range error %d: addr=%lx nr=%lu\n",
+                err, addr, nr);
+        return err;
+      }
+
+      for (unsigned long j = 0; j < nr; ++j, addr += pagesize) {
+        if (is_first_walk)
+          test_map[addr] = val;
+        else if (val && test_map.find(addr) != test_map.end())
+          ++test_map[addr];
+      }
+      addr -= extra * pagesize;
+    }
+  }
+
+  return do_self_test_compare(pagesize, false);
+}
+
+// count_payloads() vs. a histogram built by get_next()
+int AddrSequence::do_self_test_histogram()
+{
+  const int max_value = 20;
+  const int cols = max_value + 1;
+  std::vector<unsigned long> expect(HIST_NIDS * cols, 0);
+  std::vector<unsigned long> counts;
+  unsigned long addr;
+  unsigned long nr;
+  payload_t payload;
+  int8_t nid;
+  int err;
+
+  clear();
+  set_pageshift(12);
+
+  for (int loop = 0; loop < 30; ++loop) {
+    unsigned int seed = 1;
+
+    rewind();
+    addr = 0x100000;
+    for (int i = 0; i < 1<<12; ++i) {
+      addr += ((rand_r(&seed) & 0x1ff) + 1) * pagesize;
+      nr = (rand_r(&seed) & 0x3ff) + 1;
+      inc_payload_range(addr, nr, rand() & 1);
+      addr += nr * pagesize;
+    }
+
+    if (loop)
+      continue;
+
+    // assign nodes in runs, as get_memory_type() would
+    err = get_first(addr, payload, nid);
+    nid = -1;
+    while (!err) {
+      if (!(rand() & 63))
+        nid = (rand() % (HIST_NIDS + 2)) - 2;
+      update_nodeid(addr, nid, LOC_DRAM);
+      err = get_next(addr, payload, nid);
+    }
+  }
+
+  err = get_first(addr, payload, nid);
+  while (!err) {
+    if (nid < 0 || nid >= HIST_NIDS - 1)
+      nid = HIST_NIDS - 1;
+    ++expect[nid * cols + std::min((int)payload, max_value)];
+    err = get_next(addr, payload, nid);
+  }
+
+  for (bool use_simd: {false, true}) {
+    counts.clear();
+    count_payloads(counts, max_value, use_simd);
+    if (counts != expect) {
+      fprintf(stderr, "count_payloads mismatch: layout=%d simd=%d\n",
+              layout, (int)use_simd);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// more walks than 8 bit payloads can count, over several buffers
+int AddrSequence::do_self_test_wide_payload()
+{
+  const int nr_runs = 24;
+  const int run_pages = 1000;
+  const int nr_loops = 300;
+  const int cols = nr_loops + 1;
+  int width = get_payload_width();
+  std::vector<unsigned long> expect(HIST_NIDS * cols, 0);
+  std::vector<unsigned long> counts;
+  unsigned long i = 0;
+
+  // refs of page p in run r; per page in even runs, per run in odd ones
+  auto refs_of = [](int r, int p) {
+    return r & 1 ? (r * 61) % 400 : ((r * run_pages + p) * 7) % 400;
+  };
+  auto addr_of = [](int r, int p) {
+    // 1GB gaps between runs need far deltas
+    return 0x100000 + ((unsigned long)r << 30) + ((unsigned long)p << 12);
+  };
+
+  clear();
+  set_pageshift(12);
+
+  for (int loop = 0; loop < nr_loops; ++loop) {
+    rewind();
+    for (int r = 0; r < nr_runs; ++r) {
+      if (r & 1) {
+        inc_payload_range(addr_of(r, 0), run_pages, loop < refs_of(r, 0));
+        continue;
+      }
+      for (int p = 0; p < run_pages; ++p)
+        inc_payload(addr_of(r, p), loop < refs_of(r, p));
+    }
+  }
+
+  if (set_payload_width(24 - width) != -EBUSY) {
+    printf("set_payload_width on non empty sequence\n");
+    return -1;
+  }
+
+  for (auto& entry: *this) {
+    int r = i / run_pages;
+    int p = i % run_pages;
+    int refs = std::min(std::min(refs_of(r, p), nr_loops), max_payload);
+
+    if (entry.addr != addr_of(r, p) || entry.payload != refs) {
+      printf("wide payload mismatch: width=%d layout=%d addr=%lx payload=%d expect=%d\n",
+             width, layout, entry.addr, entry.payload, refs);
+      return -1;
+    }
+    ++expect[(HIST_NIDS - 1) * cols + refs];
+    ++i;
+  }
+  if (i != (unsigned long)nr_runs * run_pages || buf_pool.size() < 2) {
+    printf("wide payload: %lu addrs in %lu buffers\n", i, buf_pool.size());
+    return -1;
+  }
+
+  count_payloads(counts, cols - 1);
+  if (counts != expect) {
+    printf("wide payload count_payloads mismatch: width=%d layout=%d\n",
+           width, layout);
+    return -1;
+  }
+
+  return do_self_test_snapshot();
+}
+
+// dirty scores beside refs, over several buffers
+int AddrSequence::do_self_test_dirty()
+{
+  const int nr_runs = 16;
+  const int run_pages = 1500;
+  const int nr_loops = 20;
+  std::vector<unsigned long> expect_refs(HIST_NIDS * (nr_loops + 1), 0);
+  std::vector<unsigned long> expect_dirty(nr_loops + 1, 0);
+  std::vector<unsigned long> counts;
+  unsigned long sum = 0;
+  unsigned long i = 0;
+
+  // accessed in loops < refs, of which written in loops < dirty
+  auto refs_of = [](int r, int p) { return r & 1 ? r : (r + p) % (nr_loops + 1); };
+  auto dirty_of = [&](int r, int p) { return refs_of(r, p) * (r % 3) / 2; };
+  auto addr_of = [](int r, int p) {
+    return 0x200000 + ((unsigned long)r << 28) + ((unsigned long)p << 12);
+  };
+
+  clear();
+  set_pageshift(12);
+  if (set_dirty_tracking(true))
+    return -1;
+
+  for (int loop = 0; loop < nr_loops; ++loop) {
+    rewind();
+    for (int r = 0; r < nr_runs; ++r) {
+      if (r & 1) {
+        inc_payload_range(addr_of(r, 0), run_pages, loop < refs_of(r, 0),
+                          loop < dirty_of(r, 0));
+        continue;
+      }
+      for (int p = 0; p < run_pages; ++p)
+        inc_payload(addr_of(r, p), loop < refs_of(r, p), loop < dirty_of(r, p));
+    }
+  }
+
+  for (auto& entry: *this) {
+    int r = i / run_pages;
+    int p = i % run_pages;
+
+    if (entry.addr != addr_of(r, p) || entry.payload != refs_of(r, p)
+        || entry.dirty != dirty_of(r, p)) {
+      printf("dirty mismatch: layout=%d addr=%lx payload=%d/%d dirty=%d/%d\n",
+             layout, entry.addr, entry.payload, refs_of(r, p),
+             entry.dirty, dirty_of(r, p));
+      return -1;
+    }
+    ++expect_refs[(HIST_NIDS - 1) * (nr_loops + 1) + entry.payload];
+    ++expect_dirty[entry.dirty];
+    ++i;
+  }
+  if (i != (unsigned long)nr_runs * run_pages || buf_pool.size() < 2) {
+    printf("dirty: %lu addrs in %lu buffers\n", i, buf_pool.size());
+    return -1;
+  }
+
+  count_dirty(counts, nr_loops);
+  if (counts != expect_dirty) {
+    printf("count_dirty mismatch: layout=%d\n", layout);
+    return -1;
+  }
+
+  for (bool use_simd: {false, true}) {
+    counts.clear();
+    count_payloads(counts, nr_loops, use_simd);
+    if (counts != expect_refs) {
+      printf("dirty count_payloads mismatch: layout=%d simd=%d\n",
+             layout, (int)use_simd);
+      return -1;
+    }
+  }
+
+  for_each_payload([&](payload_t payload, int8_t nid) { sum += payload; });
+  for (int j = 0; j <= nr_loops; ++j)
+    sum -= j * expect_refs[(HIST_NIDS - 1) * (nr_loops + 1) + j];
+  if (sum) {
+    printf("dirty for_each_payload mismatch: layout=%d\n", layout);
+    return -1;
+  }
+
+  clear();
+  return set_dirty_tracking(false);
+}
+
 int AddrSequence::self_test()
 {
   int ret;
@@ -513,10 +1474,63 @@ int AddrSequence::self_test()
   clear();
   set_pageshift(12);
   ret = do_self_test(4096, 30, false);
+  if (ret)
+    return ret;
+  ret = do_self_test_random_update();
+  if (ret)
+    return ret;
+
+  ret = do_self_test_range(30);
+  if (ret)
+    return ret;
+  ret = do_self_test_iterator();
+  if (ret)
+    return ret;
+  ret = do_self_test_snapshot();
+  if (ret)
+    return ret;
+  ret = do_self_test_histogram();
   if (ret)
     return ret;
 
   clear();
+  set_layout(LAYOUT_SOA);
+  set_pageshift(12);
+  ret = do_self_test(4096, 30, false);
+  if (ret)
+    return ret;
+  ret = do_self_test_random_update();
+  if (ret)
+    return ret;
+  ret = do_self_test_range(30);
+  if (ret)
+    return ret;
+  ret = do_self_test_iterator();
+  if (ret)
+    return ret;
+  ret = do_self_test_snapshot();
+  if (ret)
+    return ret;
+  ret = do_self_test_histogram();
+  if (ret)
+    return ret;
+
+  for (int l: {LAYOUT_AOS, LAYOUT_SOA})
+    for (int width: {8, 16}) {
+      clear();
+      set_layout(l);
+      set_payload_width(width);
+      ret = do_self_test_wide_payload();
+      if (ret)
+        return ret;
+      ret = do_self_test_dirty();
+      if (ret)
+        return ret;
+    }
+
+  clear();
+  set_payload_width(8);
+  set_layout(LAYOUT_AOS);
   set_pageshift(21);
   ret = do_self_test(1<<21, 30, false);
   if (ret)
@@ -537,15 +1551,195 @@ int AddrSequence::self_test()
   clear();
   set_pageshift(21);
   ret = do_self_test(1<<21, 30, false);
+  if (ret)
+    return ret;
+
+  ret = do_self_test_buf_pool();
 
   return ret;
 }
 
+// save, mmap and load back should reproduce the sequence
+int AddrSequence::do_self_test_snapshot()
+{
+  char path[] = "/tmp/addr-seq-snapshot-XXXXXX";
+  AddrSequenceSnapshot snapshot;
+  AddrSequence loaded;
+  long size;
+  int fd;
+  int err;
+
+  fd = mkstemp(path);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  size = save_snapshot(fd);
+  ::close(fd);
+  if (size < 0) {
+    printf("save_snapshot error %ld\n", size);
+    unlink(path);
+    return -1;
+  }
+
+  err = snapshot.open(path);
+  unlink(path);
+  if (err)
+    return -1;
+
+  auto it = begin();
+  err = 0;
+  snapshot.for_each([&](unsigned long addr, payload_t payload,
+                        int8_t nid, int8_t location) {
+    if (err || it == end()
+        || it->addr != addr || it->payload != payload || it->nid != nid)
+      err = -1;
+    else
+      ++it;
+  });
+  if (err || it != end() || snapshot.size() != this->size()) {
+    printf("snapshot walk mismatch\n");
+    return -1;
+  }
+
+  err = loaded.load_snapshot(snapshot);
+  if (err) {
+    printf("load_snapshot error %d\n", err);
+    return -1;
+  }
+
+  it = begin();
+  for (auto& entry: loaded) {
+    if (it == end()
+        || it->addr != entry.addr
+        || it->payload != entry.payload
+        || it->nid != entry.nid) {
+      printf("load_snapshot mismatch\n");
+      return -1;
+    }
+    ++it;
+  }
+  if (it != end() || loaded.nr_walks != nr_walks) {
+    printf("load_snapshot mismatch at end\n");
+    return -1;
+  }
+
+  printf("snapshot: %lu addrs %lu clusters in %ld bytes\n",
+         this->size(), addr_clusters.size(), size);
+  return 0;
+}
+
+// const_iterator, seek() and split() should agree with get_next()
+int AddrSequence::do_self_test_iterator()
+{
+  std::vector<Entry> expect;
+  Entry e;
+  int err;
+
+  err = get_first(e.addr, e.payload, e.nid);
+  while (!err) {
+    expect.push_back(e);
+    err = get_next(e.addr, e.payload, e.nid);
+  }
+
+  size_t i = 0;
+  for (auto& entry: *this) {
+    if (i >= expect.size()
+        || entry.addr != expect[i].addr
+        || entry.payload != expect[i].payload
+        || entry.nid != expect[i].nid) {
+      printf("const_iterator mismatch at %lu\n", i);
+      return -1;
+    }
+    ++i;
+  }
+  if (i != expect.size()) {
+    printf("const_iterator walked %lu of %lu addrs\n", i, expect.size());
+    return -1;
+  }
+
+  for (int loop = 0; loop < 1000 && !expect.empty(); ++loop) {
+    unsigned long addr = expect[rand() % expect.size()].addr;
+
+    addr += (rand() % 3 - 1) * pagesize;
+    auto it = std::lower_bound(expect.begin(), expect.end(), addr,
+                          [](const Entry& a, unsigned long b) {
+                            return a.addr < b;
+                          });
+    auto cursor = seek(addr);
+    if (it == expect.end() ? cursor != end() : cursor->addr != it->addr) {
+      printf("seek(%lx) mismatch\n", addr);
+      return -1;
+    }
+  }
+
+  for (int n = 1; n <= 8; ++n) {
+      auto shards = split(n);
+
+    i = 0;
+    for (auto& shard: shards) {
+      unsigned long nr = 0;
+
+      for (auto& entry: shard) {
+        if (i >= expect.size() || entry.addr != expect[i].addr) {
+          printf("split(%d) mismatch at %lu\n", n, i);
+          return -1;
+        }
+        ++i;
+        ++nr;
+      }
+      if (nr != shard.size()) {
+        printf("split(%d) shard size %lu != %lu\n", n, nr, shard.size());
+        return -1;
+      }
+    }
+    if ((int)shards.size() > n || i != expect.size()) {
+      printf("split(%d) gave %lu shards covering %lu of %lu addrs\n",
+             n, shards.size(), i, expect.size());
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// a refill after clear() should be served from the chunks returned to the pool
+int AddrSequence::do_self_test_buf_pool()
+{
+  BufferPool& pool = get_buf_allocator();
+  unsigned long peak;
+
+  for (int round = 0; round < 3; ++round) {
+    clear();
+    set_pageshift(12);
+    rewind();
+    inc_payload_range(0x100000, 1UL << 20, 1);
+
+    if (round == 0)
+      peak = pool.get_peak();
+    else if (pool.get_peak() != peak) {
+      printf("buffer pool peak grew from %lu to %lu chunks in round %d\n",
+             peak, pool.get_peak(), round);
+      return -1;
+    }
+  }
+
+  clear();
+  if (pool.get_in_use()) {
+    printf("buffer pool leaked %lu chunks\n", pool.get_in_use());
+    return -1;
+  }
+
+  pool.show();
+  return 0;
+}
+
 int AddrSequence::do_self_test(unsigned long pagesize,
                                int max_loop,
                                bool is_perf)
 {
-  std::map<unsigned long, uint8_t> am;
+  std::map<unsigned long, payload_t> am;
   int err;
 
   //max_walks = 30; //rand() & 0xff;
@@ -568,7 +1762,7 @@ int test_static()
   AddrSequence  as;
   int rc;
   unsigned long addr;
-  uint8_t  payload;
+  payload_t  payload;
   int8_t  nid;
 
   as.set_pageshift(12);
@@ -637,6 +1831,225 @@ out:
   return rc;
 }
 
+// sequential vs. random order update throughput
+int AddrSequence::self_test_perf()
+{
+  std::vector<unsigned long> addrs;
+  unsigned long addr = 0x100000;
+  struct timeval ts1, ts2;
+  payload_t payload;
+  int8_t nid;
+  float secs;
+  int err;
+
+  clear();
+  set_pageshift(12);
+
+  rewind();
+  for (int i = 0; i < 1<<22; ++i) {
+    addr += ((rand() & 3) + 1) * pagesize;
+    inc_payload(addr, 1);
+  }
+
+  err = get_first(addr, payload, nid);
+  while (!err) {
+    addrs.push_back(addr);
+    err = get_next(addr, payload, nid);
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    if (i)
+      random_shuffle(addrs.begin(), addrs.end());
+
+    rewind();
+    gettimeofday(&ts1, NULL);
+    for (auto& a: addrs)
+      inc_payload(a, 1);
+    gettimeofday(&ts2, NULL);
+
+    secs = (ts2.tv_sec - ts1.tv_sec) + (ts2.tv_usec - ts1.tv_usec) * 0.000001;
+    printf("%-10s update: %lu addrs %lu clusters in %.3f seconds, %.2f M/s\n",
+           i ? "random" : "sequential",
+           addrs.size(), addr_clusters.size(), secs,
+           addrs.size() / (secs + 0.0000001) / 1000000);
+  }
+
+  return 0;
+}
+
+// walk bandwidth of AOS vs. SOA layout on a 50M pages sequence
+int AddrSequence::self_test_layout()
+{
+  const unsigned long nr_pages = 50UL << 20;
+  unsigned long refs[256];
+  unsigned long sum;
+  unsigned long addr;
+  unsigned long nr;
+  struct timeval ts1, ts2;
+  payload_t payload;
+  int8_t nid;
+  float secs;
+  int err;
+
+  for (int l: {LAYOUT_AOS, LAYOUT_SOA}) {
+    const char* name = l == LAYOUT_SOA ? "SOA" : "AOS";
+
+    clear();
+    set_layout(l);
+    set_pageshift(12);
+
+    srand(1);
+    rewind();
+    addr = 0x100000;
+    while (size() < nr_pages) {
+      addr += ((rand() & 0xf) + 1) * pagesize;
+      nr = std::min((unsigned long)(rand() & 0x3ff) + 1, nr_pages - size());
+      inc_payload_range(addr, nr, rand() & 1);
+      addr += nr * pagesize;
+    }
+
+    memset(refs, 0, sizeof(refs));
+    gettimeofday(&ts1, NULL);
+    err = get_first(addr, payload, nid);
+    while (!err) {
+      ++refs[payload];
+      err = get_next(addr, payload, nid);
+    }
+    gettimeofday(&ts2, NULL);
+    secs = (ts2.tv_sec - ts1.tv_sec) + (ts2.tv_usec - ts1.tv_usec) * 0.000001;
+    printf("%s get_next():         %lu pages in %.3f seconds, %'.0f MB/s\n",
+           name, size(), secs, size() * ITEM_SIZE / (secs + 0.0000001) / 1e6);
+
+    sum = 0;
+    gettimeofday(&ts1, NULL);
+    for_each_payload([&sum](payload_t payload, int8_t nid) {
+                       sum += payload + (nid < 0);
+                     });
+    gettimeofday(&ts2, NULL);
+    secs = (ts2.tv_sec - ts1.tv_sec) + (ts2.tv_usec - ts1.tv_usec) * 0.000001;
+    printf("%s for_each_payload(): %lu pages in %.3f seconds, %'.0f MB/s (sum %lu)\n",
+           name, size(), secs, size() * ITEM_SIZE / (secs + 0.0000001) / 1e6, sum);
+  }
+
+  clear();
+  set_layout(LAYOUT_AOS);
+  return 0;
+}
+
+// bytes per tracked page for runs of pages separated by random gaps
+int AddrSequence::self_test_density()
+{
+  struct {
+    const char*   name;
+    unsigned long nr_pages;
+    unsigned long max_run;
+    unsigned long min_gap;
+    unsigned long max_gap;
+  } layouts[] = {
+    { "dense",  8UL << 20, 1024, 1, 16 },        // THP-light heap
+    { "sparse", 1UL << 20, 8,    256, 65536 },   // 1MB-256MB gaps
+  };
+  unsigned long addr;
+  unsigned long nr;
+  unsigned long bytes;
+
+  for (auto& l: layouts) {
+    clear();
+    set_pageshift(12);
+    srand(1);
+    rewind();
+
+    addr = 0x100000;
+    while (size() < l.nr_pages) {
+      addr += (l.min_gap + rand() % (l.max_gap - l.min_gap + 1)) * pagesize;
+      nr = std::min(1 + rand() % l.max_run, l.nr_pages - size());
+      inc_payload_range(addr, nr, 1);
+      addr += nr * pagesize;
+    }
+
+    bytes = addr_clusters.size() * sizeof(AddrCluster)
+            + skip_table.size() * sizeof(unsigned long)
+            + far_deltas.size() * sizeof(FarDelta)
+            + size() * ITEM_SIZE;
+
+    printf("%-6s %8lu pages %8lu clusters %6.2f bytes/page (%6.2f in %lu buffers)\n",
+           l.name, size(), addr_clusters.size(),
+           (float)bytes / size(),
+           (float)(buf_pool.size() * BUF_SIZE) / size(), buf_pool.size());
+  }
+
+  clear();
+  return 0;
+}
+
+// refs histogram by get_next() vs. count_payloads()
+int AddrSequence::self_test_histogram()
+{
+  const unsigned long nr_pages = 50UL << 20;
+  const int max_value = 30;
+  std::vector<unsigned long> counts;
+  unsigned long addr;
+  unsigned long nr;
+  struct timeval ts1, ts2;
+  payload_t payload;
+  int8_t nid;
+  float secs;
+  int err;
+
+  for (int l: {LAYOUT_AOS, LAYOUT_SOA}) {
+    const char* name = l == LAYOUT_SOA ? "SOA" : "AOS";
+
+    clear();
+    set_layout(l);
+    set_pageshift(12);
+
+    // mostly idle runs with scattered young pages
+    srand(1);
+    for (int loop = 0; loop < 2; ++loop) {
+      rewind();
+      addr = 0x100000;
+      while (addr < 0x100000 + nr_pages * pagesize) {
+        addr += ((rand() & 0xf) + 1) * pagesize;
+        nr = (rand() & 0x3ff) + 1;
+        if (rand() & 3)
+          inc_payload_range(addr, nr, 0);
+        else
+          for (unsigned long i = 0; i < nr; ++i)
+            inc_payload(addr + i * pagesize, rand() & 1);
+        addr += nr * pagesize;
+      }
+    }
+
+    counts.assign(HIST_NIDS * (max_value + 1), 0);
+    gettimeofday(&ts1, NULL);
+    err = get_first(addr, payload, nid);
+    while (!err) {
+      if (nid < 0 || nid >= HIST_NIDS - 1)
+        nid = HIST_NIDS - 1;
+      ++counts[nid * (max_value + 1) + std::min((int)payload, max_value)];
+      err = get_next(addr, payload, nid);
+    }
+    gettimeofday(&ts2, NULL);
+    secs = (ts2.tv_sec - ts1.tv_sec) + (ts2.tv_usec - ts1.tv_usec) * 0.000001;
+    printf("%s get_next() histogram:     %lu pages in %.3f seconds\n",
+           name, size(), secs);
+
+    for (bool use_simd: {false, true}) {
+      counts.clear();
+      gettimeofday(&ts1, NULL);
+      count_payloads(counts, max_value, use_simd);
+      gettimeofday(&ts2, NULL);
+      secs = (ts2.tv_sec - ts1.tv_sec) + (ts2.tv_usec - ts1.tv_usec) * 0.000001;
+      printf("%s count_payloads() %-6s:  %lu pages in %.3f seconds\n",
+             name, use_simd ? "simd" : "scalar", size(), secs);
+    }
+  }
+
+  clear();
+  set_layout(LAYOUT_AOS);
+  return 0;
+}
+
 int main(int argc, char* argv[])
 {
   if (argc >= 2) {
@@ -644,6 +2057,22 @@ int main(int argc, char* argv[])
       AddrSequence as;
       return as.self_test();
     }
+    if (!strcmp(argv[1], "perf")) {
+      AddrSequence as;
+      return as.self_test_perf();
+    }
+    if (!strcmp(argv[1], "layout")) {
+      AddrSequence as;
+      return as.self_test_layout();
+    }
+    if (!strcmp(argv[1], "histogram")) {
+      AddrSequence as;
+      return as.self_test_histogram();
+    }
+    if (!strcmp(argv[1], "density")) {
+      AddrSequence as;
+      return as.self_test_density();
+    }
   }
 
   return test_static();
@@ -14,11 +14,21 @@
 #include <vector>
 #include <memory>
 #include <string.h>
+#include <stddef.h>
 
+#include "BufferPool.h"
+
+class AddrSequenceSnapshot;
+
+// wide enough for payloads of any supported width
+typedef uint16_t payload_t;
+
+// One item in LAYOUT_AOS. LAYOUT_SOA stores the same fields in
+// separate arrays, see AddrSequence::field_offset.
 struct DeltaPayload
 {
   uint8_t delta;    // in pagesize unit
-  uint8_t payload;  // stores refs count
+  uint8_t payload;  // stores refs count, low byte if 16 bit wide
   int8_t nid;
   int8_t location;  // in AEP or DRAM
 }__attribute__((packed));
@@ -27,7 +37,18 @@ struct AddrCluster
 {
   unsigned long start;
   int size;
-  DeltaPayload *deltas; // points into AddrSequence::bufs
+  int skip_index;       // first entry in AddrSequence::skip_table
+  uint8_t *deltas;      // points into AddrSequence::buf_pool
+  int far_index;        // first entry in AddrSequence::far_deltas
+};
+
+// Delta of an item too far from its previous neighbor for the 8bit
+// DeltaPayload::delta, which is then 0 (an escape, as only the first
+// item of a cluster may have delta 0).
+struct FarDelta
+{
+  int index;            // item index in cluster
+  uint32_t delta;       // in pagesize unit
 };
 
 // A sparse array for ordered addresses.
@@ -36,9 +57,13 @@ struct AddrCluster
 // Since addresses will have good spacial locality, organize them by clusters.
 // Each AddrCluster represents a range of addresses that are close enough to
 // each other, within 255 pages distance from prev/next neighbors, thus can be
-// encoded by 8bit delta to save space.
+// encoded by 8bit delta to save space. Far neighbors in sparse address
+// spaces stay in the same cluster, with their delta escaped to far_deltas.
 //
-// The addresses will be appended, updated or visited all sequentially.
+// The addresses will be appended and visited sequentially. Updates are
+// usually sequential too, however each cluster is indexed by its start
+// address plus a skip table of every SKIP_STRIDE items, so that any address
+// can be located in O(log clusters) time when updates come out of order.
 class AddrSequence
 {
   public:
@@ -49,6 +74,11 @@ class AddrSequence
         END_OF_SEQUENCE,
     };
 
+    enum layout {
+        LAYOUT_AOS,   // interleaved DeltaPayload items, the default
+        LAYOUT_SOA,   // delta/payload/nid/location arrays in each buffer
+    };
+
     enum {
         LOC_BEGIN,
         LOC_DRAM = LOC_BEGIN,
@@ -71,6 +101,26 @@ class AddrSequence
     void set_pageshift(int shift);
     void clear();
 
+    // only takes effect on an empty sequence, e.g. right after clear()
+    int set_layout(int new_layout);
+    int get_layout() const { return layout; }
+
+    // Bits of each payload, 8 or 16. The default 8 bit payloads saturate
+    // at 255 scans; 16 bit ones add a high byte array to each buffer and
+    // hold fewer items per buffer. Also only for an empty sequence.
+    int set_payload_width(int bits);
+    int get_payload_width() const { return payload_bytes * 8; }
+    int get_max_payload() const { return max_payload; }
+
+    // Keep a dirty score beside each payload: the number of walks the page
+    // was seen written, saturating at 255. Adds 1 byte per page. Also only
+    // for an empty sequence, and not kept in snapshots.
+    int set_dirty_tracking(bool on);
+    bool get_dirty_tracking() const { return dirty_bytes; }
+
+    // the BUF_SIZE chunks of all AddrSequence instances come from here
+    static BufferPool& get_buf_allocator();
+
     // call me before starting each walk
     int rewind();
 
@@ -88,15 +138,96 @@ class AddrSequence
     // - updating: for (nr_walks >= 2) walks
     // will do ++payload
     // will ignore addresses not already there
-    int inc_payload(unsigned long addr, int n);
+    //
+    // dirty=true also increases the dirty score with dirty tracking
+    int inc_payload(unsigned long addr, int n, bool dirty = false);
+
+    // same as calling inc_payload() for nr_pages consecutive pages
+    // starting from addr, but fills/updates the whole run in one go
+    int inc_payload_range(unsigned long addr, unsigned long nr_pages, int n,
+                          bool dirty = false);
     int set_payload(unsigned long addr, int n);
     int update_nodeid(unsigned long addr, int8_t nid, int8_t location);
     int smooth_payloads();
 
     // for sequential visiting
     bool prepare_get();
-    int get_first(unsigned long& addr, uint8_t& payload, int8_t& nid);
-    int get_next(unsigned long& addr, uint8_t& payload, int8_t& nid);
+    int get_first(unsigned long& addr, payload_t& payload, int8_t& nid);
+    int get_next(unsigned long& addr, payload_t& payload, int8_t& nid);
+
+    // Read only cursors, independent of the internal walk_iter/find_iter.
+    // Any number of them may walk the sequence concurrently, as long as
+    // no addr is added or updated meanwhile.
+    struct Entry {
+      unsigned long addr;
+      payload_t     payload;
+      int8_t        nid;
+      uint8_t       dirty;      // 0 without dirty tracking
+    };
+    class const_iterator;
+    class Shard;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    // positioned at the first addr >= the given one
+    const_iterator seek(unsigned long addr) const;
+    // at most n shards of whole clusters with about the same number of
+    // addrs each, for parallel consumers
+    std::vector<Shard> split(int n) const;
+
+    // visit (payload, nid) of all addrs without decoding the addresses,
+    // which in LAYOUT_SOA touches only the payload and nid arrays
+    template<class F>
+    void for_each_payload(F&& fn) const {
+      for (auto& cluster: addr_clusters) {
+        const uint8_t* payload = cluster.deltas + field_offset[FIELD_PAYLOAD];
+        const int8_t* nid = (const int8_t*)cluster.deltas + field_offset[FIELD_NID];
+
+        if (payload_bytes > 1 || dirty_bytes)
+          for (int i = 0; i < cluster.size; ++i)
+            fn(load_payload(cluster.deltas, i), nid[i * item_stride]);
+        else if (layout == LAYOUT_SOA)
+          for (int i = 0; i < cluster.size; ++i)
+            fn((payload_t)payload[i], nid[i]);
+        else
+          for (int i = 0; i < cluster.size; ++i)
+            fn((payload_t)payload[i * ITEM_SIZE], nid[i * ITEM_SIZE]);
+      }
+    }
+
+    // visit all addrs in order, fn(addr, payload) may modify the payload
+    template<class F>
+    void update_payloads(F&& fn) {
+      walk_iterator iter;
+      unsigned long addr;
+      payload_t payload;
+      int8_t nid;
+
+      if (addr_clusters.empty())
+        return;
+
+      reset_iterator(iter, 0);
+      while (!do_walk(iter, addr, payload, nid)) {
+        fn(addr, payload);
+        store_payload(iter.cur_delta_ptr, iter.delta_index, payload);
+        do_walk_move_next(iter);
+      }
+    }
+
+    // Write the sequence as one AddrSequenceSnapshot image at the current
+    // position of fd. Returns the image size or negative errno.
+    long save_snapshot(int fd) const;
+    // replace the sequence with the content of a snapshot image
+    int load_snapshot(const AddrSequenceSnapshot& snapshot);
+
+    // histogram of min(payload, max_value) for each nid, added into
+    // counts[nid * (max_value + 1) + payload]. nid < 0 is counted as
+    // nid HIST_NIDS - 1. Works on the cluster buffers directly, with an
+    // AVX2 kernel for runs of same (payload, nid) items when available.
+    const static int HIST_NIDS = 33;
+    void count_payloads(std::vector<unsigned long>& counts, int max_value);
+    // histogram of min(dirty score, max_dirty), added into counts[score]
+    void count_dirty(std::vector<unsigned long>& counts, int max_dirty) const;
 
     void set_user_flag(unsigned long bit) {
       user_flags |= (1UL << bit);
@@ -112,6 +243,18 @@ class AddrSequence
     int do_self_test(unsigned long pagesize, int max_loop, bool is_pref);
     int do_self_test_walk(unsigned long pagesize, bool is_perf);
     int do_self_test_compare(unsigned long pagesize, bool is_perf);
+    int do_self_test_random_update();
+    int do_self_test_range(int max_loop);
+    int do_self_test_buf_pool();
+    int do_self_test_iterator();
+    int self_test_perf();
+    int self_test_layout();
+    int do_self_test_histogram();
+    int self_test_histogram();
+    int self_test_density();
+    int do_self_test_snapshot();
+    int do_self_test_wide_payload();
+    int do_self_test_dirty();
 #endif
 
   private:
@@ -120,27 +263,103 @@ class AddrSequence
       unsigned long  cluster_iter_end;
       unsigned long  delta_sum;
       int            delta_index;
+      int            far_index;    // next far_deltas entry in cluster
+
+      const AddrCluster* cur_cluster_ptr;
+      uint8_t*       cur_delta_ptr;
+    };
 
-      AddrCluster*   cur_cluster_ptr;
-      DeltaPayload*  cur_delta_ptr;
+    enum {
+      FIELD_DELTA,
+      FIELD_PAYLOAD,
+      FIELD_NID,
+      FIELD_LOCATION,
+      FIELD_PAYLOAD_HI,   // only with 16 bit payloads
+      FIELD_DIRTY,        // only with dirty tracking
+      FIELD_MAX,
     };
 
-    int append_addr(unsigned long addr, int n);
-    int update_addr(unsigned long addr, int n, bool is_inc_payload);
+    uint8_t* item_field(uint8_t* base, int field, int index) const {
+      return base + field_offset[field] + index * item_stride;
+    }
+    uint8_t& delta_at(uint8_t* base, int index) const {
+      return *item_field(base, FIELD_DELTA, index);
+    }
+    uint8_t& payload_at(uint8_t* base, int index) const {
+      return *item_field(base, FIELD_PAYLOAD, index);
+    }
+    int8_t& nid_at(uint8_t* base, int index) const {
+      return *(int8_t*)item_field(base, FIELD_NID, index);
+    }
+    int8_t& location_at(uint8_t* base, int index) const {
+      return *(int8_t*)item_field(base, FIELD_LOCATION, index);
+    }
+    payload_t load_payload(uint8_t* base, int index) const {
+      payload_t payload = payload_at(base, index);
+
+      if (payload_bytes > 1)
+        payload |= *item_field(base, FIELD_PAYLOAD_HI, index) << 8;
+      return payload;
+    }
+    void store_payload(uint8_t* base, int index, payload_t payload) const {
+      payload_at(base, index) = payload;
+      if (payload_bytes > 1)
+        *item_field(base, FIELD_PAYLOAD_HI, index) = payload >> 8;
+    }
+    uint8_t load_dirty(uint8_t* base, int index) const {
+      return dirty_bytes ? *item_field(base, FIELD_DIRTY, index) : 0;
+    }
+
+    int append_addr(unsigned long addr, int n, bool dirty = false);
+    int append_addr_range(unsigned long addr, unsigned long nr_pages, int n,
+                          bool dirty);
+    int update_addr(unsigned long addr, int n, bool is_inc_payload,
+                    bool dirty = false);
+    int update_addr_range(unsigned long addr, unsigned long nr_pages, int n,
+                          bool dirty);
+
+    int do_find(walk_iterator& iter, unsigned long addr);
+    void seek_iterator(walk_iterator& iter, unsigned long addr) const;
+    void seek_in_cluster(walk_iterator& iter, unsigned long addr) const;
+    unsigned long far_end(unsigned long cluster_index) const;
+    unsigned long current_addr(const walk_iterator& iter) const {
+      return iter.cur_cluster_ptr->start +
+             ((iter.delta_sum + current_delta(iter)) << pageshift);
+    }
+    unsigned long current_delta(const walk_iterator& iter) const {
+      unsigned long delta = delta_at(iter.cur_delta_ptr, iter.delta_index);
+
+      if (!delta && iter.delta_index)
+        delta = far_deltas[iter.far_index].delta;
+      return delta;
+    }
 
-    int create_cluster(unsigned long addr, int n);
+    int create_cluster(unsigned long addr, int n, bool dirty);
     AddrCluster new_cluster(unsigned long addr, void* buffer);
-    int save_into_cluster(AddrCluster& cluster, unsigned long addr, int n);
+    int save_into_cluster(AddrCluster& cluster, unsigned long addr, int n,
+                          bool dirty);
+    int save_range_into_cluster(AddrCluster& cluster, unsigned long count,
+                                int n, bool dirty);
     bool can_merge_into_cluster(AddrCluster& cluster, unsigned long addr);
 
+    // number of private sub-histograms used by count_payloads(), to avoid
+    // stalls on back-to-back increments of the same counter
+    const static int NR_SUB_HIST = 4;
+    void count_cluster_scalar(AddrCluster& cluster, unsigned long* sub_hist,
+                              int from, int to, int max_value);
+    void count_cluster_avx2(AddrCluster& cluster, unsigned long* sub_hist,
+                            int max_value);
+    void count_payloads(std::vector<unsigned long>& counts, int max_value,
+                        bool use_simd);
+
     int get_free_buffer(void** free_ptr);
     int allocate_buf();
     void free_all_buf();
     int is_buffer_full() {
-      return buf_used_count == MAX_ITEM_COUNT;
+      return buf_used_count == max_item_count;
     }
 
-    void reset_iterator(walk_iterator& iter, unsigned long new_start) {
+    void reset_iterator(walk_iterator& iter, unsigned long new_start) const {
       iter.cluster_iter = new_start;
       iter.cluster_iter_end = addr_clusters.size();
       iter.delta_sum = 0;
@@ -152,21 +371,22 @@ class AddrSequence
 
     int in_append_period() { return nr_walks < 2; }
 
-    int  do_walk(walk_iterator& iter,
-                 unsigned long& addr, uint8_t& payload, int8_t& nid);
-    void do_walk_move_next(walk_iterator& iter);
+    int  do_walk(const walk_iterator& iter,
+                 unsigned long& addr, payload_t& payload, int8_t& nid) const;
+    void do_walk_move_next(walk_iterator& iter) const;
     void do_walk_update_payload(walk_iterator& iter,
-                                unsigned addr, uint8_t payload,
-                                bool is_inc_payload);
+                                unsigned addr, payload_t payload,
+                                bool is_inc_payload, bool dirty);
     void do_walk_update_nid(walk_iterator& iter,
                             unsigned addr,
                             int8_t nid, int8_t location);
 
     bool do_walk_continue(int rc) { return rc >=0 && rc != END_OF_SEQUENCE; }
 
-    void do_walk_update_current_ptr(walk_iterator& iter) {
+    void do_walk_update_current_ptr(walk_iterator& iter) const {
         iter.cur_cluster_ptr = &addr_clusters[iter.cluster_iter];
         iter.cur_delta_ptr = iter.cur_cluster_ptr->deltas;
+        iter.far_index = iter.cur_cluster_ptr->far_index;
     }
 
     void clear_location_count() {
@@ -175,8 +395,8 @@ class AddrSequence
     }
 
     void update_addr_location_count(walk_iterator& iter) {
-        int payload = iter.cur_delta_ptr[iter.delta_index].payload;
-        int location = iter.cur_delta_ptr[iter.delta_index].location;
+        int payload = load_payload(iter.cur_delta_ptr, iter.delta_index);
+        int location = location_at(iter.cur_delta_ptr, iter.delta_index);
 
         if (payload >= 1)
           young_bytes[location] += pagesize;
@@ -186,8 +406,17 @@ class AddrSequence
   private:
     const static int BUF_SIZE = 0x10000; // 64KB;
     const static int ITEM_SIZE = sizeof(struct DeltaPayload);
-    const static int MAX_ITEM_COUNT = BUF_SIZE / ITEM_SIZE;
     const static unsigned long MAX_DELTA_DIST = ( 1 << ( sizeof(uint8_t) * 8 ) ) - 1;
+    const static unsigned long MAX_FAR_DELTA_DIST = UINT32_MAX;
+    const static int SKIP_STRIDE = 64;
+
+    int layout;
+    int item_stride;                // bytes between 2 items of a field
+    int field_offset[FIELD_MAX];    // byte offset of each field in buffer
+    int payload_bytes;              // 1 or 2
+    int dirty_bytes;                // 0 or 1
+    int max_payload;                // payloads saturate here
+    int max_item_count;             // items per BUF_SIZE buffer
 
     int nr_walks;
     int pageshift;
@@ -198,11 +427,17 @@ class AddrSequence
 
     std::vector<AddrCluster>     addr_clusters;
 
+    // page offset from cluster start of item 0, SKIP_STRIDE, 2*SKIP_STRIDE...
+    // of each cluster, used by seek_iterator() for random access.
+    std::vector<unsigned long>   skip_table;
+
+    // deltas > MAX_DELTA_DIST, ordered by cluster and item index
+    std::vector<FarDelta>        far_deltas;
+
     // inc_payload() will allocate new fixed size buf on demand,
     // avoiding internal/external fragmentations.
-    // Only freed on clear().
-    std::allocator<DeltaPayload> buf_allocator;
-    std::vector<DeltaPayload*>   buf_pool;
+    // Only returned to the process wide get_buf_allocator() on clear().
+    std::vector<uint8_t*>        buf_pool;
     int buf_used_count;
 
     walk_iterator walk_iter;
@@ -211,11 +446,79 @@ class AddrSequence
     unsigned long last_cluster_end;
 
 #ifdef ADDR_SEQ_SELF_TEST
-    std::map<unsigned long, uint8_t> test_map;
+    std::map<unsigned long, payload_t> test_map;
 #endif
 
     unsigned long user_flags;
 };
 
+class AddrSequence::const_iterator
+{
+  public:
+    const Entry& operator*() const { return entry; }
+    const Entry* operator->() const { return &entry; }
+
+    const_iterator& operator++() {
+      seq->do_walk_move_next(iter);
+      load();
+      return *this;
+    }
+
+    bool operator==(const const_iterator& other) const {
+      return iter.cluster_iter == other.iter.cluster_iter &&
+             iter.delta_index == other.iter.delta_index;
+    }
+    bool operator!=(const const_iterator& other) const {
+      return !(*this == other);
+    }
+
+  private:
+    friend class AddrSequence;
+
+    // walks clusters [cluster, cluster_end)
+    const_iterator(const AddrSequence* s,
+                   unsigned long cluster, unsigned long cluster_end) : seq(s) {
+      iter.cluster_iter = cluster;
+      iter.cluster_iter_end = cluster_end;
+      iter.delta_sum = 0;
+      iter.delta_index = 0;
+      iter.far_index = 0;
+
+      if (cluster < cluster_end) {
+        seq->do_walk_update_current_ptr(iter);
+        load();
+      }
+    }
+
+    void load() {
+      if (iter.cluster_iter < iter.cluster_iter_end) {
+        seq->do_walk(iter, entry.addr, entry.payload, entry.nid);
+        entry.dirty = seq->load_dirty(iter.cur_delta_ptr, iter.delta_index);
+      }
+    }
+
+    const AddrSequence* seq;
+    walk_iterator       iter;
+    Entry               entry;
+};
+
+class AddrSequence::Shard
+{
+  public:
+    const_iterator begin() const { return first; }
+    const_iterator end() const { return last; }
+    unsigned long size() const { return nr_addrs; }
+
+  private:
+    friend class AddrSequence;
+
+    Shard(const const_iterator& f, const const_iterator& l, unsigned long n)
+      : first(f), last(l), nr_addrs(n) {}
+
+    const_iterator first;
+    const_iterator last;
+    unsigned long  nr_addrs;
+};
+
 #endif
 // vim:set ts=2 sw=2 et:
@@ -0,0 +1,150 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "AddrSequenceSnapshot.h"
+
+AddrSequenceSnapshot::AddrSequenceSnapshot()
+{
+  map_base = NULL;
+  map_size = 0;
+  header = NULL;
+}
+
+AddrSequenceSnapshot::~AddrSequenceSnapshot()
+{
+  close();
+}
+
+void AddrSequenceSnapshot::close()
+{
+  if (map_base)
+    munmap(map_base, map_size);
+
+  map_base = NULL;
+  map_size = 0;
+  header = NULL;
+}
+
+int AddrSequenceSnapshot::open(const char* path, size_t offset)
+{
+  struct stat st;
+  void* p;
+  int fd;
+  int err;
+
+  close();
+
+  fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return -errno;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    err = -errno;
+    ::close(fd);
+    return err;
+  }
+
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  err = -errno;
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    perror(path);
+    return err;
+  }
+
+  err = (size_t)st.st_size < offset ? -EINVAL :
+        attach((uint8_t*)p + offset, st.st_size - offset);
+  map_base = p;
+  map_size = st.st_size;
+  if (err) {
+    fprintf(stderr, "%s: invalid snapshot\n", path);
+    close();
+  }
+
+  return err;
+}
+
+int AddrSequenceSnapshot::attach(const void* base, size_t size)
+{
+  const uint8_t* p = (const uint8_t*)base;
+
+  if (size < sizeof(SnapshotHeader) || (unsigned long)p % 8)
+    return -EINVAL;
+
+  header = (const SnapshotHeader*)p;
+  if (validate(size)) {
+    header = NULL;
+    return -EINVAL;
+  }
+
+  clusters   = (const SnapshotCluster*)(p + header->clusters_offset);
+  far_deltas = (const FarDelta*)(p + header->far_deltas_offset);
+  deltas     = p + header->deltas_offset;
+  payloads   = p + header->payloads_offset;
+  nids       = (const int8_t*)(p + header->nids_offset);
+  locations  = (const int8_t*)(p + header->locations_offset);
+  payloads_hi = header->payload_bits > 8 ? p + header->payloads_hi_offset : NULL;
+
+  // the walk in for_each() relies on these
+  for (uint64_t i = 0; i < header->nr_clusters; ++i) {
+    const SnapshotCluster& c = clusters[i];
+
+    if (c.first_item + c.size > header->nr_items
+        || c.far_index > header->nr_far_deltas
+        || (i && c.far_index < clusters[i - 1].far_index)) {
+      header = NULL;
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+int AddrSequenceSnapshot::validate(size_t size)
+{
+  struct {
+    uint64_t offset;
+    uint64_t bytes;
+  } sections[] = {
+    { header->clusters_offset,   header->nr_clusters * sizeof(SnapshotCluster) },
+    { header->far_deltas_offset, header->nr_far_deltas * sizeof(FarDelta) },
+    { header->deltas_offset,     header->nr_items },
+    { header->payloads_offset,   header->nr_items },
+    { header->nids_offset,       header->nr_items },
+    { header->locations_offset,  header->nr_items },
+    { header->payloads_hi_offset,
+      header->payload_bits > 8 ? header->nr_items : 0 },
+  };
+
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic))
+      || header->version != SNAPSHOT_VERSION
+      || header->header_size != sizeof(SnapshotHeader)
+      || header->image_size > size
+      || header->nr_clusters > size
+      || header->nr_far_deltas > size
+      || header->nr_items > size
+      || (header->payload_bits != 8 && header->payload_bits != 16)
+      || header->pageshift < 12 || header->pageshift > 30)
+    return -1;
+
+  for (auto& s: sections)
+    if (s.offset % 8
+        || s.offset > header->image_size
+        || s.bytes > header->image_size - s.offset)
+      return -1;
+
+  return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#ifndef AEP_ADDR_SEQUENCE_SNAPSHOT_H
+#define AEP_ADDR_SEQUENCE_SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "AddrSequence.h"
+
+// On-disk image of an AddrSequence, written by AddrSequence::save_snapshot().
+//
+// Every section is an array of fixed size records at an 8 byte aligned
+// offset from the image start, so a mmap'ed image can be walked in place.
+// Item fields are stored as separate arrays regardless of the in memory
+// layout. 16 bit payloads keep their high bytes in one more array.
+#define SNAPSHOT_MAGIC    "AEPASEQ"
+#define SNAPSHOT_VERSION  2
+
+struct SnapshotHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  int32_t  pageshift;
+  int32_t  nr_walks;
+  int32_t  payload_bits;        // 8 or 16
+  int32_t  reserved;
+  uint64_t nr_clusters;
+  uint64_t nr_items;
+  uint64_t nr_far_deltas;
+  uint64_t clusters_offset;     // SnapshotCluster[nr_clusters]
+  uint64_t far_deltas_offset;   // FarDelta[nr_far_deltas]
+  uint64_t deltas_offset;       // uint8_t[nr_items]
+  uint64_t payloads_offset;     // uint8_t[nr_items]
+  uint64_t nids_offset;         // int8_t[nr_items]
+  uint64_t locations_offset;    // int8_t[nr_items]
+  uint64_t payloads_hi_offset;  // uint8_t[nr_items] if payload_bits == 16
+  uint64_t image_size;
+};
+
+struct SnapshotCluster
+{
+  uint64_t start;
+  uint64_t first_item;          // index into the item field arrays
+  uint32_t size;
+  uint32_t far_index;           // first entry in far deltas
+};
+
+class AddrSequenceSnapshot
+{
+  public:
+    AddrSequenceSnapshot();
+    ~AddrSequenceSnapshot();
+
+    // map the image at offset of a file
+    int open(const char* path, size_t offset = 0);
+    // use an image inside memory owned by the caller
+    int attach(const void* base, size_t size);
+    void close();
+
+    int get_pageshift() const { return header->pageshift; }
+    int get_nr_walks() const { return header->nr_walks; }
+    int get_payload_width() const { return header->payload_bits; }
+    unsigned long size() const { return header->nr_items; }
+    unsigned long get_image_size() const { return header->image_size; }
+
+    // fn(addr, payload, nid, location) for each addr in order
+    template<class F>
+    void for_each(F&& fn) const {
+      for (uint64_t c = 0; c < header->nr_clusters; ++c) {
+        const SnapshotCluster& cluster = clusters[c];
+        const FarDelta* far = far_deltas + cluster.far_index;
+        const FarDelta* far_end = far_deltas + (c + 1 < header->nr_clusters ?
+                                                clusters[c + 1].far_index :
+                                                header->nr_far_deltas);
+        unsigned long offset = 0;
+
+        for (uint32_t i = 0; i < cluster.size; ++i) {
+          uint64_t item = cluster.first_item + i;
+          unsigned long delta = deltas[item];
+
+          if (!delta && i && far < far_end)
+            delta = (far++)->delta;
+          offset += delta;
+
+          payload_t payload = payloads[item];
+
+          if (payloads_hi)
+            payload |= payloads_hi[item] << 8;
+
+          fn(cluster.start + (offset << header->pageshift),
+             payload, nids[item], locations[item]);
+        }
+      }
+    }
+
+  private:
+    int validate(size_t size);
+
+  private:
+    void*   map_base;
+    size_t  map_size;
+
+    const SnapshotHeader*  header;
+    const SnapshotCluster* clusters;
+    const FarDelta*        far_deltas;
+    const uint8_t*         deltas;
+    const uint8_t*         payloads;
+    const int8_t*          nids;
+    const int8_t*          locations;
+    const uint8_t*         payloads_hi;   // NULL for 8 bit payloads
+};
+
+#endif
+// vim:set ts=2 sw=2 et:
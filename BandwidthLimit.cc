@@ -20,32 +20,38 @@ const float BandwidthLimit::MAX_TIME_HISTORY = 3;
 void BandwidthLimit::add_and_sleep(unsigned long bytes)
 {
   float time_delta;
+  float sleep_time = 0;
   timeval cur_time;
 
   if (0 == bwlimit_byteps)
     return;
 
-  if (!last_time.tv_sec && !last_time.tv_usec) {
-    allow_bytes = 0;
-    gettimeofday(&last_time, NULL);
-    return;
-  }
+  {
+    std::lock_guard<std::mutex> lock(mlock);
 
-  std::unique_lock<std::mutex> lock(mlock);
+    if (!last_time.tv_sec && !last_time.tv_usec) {
+      allow_bytes = 0;
+      gettimeofday(&last_time, NULL);
+      return;
+    }
 
-  gettimeofday(&cur_time, NULL);
-  time_delta = tv_secs(last_time, cur_time);
-  if (time_delta > MAX_TIME_HISTORY)
-    time_delta = MAX_TIME_HISTORY;
+    gettimeofday(&cur_time, NULL);
+    time_delta = tv_secs(last_time, cur_time);
+    if (time_delta > MAX_TIME_HISTORY)
+      time_delta = MAX_TIME_HISTORY;
 
-  last_time = cur_time;
+    last_time = cur_time;
 
-  allow_bytes += time_delta * bwlimit_byteps;
-  allow_bytes -= bytes;
+    allow_bytes += time_delta * bwlimit_byteps;
+    allow_bytes -= bytes;
+
+    if (allow_bytes < 0)
+      sleep_time = ((-allow_bytes) / bwlimit_byteps) * 1000000;
+  }
 
-  if (allow_bytes < 0) {
-    float sleep_time;
-    sleep_time = ((-allow_bytes) / bwlimit_byteps) * 1000000;
+  // sleep unlocked, so the other threads keep accounting their moves
+  // and sleep for them in parallel
+  if (sleep_time > 0) {
     //printf("thread will sleep %f microseconds\n", sleep_time);
     usleep(sleep_time);
   }
@@ -0,0 +1,121 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "BufferPool.h"
+
+BufferPool::BufferPool(size_t size) : chunk_size(size)
+{
+}
+
+BufferPool::~BufferPool()
+{
+  for (auto& r : regions)
+    munmap(r, REGION_SIZE);
+}
+
+void BufferPool::set_backing(int b)
+{
+  std::lock_guard<std::mutex> guard(mlock);
+
+  backing = b;
+}
+
+uint8_t* BufferPool::allocate()
+{
+  std::lock_guard<std::mutex> guard(mlock);
+  uint8_t* chunk;
+
+  if (free_chunks.empty() && map_region() < 0)
+    return NULL;
+
+  chunk = free_chunks.back();
+  free_chunks.pop_back();
+
+  if (++nr_in_use > nr_peak)
+    nr_peak = nr_in_use;
+
+  return chunk;
+}
+
+void BufferPool::deallocate(uint8_t* chunk)
+{
+  std::lock_guard<std::mutex> guard(mlock);
+
+  free_chunks.push_back(chunk);
+  --nr_in_use;
+}
+
+void* BufferPool::mmap_aligned(size_t size, int flags)
+{
+  uint8_t* p;
+  uint8_t* aligned;
+
+  // over-map so that THP can back the whole region
+  p = (uint8_t*)mmap(NULL, size * 2, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  if (p == MAP_FAILED)
+    return MAP_FAILED;
+
+  aligned = (uint8_t*)(((unsigned long)p + size - 1) & ~(size - 1));
+  if (aligned > p)
+    munmap(p, aligned - p);
+  munmap(aligned + size, p + size - aligned);
+
+  return aligned;
+}
+
+int BufferPool::map_region()
+{
+  void* p = MAP_FAILED;
+
+  if (backing == BACKING_HUGETLB) {
+    p = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+      ++nr_hugetlb_regions;
+  }
+
+  if (p == MAP_FAILED)
+    p = mmap_aligned(REGION_SIZE, 0);
+
+  if (p == MAP_FAILED) {
+    perror("BufferPool mmap");
+    return -ENOMEM;
+  }
+
+#ifdef MADV_HUGEPAGE
+  if (backing != BACKING_NORMAL)
+    madvise(p, REGION_SIZE, MADV_HUGEPAGE);
+#endif
+
+  regions.push_back((uint8_t*)p);
+  for (size_t off = REGION_SIZE; off >= chunk_size; off -= chunk_size)
+    free_chunks.push_back((uint8_t*)p + off - chunk_size);
+
+  return 0;
+}
+
+unsigned long BufferPool::get_mapped_bytes()
+{
+  std::lock_guard<std::mutex> guard(mlock);
+
+  return regions.size() * REGION_SIZE;
+}
+
+void BufferPool::show()
+{
+  std::lock_guard<std::mutex> guard(mlock);
+
+  printf("buffer pool: in use %lu KB  peak %lu KB  mapped %lu KB (%lu hugetlb regions)\n",
+         nr_in_use * chunk_size >> 10,
+         nr_peak * chunk_size >> 10,
+         regions.size() * REGION_SIZE >> 10,
+         nr_hugetlb_regions);
+}
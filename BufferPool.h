@@ -0,0 +1,64 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#ifndef AEP_BUFFER_POOL_H
+#define AEP_BUFFER_POOL_H
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+// Process wide slab pool of fixed size chunks.
+//
+// Chunks are carved out of 2MB mmap regions, which may be backed by
+// hugetlbfs pages or THP. Freed chunks go back to a free list and are
+// handed out again on the next round; regions are never unmapped, so
+// the mapped size stays at the high-water mark of the process.
+class BufferPool
+{
+  public:
+    enum backing {
+      BACKING_NORMAL,
+      BACKING_THP,      // madvise(MADV_HUGEPAGE)
+      BACKING_HUGETLB,  // MAP_HUGETLB, falls back to THP
+    };
+
+    BufferPool(size_t chunk_size);
+    ~BufferPool();
+
+    uint8_t* allocate();
+    void deallocate(uint8_t* chunk);
+
+    // only affects regions mapped afterwards
+    void set_backing(int backing);
+
+    size_t get_chunk_size()       { return chunk_size; }
+    unsigned long get_in_use()    { return nr_in_use; }
+    unsigned long get_peak()      { return nr_peak; }
+    unsigned long get_mapped_bytes();
+    void show();
+
+  private:
+    int map_region();
+    void* mmap_aligned(size_t size, int flags);
+
+  private:
+    static const size_t REGION_SIZE = 2UL << 20;
+
+    std::mutex mlock;
+    size_t chunk_size;
+    int backing = BACKING_NORMAL;
+
+    std::vector<uint8_t*> free_chunks;
+    std::vector<uint8_t*> regions;
+    unsigned long nr_hugetlb_regions = 0;
+
+    unsigned long nr_in_use = 0;
+    unsigned long nr_peak = 0;
+};
+
+#endif
+// vim:set ts=2 sw=2 et:
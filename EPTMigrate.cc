@@ -16,6 +16,7 @@
 #include <string>
 #include <iostream>
 #include <algorithm>
+#include <numeric>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -30,6 +31,7 @@
 #include "lib/stats.h"
 #include "AddrSequence.h"
 #include "VMAInspect.h"
+#include "IdleTrace.h"
 #include "Numa.h"
 #include "BandwidthLimit.h"
 
@@ -67,6 +69,7 @@ void MigrateStats::show(Formatter& fmt, int mwhat)
             skip_kb, percent(skip_kb, to_move_kb), type);
   fmt.print("migrate successful: %'11lu %3d%% of %4s pages\n",
             move_kb, percent(move_kb, to_move_kb), type);
+  page_calls.show(fmt, "move_pages:");
 
   if (option.debug_move_pages)
     show_move_state(fmt);
@@ -167,7 +170,7 @@ int EPTMigrate::select_top_pages(ProcIdlePageType type)
   int min_refs;
   int max_refs;
   unsigned long addr;
-  uint8_t ref_count;
+  payload_t ref_count;
   int8_t unused_nid;
   int iter_ret;
 
@@ -218,14 +221,27 @@ int EPTMigrate::migrate()
   if (policy.placement == PLACEMENT_DRAM)
     return 0;
 
+  // the traced pids are gone, or are some other tasks by now
+  if (IdleTrace::get_source())
+    return 0;
+
+  gettimeofday(&ts_migrate_begin, NULL);
+
   fmt.clear();
   fmt.reserve(1<<10);
 
+  for (auto& moved: moved_pages)
+    moved.clear();
+
   for (int i = COLD_MIGRATE; i < MAX_MIGRATE; ++i) {
     page_migrate_stats[i].clear();
     update_migrate_state(i);
   }
 
+  // the nids found by the first walk of the round are too old
+  if (option.migrate_nid_max_age > 0 && !is_nids_trusted())
+    get_memory_type();
+
   for (auto& type : {PTE_ACCESSED, PMD_ACCESSED}) {
     if (!parameter[type].enabled) {
       printf("Skip %s migration: %s\n",
@@ -248,6 +264,8 @@ int EPTMigrate::migrate()
   if (!fmt.empty())
     std::cout << fmt.str();
 
+  gettimeofday(&ts_migrate_end, NULL);
+
   return err;
 }
 
@@ -281,6 +299,17 @@ long EPTMigrate::do_move_pages(ProcIdlePageType type)
   return ret;
 }
 
+bool EPTMigrate::is_nids_trusted()
+{
+  struct timeval now;
+
+  if (option.migrate_nid_max_age <= 0 || !nids_time.tv_sec)
+    return false;
+
+  gettimeofday(&now, NULL);
+  return tv_secs(nids_time, now) <= option.migrate_nid_max_age;
+}
+
 unsigned long EPTMigrate::calc_numa_anon_capacity(ProcIdlePageType type,
                                                   ProcVmstat& proc_vmstat)
 {
@@ -301,13 +330,19 @@ unsigned long EPTMigrate::calc_numa_anon_capacity(ProcIdlePageType type,
   return sum;
 }
 
+// With option.dirty_min_refs, write-hot PMEM pages at the hot threshold
+// go first into the promote_remain quota, the clean ones get what's left
+// in address order; write-hot DRAM pages are never demoted.
 int EPTMigrate::promote_and_demote(ProcIdlePageType type)
 {
   unsigned long addr;
-  uint8_t refs;
+  payload_t refs;
   int8_t  nid;
   int ret = -1;
   bool refs_in_range;
+  bool write_hot;
+  int dirty_min_refs = option.dirty_min_refs;
+  std::vector<std::pair<unsigned long, int8_t>> clean_promote;
 
   long nr_promote = parameter[type].nr_promote;
   long nr_demote = parameter[type].nr_demote;
@@ -315,6 +350,9 @@ int EPTMigrate::promote_and_demote(ProcIdlePageType type)
   std::vector<void*> addr_array_2d[MAX_MIGRATE];
   std::vector<int> target_nid_2d[MAX_MIGRATE];
   std::vector<int> from_nid_2d[MAX_MIGRATE];
+  // with option.migrate_by_hotness
+  std::vector<payload_t> refs_2d[MAX_MIGRATE];
+  bool by_hotness = option.migrate_by_hotness;
 
   AddrSequence& page_refs
       = get_pagetype_refs(type).page_refs;
@@ -330,38 +368,72 @@ int EPTMigrate::promote_and_demote(ProcIdlePageType type)
     target_nid_2d[COLD_MIGRATE].reserve(nr_demote);
   }
 
-  ret = page_refs.get_first(addr, refs, nid);
-  while(!ret) {
+  if (dirty_min_refs > 0 && parameter[type].promote_remain > 0)
+    clean_promote.reserve(parameter[type].promote_remain);
+
+  for (auto& entry: page_refs) {
+    addr = entry.addr;
+    refs = entry.payload;
+    nid = entry.nid;
+    write_hot = dirty_min_refs > 0 && entry.dirty >= dirty_min_refs;
 
     if (!numa_collection->is_valid_nid(nid))
-      goto next;
+      continue;
 
     if (numa_collection->get_node(nid)->is_pmem()) {
       refs_in_range = refs > parameter[type].hot_threshold
                       && refs <= parameter[type].hot_threshold_max;
-      if ((refs == parameter[type].hot_threshold
+      if (refs == parameter[type].hot_threshold && dirty_min_refs > 0
+          && !write_hot) {
+        if (clean_promote.size() < clean_promote.capacity())
+          clean_promote.emplace_back(addr, nid);
+        continue;
+      }
+      if (((refs == parameter[type].hot_threshold
           && parameter[type].promote_remain-- > 0)
           || refs_in_range)
-        save_migrate_parameter((void*)addr, nid,
-                               addr_array_2d[HOT_MIGRATE],
-                               from_nid_2d[HOT_MIGRATE],
-                               target_nid_2d[HOT_MIGRATE]);
+          && !save_migrate_parameter((void*)addr, nid,
+                                     addr_array_2d[HOT_MIGRATE],
+                                     from_nid_2d[HOT_MIGRATE],
+                                     target_nid_2d[HOT_MIGRATE])
+          && by_hotness)
+        refs_2d[HOT_MIGRATE].push_back(refs);
 
     } else {
+      if (write_hot)
+        continue;
+
       refs_in_range = refs < parameter[type].cold_threshold
                       && refs >= parameter[type].cold_threshold_min;
 
-      if ((refs == parameter[type].cold_threshold
+      if (((refs == parameter[type].cold_threshold
           && parameter[type].demote_remain-- > 0)
           || refs_in_range)
-        save_migrate_parameter((void*)addr, nid,
-                               addr_array_2d[COLD_MIGRATE],
-                               from_nid_2d[COLD_MIGRATE],
-                               target_nid_2d[COLD_MIGRATE]);
+          && !save_migrate_parameter((void*)addr, nid,
+                                     addr_array_2d[COLD_MIGRATE],
+                                     from_nid_2d[COLD_MIGRATE],
+                                     target_nid_2d[COLD_MIGRATE])
+          && by_hotness)
+        refs_2d[COLD_MIGRATE].push_back(refs);
 
     }
-next:
-    ret = page_refs.get_next(addr, refs, nid);
+  }
+
+  for (auto& page: clean_promote) {
+    if (parameter[type].promote_remain-- <= 0)
+      break;
+    if (!save_migrate_parameter((void*)page.first, page.second,
+                                addr_array_2d[HOT_MIGRATE],
+                                from_nid_2d[HOT_MIGRATE],
+                                target_nid_2d[HOT_MIGRATE])
+        && by_hotness)
+      refs_2d[HOT_MIGRATE].push_back(parameter[type].hot_threshold);
+  }
+
+  if (by_hotness) {
+    for (int i = 0; i < MAX_MIGRATE; ++i)
+      sort_by_hotness(i, refs_2d[i], addr_array_2d[i],
+                      from_nid_2d[i], target_nid_2d[i]);
   }
 
   ret = do_interleave_move_pages(type,
@@ -380,6 +452,39 @@ next:
   return ret;
 }
 
+// Stable sort by refs keeps the address order of the pages of each refs
+// bucket, and the write-hot ones first among those at the hot threshold.
+void EPTMigrate::sort_by_hotness(int migrate_type,
+                                 const std::vector<payload_t>& refs,
+                                 std::vector<void*>& addr_array,
+                                 std::vector<int>& from_nid_array,
+                                 std::vector<int>& target_nid_array)
+{
+  std::vector<size_t> order(refs.size());
+  std::vector<void*> addrs;
+  std::vector<int> from_nids;
+  std::vector<int> target_nids;
+
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return migrate_type == HOT_MIGRATE ? refs[a] > refs[b]
+                                       : refs[a] < refs[b];
+  });
+
+  addrs.reserve(order.size());
+  from_nids.reserve(order.size());
+  target_nids.reserve(order.size());
+  for (auto i: order) {
+    addrs.push_back(addr_array[i]);
+    from_nids.push_back(from_nid_array[i]);
+    target_nids.push_back(target_nid_array[i]);
+  }
+
+  addr_array.swap(addrs);
+  from_nid_array.swap(from_nids);
+  target_nid_array.swap(target_nids);
+}
+
 int EPTMigrate::save_migrate_parameter(void* addr, int nid,
                                         std::vector<void*>& addr_array,
                                         std::vector<int>& from_nid_array,
@@ -436,14 +541,18 @@ int EPTMigrate::do_interleave_move_pages(ProcIdlePageType type,
       if (i < addr[migrate_type].size()) {
 
         count = std::min(batch_size, addr[migrate_type].size() - i);
-        page_migrator[migrate_type].move_pages(&addr[migrate_type][i],
-                                               &target_nid[migrate_type][i],
-                                               count);
-        page_migrate_stats[migrate_type]
-            .save_migrate_states(pagetype_shift[type],
-                                 &from_nid[migrate_type][i],
-                                 &target_nid[migrate_type][i],
-                                 page_migrator[migrate_type].get_migration_result());
+        if (scheduler)
+          schedule_move_batch(type, migrate_type,
+                              &addr[migrate_type][i],
+                              &from_nid[migrate_type][i],
+                              &target_nid[migrate_type][i],
+                              count);
+        else
+          move_batch(type, migrate_type,
+                     &addr[migrate_type][i],
+                     &from_nid[migrate_type][i],
+                     &target_nid[migrate_type][i],
+                     count);
       }
 
       if (throttler)
@@ -455,6 +564,95 @@ int EPTMigrate::do_interleave_move_pages(ProcIdlePageType type,
   return 0;
 }
 
+unsigned long EPTMigrate::move_batch(ProcIdlePageType type, int migrate_type,
+                                     void** addrs, int* from_nid,
+                                     int* target_nid, long count)
+{
+  MovePages& migrator = page_migrator[migrate_type];
+  unsigned long last_move_kb = page_migrate_stats[migrate_type].move_kb;
+
+  migrator.move_pages_by_node(addrs, target_nid, count);
+  migrator.take_call_stats(&page_migrate_stats[migrate_type]);
+
+  if (record_moved) {
+    auto& result = migrator.get_migration_result();
+    auto& moved = moved_pages[pagetype_index[type]];
+
+    for (long j = 0; j < count; ++j)
+      if (result[j] == target_nid[j])
+        moved.emplace_back((unsigned long)addrs[j], result[j]);
+  }
+
+  page_migrate_stats[migrate_type]
+      .save_migrate_states(pagetype_shift[type],
+                           from_nid, target_nid,
+                           migrator.get_migration_result());
+
+  return (page_migrate_stats[migrate_type].move_kb - last_move_kb) << 10;
+}
+
+// Move the pages of each (from, target) node pair of the batch in a
+// slot of the scheduler, in address order within the pair.
+void EPTMigrate::schedule_move_batch(ProcIdlePageType type, int migrate_type,
+                                     void** addrs, int* from_nid,
+                                     int* target_nid, long count)
+{
+  std::map<std::pair<int, int>, std::vector<long>> pair_pages;
+  std::vector<void*> pair_addrs;
+  std::vector<int> pair_from;
+  std::vector<int> pair_target;
+  unsigned long bytes;
+
+  for (long i = 0; i < count; ++i)
+    pair_pages[{from_nid[i], target_nid[i]}].push_back(i);
+
+  for (auto& kv : pair_pages) {
+    pair_addrs.clear();
+    pair_from.clear();
+    pair_target.clear();
+    for (long i : kv.second) {
+      pair_addrs.push_back(addrs[i]);
+      pair_from.push_back(from_nid[i]);
+      pair_target.push_back(target_nid[i]);
+    }
+
+    scheduler->acquire(kv.first.first, kv.first.second);
+    bytes = move_batch(type, migrate_type, &pair_addrs[0],
+                       &pair_from[0], &pair_target[0], pair_addrs.size());
+    scheduler->release(kv.first.first, kv.first.second, bytes);
+  }
+}
+
+void EPTMigrate::apply_moved_pages(EPTMigrate& last)
+{
+  NumaNode* node;
+
+  for (auto& type : {PTE_ACCESSED, PMD_ACCESSED}) {
+    auto& moved = last.moved_pages[pagetype_index[type]];
+    AddrSequence& page_refs = get_pagetype_refs(type).page_refs;
+
+    if (moved.empty() || page_refs.empty())
+      continue;
+
+    // find_iter only seeks forward
+    sort(moved.begin(), moved.end());
+    page_refs.prepare_update();
+
+    for (auto& page : moved) {
+      if (page.first < va_start || page.first >= va_end)
+        continue;
+
+      node = numa_collection->get_node(page.second);
+      if (!node)
+        continue;
+
+      page_refs.update_nodeid(page.first, page.second,
+                              node->is_pmem() ? AddrSequence::LOC_PMEM
+                                              : AddrSequence::LOC_DRAM);
+    }
+  }
+}
+
 void EPTMigrate::setup_migrator(ProcIdlePageType type, MovePages& migrator)
 {
   migrator.set_pid(pid);
@@ -536,7 +734,7 @@ int EPTMigrate::normalize_addr_sequence(AddrSequence& addr_seq, long hot_thresho
   int rc;
   unsigned long addr;
   int8_t unused_nid;
-  uint8_t count, new_payload;
+  payload_t count, new_payload;
 
   // this is the only flag defined so far
   // Let's move this into a common header if we need
@@ -559,3 +757,166 @@ int EPTMigrate::normalize_addr_sequence(AddrSequence& addr_seq, long hot_thresho
   addr_seq.set_user_flag(FLAG_NORMALIZED);
   return 0;
 }
+
+#ifdef EPT_MIGRATE_SELF_TEST
+
+#include <thread>
+
+#define EPT_MIGRATE_CHECK(cond)                                      \
+  if (!(cond)) {                                                     \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);  \
+    return -1;                                                       \
+  }
+
+Option option;
+
+int debug_level()
+{
+  return option.debug_level;
+}
+
+// Append the pages of buf to the 4K page refs of range, as walked once
+// with none accessed
+static void walk_pages(EPTMigrate& range, char* buf, int nr_pages)
+{
+  AddrSequence& page_refs = range.get_pagetype_refs(PTE_ACCESSED).page_refs;
+
+  range.set_pid(getpid());
+  range.set_va_range((unsigned long)buf,
+                     (unsigned long)buf + (nr_pages << PAGE_SHIFT));
+  range.prepare_walks(1);
+  page_refs.rewind();
+  page_refs.inc_payload_range((unsigned long)buf, nr_pages, 0);
+}
+
+// Migrate our own pages on a thread as migrate_async does, while the
+// next round walks them, then apply the moves to the next round. The
+// pages go to another node when there is one, else to the node they
+// are on.
+static int self_test_moved_pages()
+{
+  const int nr_pages = 256;
+  NumaNodeCollection numa_collection;
+  NumaHWConfig numa_config;
+  EPTMigrate range;
+  EPTMigrate next_range;
+  std::vector<int> status(1);
+  void* addr;
+  char* buf;
+  int nid;
+  int target_nid;
+  int err = 0;
+
+  buf = (char*)mmap(NULL, nr_pages << PAGE_SHIFT, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  EPT_MIGRATE_CHECK(buf != MAP_FAILED);
+  for (int i = 0; i < nr_pages; ++i)
+    buf[i << PAGE_SHIFT] = i;
+
+  addr = buf;
+  EPT_MIGRATE_CHECK(!::move_pages(0, 1, &addr, NULL, &status[0], 0));
+  nid = status[0];
+  EPT_MIGRATE_CHECK(nid >= 0);
+
+  target_nid = nid;
+  for (int n = 0; n <= numa_max_node(); ++n)
+    if (n != nid && numa_bitmask_isbitset(numa_all_nodes_ptr, n))
+      target_nid = n;
+
+  // all DRAM, demoting from the node of buf to target_nid
+  numa_config.numa_dram_list = "0-" + std::to_string(numa_max_node());
+  numa_config.numa_pmem_list = numa_config.numa_dram_list;
+  numa_config.pmem_dram_map = std::to_string(nid) + "->" +
+                              std::to_string(target_nid);
+  numa_collection.collect(&numa_config, NULL);
+
+  walk_pages(range, buf, nr_pages);
+  range.set_numacollection(&numa_collection);
+  range.get_memory_type();
+  range.parameter[PTE_ACCESSED].clear();
+  range.parameter[PTE_ACCESSED].enabled = true;
+  range.parameter[PTE_ACCESSED].cold_threshold = 1;
+  range.parameter[PTE_ACCESSED].nr_demote = nr_pages;
+  range.set_record_moved(true);
+
+  std::thread migration([&range, &err] { err = range.migrate(); });
+
+  // nids of the next round as walked meanwhile: not looked up yet
+  walk_pages(next_range, buf, nr_pages);
+  next_range.set_numacollection(&numa_collection);
+  migration.join();
+  EPT_MIGRATE_CHECK(!err);
+  // pages already on the target node are not counted as moved
+  MigrateStats& stats = range.get_migrate_stats(COLD_MIGRATE);
+  EPT_MIGRATE_CHECK(stats.to_move_kb ==
+                    (unsigned long)nr_pages << (PAGE_SHIFT - 10));
+  EPT_MIGRATE_CHECK(stats.move_kb == (target_nid != nid ? stats.to_move_kb : 0));
+
+  for (auto& entry: next_range.get_pagetype_refs(PTE_ACCESSED).page_refs)
+    EPT_MIGRATE_CHECK(entry.nid != target_nid);
+
+  next_range.apply_moved_pages(range);
+
+  int nr = 0;
+  for (auto& entry: next_range.get_pagetype_refs(PTE_ACCESSED).page_refs) {
+    EPT_MIGRATE_CHECK(entry.addr == (unsigned long)buf + (nr << PAGE_SHIFT));
+    EPT_MIGRATE_CHECK(entry.nid == target_nid);
+    ++nr;
+  }
+  EPT_MIGRATE_CHECK(nr == nr_pages);
+
+  for (int i = 0; i < nr_pages; ++i) {
+    addr = buf + (i << PAGE_SHIFT);
+    EPT_MIGRATE_CHECK(!::move_pages(0, 1, &addr, NULL, &status[0], 0));
+    EPT_MIGRATE_CHECK(status[0] == target_nid);
+  }
+
+  munmap(buf, nr_pages << PAGE_SHIFT);
+  return 0;
+}
+
+int EPTMigrate::self_test()
+{
+  // candidates in the order collected, pages of the same refs are
+  // expected to keep it
+  const std::vector<payload_t> refs = {3, 5, 5, 1, 5, 3};
+  const std::vector<int> hot_order = {1, 2, 4, 0, 5, 3};
+  const std::vector<int> cold_order = {3, 0, 5, 1, 2, 4};
+
+  for (int migrate_type: {HOT_MIGRATE, COLD_MIGRATE}) {
+    auto& order = migrate_type == HOT_MIGRATE ? hot_order : cold_order;
+    std::vector<void*> addrs;
+    std::vector<int> from_nids;
+    std::vector<int> target_nids;
+
+    for (size_t i = 0; i < refs.size(); ++i) {
+      addrs.push_back((void*)((i + 1) << PAGE_SHIFT));
+      from_nids.push_back(i);
+      target_nids.push_back(i + 100);
+    }
+
+    sort_by_hotness(migrate_type, refs, addrs, from_nids, target_nids);
+
+    EPT_MIGRATE_CHECK(addrs.size() == refs.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      EPT_MIGRATE_CHECK(addrs[i] == (void*)((order[i] + 1UL) << PAGE_SHIFT));
+      EPT_MIGRATE_CHECK(from_nids[i] == order[i]);
+      EPT_MIGRATE_CHECK(target_nids[i] == order[i] + 100);
+    }
+  }
+
+  if (self_test_moved_pages())
+    return -1;
+
+  printf("EPT migrate self test passed\n");
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  EPTMigrate migration;
+
+  return migration.self_test();
+}
+
+#endif
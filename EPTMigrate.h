@@ -23,6 +23,7 @@
 #include "ProcIdlePages.h"
 #include "EPTScan.h"
 #include "PidContext.h"
+#include "MigrateScheduler.h"
 
 class BandwidthLimit;
 class NumaNodeCollection;
@@ -120,6 +121,10 @@ class EPTMigrate : public EPTScan
     void set_pid_context(PidContext *new_context)
     { context = new_context; }
 
+    // move in the node pair slots of the scheduler, NULL: no limits
+    void set_scheduler(MigrateScheduler* new_scheduler)
+    { scheduler = new_scheduler; }
+
     static void reset_sys_migrate_stats();
     void count_migrate_stats();
 
@@ -129,6 +134,16 @@ class EPTMigrate : public EPTScan
 
     int normalize_page_hotness(ProcIdlePageType page_type,
                                long threshold, long threshold_max);
+
+    // remember the pages migrate() moves, for apply_moved_pages()
+    void set_record_moved(bool on) { record_moved = on; }
+    // Update the nids of the pages that the migration of last, a range
+    // of the same pid in the previous round, moved after they were walked.
+    void apply_moved_pages(EPTMigrate& last);
+
+#ifdef EPT_MIGRATE_SELF_TEST
+    int self_test();
+#endif
  private:
     size_t get_threshold_refs(ProcIdlePageType type, int& min_refs, int& max_refs);
 
@@ -136,6 +151,8 @@ class EPTMigrate : public EPTScan
     int select_top_pages(ProcIdlePageType type);
 
     long do_move_pages(ProcIdlePageType type);
+    // nids_time within option.migrate_nid_max_age
+    bool is_nids_trusted();
 
     // status => count
     std::unordered_map<int, int> calc_migrate_stats();
@@ -149,11 +166,27 @@ class EPTMigrate : public EPTScan
                                std::vector<int>& from_nid_array,
                                std::vector<int>& target_nid_array);
 
+    // order the candidates to promote hottest first, to demote coldest
+    // first, in address order within each refs value
+    void sort_by_hotness(int migrate_type,
+                         const std::vector<payload_t>& refs,
+                         std::vector<void*>& addr_array,
+                         std::vector<int>& from_nid_array,
+                         std::vector<int>& target_nid_array);
+
     int do_interleave_move_pages(ProcIdlePageType type,
                                  std::vector<void*> *addr,
                                  std::vector<int> *from_nid,
                                  std::vector<int> *target_nid);
 
+    // returns the bytes moved
+    unsigned long move_batch(ProcIdlePageType type, int migrate_type,
+                             void** addrs, int* from_nid,
+                             int* target_nid, long count);
+    void schedule_move_batch(ProcIdlePageType type, int migrate_type,
+                             void** addrs, int* from_nid,
+                             int* target_nid, long count);
+
     void setup_migrator(ProcIdlePageType type, MovePages& migrator);
 
     void update_migrate_state(int migrate_type);
@@ -170,6 +203,9 @@ class EPTMigrate : public EPTScan
   public:
     migrate_parameter parameter[MAX_ACCESSED];
     struct timeval ts_scan_finish;
+    // of the last migrate() that did not skip the range, or zeros
+    struct timeval ts_migrate_begin = {0, 0};
+    struct timeval ts_migrate_end = {0, 0};
 
   private:
     // The Virtual Address of hot/cold pages.
@@ -177,6 +213,10 @@ class EPTMigrate : public EPTScan
     //std::vector<unsigned long> hot_pages;
     std::vector<void *> pages_addr[PMD_ACCESSED + 1];
 
+    // with record_moved: (addr, nid) of the pages moved by migrate()
+    bool record_moved = false;
+    std::vector<std::pair<unsigned long, int>> moved_pages[PMD_ACCESSED + 1];
+
     // Get the status after migration
     std::vector<int> migrate_status;
 
@@ -190,6 +230,7 @@ class EPTMigrate : public EPTScan
     MovePages page_migrator[MAX_MIGRATE];
 
     BandwidthLimit* throttler = NULL;
+    MigrateScheduler* scheduler = NULL;
 };
 
 #endif
@@ -7,8 +7,12 @@
  */
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "EPTScan.h"
+#include "AddrSequenceSnapshot.h"
+#include "IdleTrace.h"
 #include "lib/debug.h"
 #include "lib/stats.h"
 
@@ -70,16 +74,18 @@ int EPTScan::walk_multi(int nr, float interval)
   int err;
   const int max_walks = 30;
   bool auto_stop = false;
+  int max_nr;
 
-  auto maps = proc_maps.load(pid);
-  if (maps.empty()) {
+  if (load_maps().empty()) {
     io_error = -ENOENT;
     return -ENOENT;
   }
 
-  if (nr > 0xff) {
-    printf("limiting nr_walks to uint8_t size\n");
-    nr = 0xff;
+  max_nr = option.addr_seq_payload_bits > 8 ? UINT16_MAX : UINT8_MAX;
+  if (nr > max_nr) {
+    printf("limiting nr_walks to %d bit payload size\n",
+           option.addr_seq_payload_bits > 8 ? 16 : 8);
+    nr = max_nr;
   } else if (nr == 0) {
     auto_stop = true;
     nr = max_walks;
@@ -99,6 +105,8 @@ int EPTScan::walk_multi(int nr, float interval)
     usleep(interval * 1000000);
   }
 
+  close_session();
+
   return 0;
 }
 
@@ -110,6 +118,10 @@ void EPTScan::prepare_walks(int max_walks)
     auto& prc = pagetype_refs[type];
     prc.page_refs.clear();
     prc.page_refs.set_pageshift(pagetype_shift[type]);
+    prc.page_refs.set_layout(option.addr_seq_soa ?
+                             AddrSequence::LAYOUT_SOA : AddrSequence::LAYOUT_AOS);
+    prc.page_refs.set_payload_width(option.addr_seq_payload_bits > 8 ? 16 : 8);
+    prc.page_refs.set_dirty_tracking(option.dirty_min_refs > 0);
 
     for (auto& histogram: prc.histogram_2d)
       histogram.clear();
@@ -117,38 +129,42 @@ void EPTScan::prepare_walks(int max_walks)
 }
 
 histogram_2d_type EPTScan::sys_refs_count[MAX_ACCESSED + 1];
+histogram_type EPTScan::sys_dirty_count[MAX_ACCESSED + 1];
 void EPTScan::reset_sys_refs_count(int nr_walks)
 {
   for (auto& src: sys_refs_count) {
     reset_one_ref_count(src, nr_walks + 1);
   }
+  for (auto& src: sys_dirty_count) {
+    src.clear();
+    src.resize(nr_walks + 1, 0);
+  }
 }
 
 void EPTScan::count_refs_one(ProcIdleRefs& prc)
 {
-  int rc;
-  unsigned long addr;
-  uint8_t ref_count;
-  int8_t nid;
   int loc_index;
   histogram_2d_type& refs_count = prc.histogram_2d;
   AddrSequence& page_refs = prc.page_refs;
+  std::vector<unsigned long> counts;
+
+  static_assert(AddrSequence::HIST_NIDS == MAX_NID + 2,
+                "AddrSequence::count_payloads() should cover all nids");
 
   reset_one_ref_count(refs_count, nr_walks + 1);
 
   // save page NID + refs information into refs_count
-  rc = page_refs.get_first(addr, ref_count, nid);
-  while (!rc) {
-
-    // In the rare case of changed VMAs, their start/end boundary may not align
-    // with the underlying huge page size. If the same huge page is covered by
-    // 2 VMAs, there will be duplicate accounting for the same page. The easy
-    // workaround is to enforce min() check here.
-    if (nid >= 0)
-      refs_count[nid][std::min(ref_count, (uint8_t)nr_walks)] += 1;
-    else
-      refs_count[REF_LOC_UNKNOWN][std::min(ref_count, (uint8_t)nr_walks)] += 1;
-    rc = page_refs.get_next(addr, ref_count, nid);
+  //
+  // In the rare case of changed VMAs, their start/end boundary may not align
+  // with the underlying huge page size. If the same huge page is covered by
+  // 2 VMAs, there will be duplicate accounting for the same page. The easy
+  // workaround is to clamp refs to nr_walks here.
+  page_refs.count_payloads(counts, nr_walks);
+  for (int i = 0; i < AddrSequence::HIST_NIDS; ++i) {
+    int nid = (i == AddrSequence::HIST_NIDS - 1) ? (int)REF_LOC_UNKNOWN : i;
+
+    for (int j = 0; j <= nr_walks; ++j)
+      refs_count[nid][j] += counts[i * (nr_walks + 1) + j];
   }
 
   // save DRAM/PMEM/ALL refs count from page NID + refs information
@@ -183,6 +199,31 @@ void EPTScan::reset_one_ref_count(histogram_2d_type& ref_count_obj, int node_siz
 }
 
 void EPTScan::count_refs()
+{
+  count_range_refs();
+  add_sys_refs();
+}
+
+void EPTScan::count_range_refs()
+{
+  if (io_error)
+    return;
+
+  for (int type = 0; type <= MAX_ACCESSED; ++type) {
+    auto& prc = pagetype_refs[type];
+
+    if (option.page_history)
+      update_page_history(type, prc);
+
+    count_refs_one(prc);
+
+    prc.dirty_count.clear();
+    if (prc.page_refs.get_dirty_tracking())
+      prc.page_refs.count_dirty(prc.dirty_count, nr_walks);
+  }
+}
+
+void EPTScan::add_sys_refs()
 {
   if (io_error) {
     printd("count_refs: skip %d\n", pid);
@@ -193,8 +234,6 @@ void EPTScan::count_refs()
     auto& src = sys_refs_count[type];
     auto& prc = pagetype_refs[type];
 
-    count_refs_one(prc);
-
     if ((unsigned long)nr_walks + 1 != prc.histogram_2d[REF_LOC_ALL].size())
       fprintf(stderr, "ERROR: nr_walks mismatch: %d %lu\n",
               nr_walks, prc.histogram_2d[REF_LOC_ALL].size());
@@ -204,6 +243,65 @@ void EPTScan::count_refs()
         src[j][i] += prc.histogram_2d[j][i];
       }
     }
+
+    if (!prc.dirty_count.empty()) {
+      histogram_type& dirty = sys_dirty_count[type];
+
+      // dirty scores are clamped to nr_walks like refs
+      dirty.resize(std::max(dirty.size(), prc.dirty_count.size()), 0);
+      for (size_t i = 0; i < prc.dirty_count.size(); ++i)
+        dirty[i] += prc.dirty_count[i];
+    }
+  }
+}
+
+std::unordered_map<pid_t, EPTScan::PageHistoryEntry> EPTScan::page_history[MAX_ACCESSED + 1];
+std::mutex EPTScan::page_history_lock;
+void EPTScan::update_page_history(int type, ProcIdleRefs& prc)
+{
+  std::unique_lock<std::mutex> map_guard(page_history_lock);
+  // entries stay in place as the map grows
+  PageHistoryEntry& entry = page_history[type][pid];
+  map_guard.unlock();
+
+  std::lock_guard<std::mutex> guard(entry.lock);
+  PageHistory& history = entry.history;
+  ProcMapsView& seen = entry.maps;
+  ProcMapsView maps = ProcMapsCache::get(pid);
+
+  // a new mapping at the address of an unmapped one starts afresh
+  if (seen && seen != maps) {
+    ProcMapsDiff diff;
+
+    ProcMaps::diff(*seen, *maps, diff);
+    for (auto& r: diff.removed)
+      history.forget(r.start, r.end);
+    for (auto& r: diff.resized) {
+      if (r.from.start < r.to.start)
+        history.forget(r.from.start, r.to.start);
+      if (r.to.end < r.from.end)
+        history.forget(r.to.end, r.from.end);
+    }
+  }
+  seen = maps;
+
+  history.set_rounds(option.page_history);
+  history.set_score(option.page_history_score, option.page_history_ewma);
+  history.update(prc.page_refs, nr_walks, va_start, va_end);
+}
+
+void EPTScan::expire_page_history()
+{
+  for (int type = 0; type <= MAX_ACCESSED; ++type) {
+    auto& map = page_history[type];
+
+    for (auto it = map.begin(); it != map.end();) {
+      if (it->second.history.is_touched()) {
+        it->second.history.clear_touched();
+        ++it;
+      } else
+        it = map.erase(it);
+    }
   }
 }
 
@@ -252,12 +350,142 @@ int EPTScan::save_counts(std::string filename)
   }
   fprintf(file, "\nALL  %'15lu\n", total_kb);
 
+  if (option.dirty_min_refs > 0) {
+    fprintf(file, "\nScan result: memory (KB) group by dirty count\n");
+    fprintf(file, "%5s %15s %15s\n", "dirty", "4k_page", "2M_page");
+    fprintf(file, "=======================================\n");
+
+    nr = sys_dirty_count[PTE_ACCESSED].size();
+    for (int i = nr - 1; i >= 0; i--) {
+      fprintf(file, "%5d", i);
+      for (int type: {PTE_ACCESSED, PMD_ACCESSED}) {
+        auto& dirty = sys_dirty_count[type];
+        unsigned long pages = i < (int)dirty.size() ? dirty[i] : 0;
+
+        fprintf(file, " %'15lu", pages * (pagetype_size[type] >> 10));
+      }
+      fprintf(file, "\n");
+    }
+  }
+
   if (file != stdout)
     fclose(file);
 
   return err;
 }
 
+#define RANGE_SNAPSHOT_MAGIC    "AEPRANGE"
+#define RANGE_SNAPSHOT_VERSION  1
+
+struct RangeSnapshotHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  int32_t  pid;
+  int32_t  nr_walks;
+  uint64_t va_start;
+  uint64_t va_end;
+  uint64_t seq_offset[MAX_ACCESSED + 1];
+  uint64_t seq_size[MAX_ACCESSED + 1];
+};
+
+long EPTScan::save_snapshot(std::string filename)
+{
+  RangeSnapshotHeader header;
+  long offset = sizeof(header);
+  long size;
+  int err = 0;
+  int fd;
+
+  fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(filename.c_str());
+    return -errno;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RANGE_SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = RANGE_SNAPSHOT_VERSION;
+  header.header_size = sizeof(header);
+  header.pid = pid;
+  header.nr_walks = nr_walks;
+  header.va_start = va_start;
+  header.va_end = va_end;
+
+  if (lseek(fd, offset, SEEK_SET) < 0)
+    err = -errno;
+
+  for (int type = 0; type <= MAX_ACCESSED && !err; ++type) {
+    size = pagetype_refs[type].page_refs.save_snapshot(fd);
+    if (size < 0) {
+      err = size;
+      break;
+    }
+    header.seq_offset[type] = offset;
+    header.seq_size[type] = size;
+    offset += size;
+  }
+
+  if (!err && pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+    err = -EIO;
+
+  close(fd);
+  if (err) {
+    fprintf(stderr, "save snapshot %s: %s\n", filename.c_str(), strerror(-err));
+    unlink(filename.c_str());
+    return err;
+  }
+
+  return offset;
+}
+
+int EPTScan::load_snapshot(std::string filename)
+{
+  RangeSnapshotHeader header;
+  int err;
+  int fd;
+
+  fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    perror(filename.c_str());
+    return -errno;
+  }
+
+  err = pread(fd, &header, sizeof(header), 0) == sizeof(header) ? 0 : -EIO;
+  close(fd);
+  if (err)
+    return err;
+
+  if (memcmp(header.magic, RANGE_SNAPSHOT_MAGIC, sizeof(header.magic))
+      || header.version != RANGE_SNAPSHOT_VERSION
+      || header.header_size != sizeof(header)) {
+    fprintf(stderr, "%s: not a range snapshot\n", filename.c_str());
+    return -EINVAL;
+  }
+
+  for (int type = 0; type <= MAX_ACCESSED; ++type) {
+    AddrSequenceSnapshot snapshot;
+
+    err = snapshot.open(filename.c_str(), header.seq_offset[type]);
+    if (err)
+      return err;
+
+    err = pagetype_refs[type].page_refs.load_snapshot(snapshot);
+    if (err)
+      return err;
+
+    for (auto& histogram: pagetype_refs[type].histogram_2d)
+      histogram.clear();
+  }
+
+  pid = header.pid;
+  nr_walks = header.nr_walks;
+  set_va_range(header.va_start, header.va_end);
+
+  return 0;
+}
+
 int EPTScan::get_memory_type_range(void** addrs, unsigned long count,
                                    AddrSequence& addrobj)
 {
@@ -308,29 +536,25 @@ update_nid:
 
 int EPTScan::get_memory_type()
 {
-  int rc;
-  unsigned long addr;
-  uint8_t unused_count;
-  int8_t nid;
-
   std::vector<void*> addr_set;
 
+  // no nodes for the traced pids, see EPTMigrate::migrate()
+  if (IdleTrace::get_source())
+    return 0;
+
   for (auto& each : pagetype_refs) {
     AddrSequence& page_refs = each.page_refs;
 
     addr_set.clear();
     page_refs.prepare_update();
 
-    rc = page_refs.get_first(addr, unused_count, nid);
-    while(!rc) {
-
-      addr_set.push_back((void*)addr);
+    // const_iterator keeps walking while update_nodeid() seeks find_iter
+    for (auto& entry : page_refs) {
+      addr_set.push_back((void*)entry.addr);
       if (addr_set.size() >= 1024) {
         get_memory_type_range(&addr_set[0], addr_set.size(), page_refs);
         addr_set.clear();
       }
-
-      rc = page_refs.get_next(addr, unused_count, nid);
     }
 
     // handle the remain unaligned part
@@ -339,6 +563,8 @@ int EPTScan::get_memory_type()
     }
   }
 
+  gettimeofday(&nids_time, NULL);
+
   return  0;
 }
 
@@ -9,12 +9,17 @@
 #ifndef AEP_EPT_SCAN_H
 #define AEP_EPT_SCAN_H
 
+#include <sys/time.h>
+
 #include <string>
+#include <mutex>
+#include <unordered_map>
 
 #include "ProcIdlePages.h"
 #include "Numa.h"
 #include "AddrSequence.h"
 #include "MovePages.h"
+#include "PageHistory.h"
 
 
 class EPTScan: public ProcIdlePages
@@ -29,9 +34,22 @@ class EPTScan: public ProcIdlePages
 
     static void reset_sys_refs_count(int nr_walks);
 
+    // count_range_refs() then add_sys_refs()
     void count_refs();
+    // count the pages of this range into its own histograms; ranges may
+    // be counted in parallel
+    void count_range_refs();
+    // add the range histograms to the system wide ones, not thread safe
+    void add_sys_refs();
     static int save_counts(std::string filename);
 
+    // per page refs of all page types in one file, the header followed
+    // by an AddrSequenceSnapshot image per type. Returns the file size
+    // or negative errno.
+    long save_snapshot(std::string filename);
+    // replace pid, va range and page refs with a saved snapshot
+    int load_snapshot(std::string filename);
+
     void set_numacollection(NumaNodeCollection* new_numa_collection) {
       numa_collection = new_numa_collection;
     }
@@ -44,16 +62,39 @@ class EPTScan: public ProcIdlePages
     static histogram_2d_type& get_sys_refs_count(ProcIdlePageType type) {
       return sys_refs_count[type];
     }
+
+    // drop the history of tasks not counted since last call, not to be
+    // called while counting
+    static void expire_page_history();
   private:
     bool should_stop();
     void count_refs_one(ProcIdleRefs& prc);
     static void reset_one_ref_count(histogram_2d_type& ref_count_obj, int node_size);
+    void update_page_history(int type, ProcIdleRefs& prc);
 
   private:
     static histogram_2d_type  sys_refs_count[MAX_ACCESSED + 1];
+    // pages by dirty score, with option.dirty_min_refs
+    static histogram_type     sys_dirty_count[MAX_ACCESSED + 1];
+
+    struct PageHistoryEntry
+    {
+      // the ranges of a task share its history
+      std::mutex lock;
+      PageHistory history;
+      // VMAs at the last history update
+      ProcMapsView maps;
+    };
+
+    // pid => history, kept across the ProcessCollection rebuild of each round
+    static std::unordered_map<pid_t, PageHistoryEntry> page_history[MAX_ACCESSED + 1];
+    // guards the maps above, not the entries
+    static std::mutex page_history_lock;
 
   protected:
      NumaNodeCollection* numa_collection = NULL;
+     // when get_memory_type() last saved the page nids
+     struct timeval nids_time = {0, 0};
 
 };
 
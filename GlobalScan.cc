@@ -23,6 +23,7 @@
 #include "GlobalScan.h"
 #include "OptionParser.h"
 #include "VMAInspect.h"
+#include "IdleTrace.h"
 
 using namespace std;
 extern OptionParser option;
@@ -76,7 +77,9 @@ void GlobalScan::main_loop()
     gettimeofday(&ts_begin, NULL);
 
     if (0 == nr_scan_rounds) {
-      reload_conf();
+      // an async migration still reads the options, see below
+      if (migrating_ranges.empty())
+        reload_conf();
       collect();
 
       if (idle_ranges.empty()) {
@@ -102,26 +105,33 @@ void GlobalScan::main_loop()
 
     nr_scan_rounds = 0;
     save_scan_finish_ts();
+    // The migration of the last round ends before the nids of this
+    // round are counted; the results of that round are settled only then,
+    // and a new conf may be loaded then
+    if (option.migrate_async) {
+      if (finish_migrate(last_migration_elapsed))
+        break;
+      reload_conf();
+    }
     count_refs();
     calc_memory_size();
 
     if (option.progressive_profile.empty()) {
       calc_migrate_parameter();
       calc_global_threshold();
-      last_migration_elapsed = migrate();
-      count_migrate_stats();
-      calc_hotness_drifting();
-      save_context_last();
+      if (option.migrate_async)
+        start_migrate();
+      else {
+        last_migration_elapsed = migrate();
+        count_migrate_stats(idle_ranges);
+        if (finish_round(idle_ranges))
+          break;
+      }
     } else {
       progressive_profile();
       break;
     }
 
-    if (option.exit_on_converged && exit_on_converged()) {
-      printf("Exit: exit_on_converged done\n");
-      break;
-    }
-
     gettimeofday(&ts_end, NULL);
     elapsed = tv_secs(ts_begin, ts_end);
     sleep_time = std::max(0.0f, option.scan_period - elapsed);
@@ -130,9 +140,37 @@ void GlobalScan::main_loop()
     usleep(sleep_time * 1000000);
     last_period_sleep_time = sleep_time;
   }
+
+  if (option.migrate_async)
+    finish_migrate(last_migration_elapsed);
   stop_threads();
 }
 
+// Compare the round of ranges with the last one, once its migration is
+// done. True to exit.
+bool GlobalScan::finish_round(std::vector<EPTMigratePtr>& ranges)
+{
+  calc_hotness_drifting(ranges);
+  save_context_last(ranges);
+
+  if (option.exit_on_converged && exit_on_converged(ranges)) {
+    printf("Exit: exit_on_converged done\n");
+    return true;
+  }
+
+  return false;
+}
+
+// Wait for the migration started by the last round, then compare that
+// round with the one before. True to exit.
+bool GlobalScan::finish_migrate(float& elapsed)
+{
+  std::vector<EPTMigratePtr> migrated(migrating_ranges);
+
+  elapsed = wait_migrate();
+  return !migrated.empty() && finish_round(migrated);
+}
+
 // auto exit for stable benchmarks
 bool GlobalScan::exit_on_stabilized()
 {
@@ -175,7 +213,9 @@ int GlobalScan::collect()
 
   idle_ranges.clear();
 
-  if (option.get_policies().empty())
+  if (IdleTrace::get_source())
+    err = process_collection.collect_trace();
+  else if (option.get_policies().empty())
     err = process_collection.collect();
   else
     err = process_collection.collect(option.get_policies());
@@ -189,6 +229,8 @@ int GlobalScan::collect()
   for (auto &kv: process_collection.get_proccesses()) {
     for (auto &m: kv.second->get_ranges()) {
       m->set_throttler(&throttler);
+      if (option.migrate_pair_jobs || option.migrate_node_jobs)
+        m->set_scheduler(&migrate_scheduler);
       m->set_numacollection(&numa_collection);
       idle_ranges.push_back(m);
     }
@@ -202,7 +244,18 @@ void GlobalScan::create_threads()
   worker_threads.reserve(option.max_threads);
 
   for (int i = 0; i < option.max_threads; ++i)
-    worker_threads.push_back(std::thread(&GlobalScan::consumer_loop, this));
+    worker_threads.push_back(std::thread(&GlobalScan::consumer_loop, this,
+                                         std::ref(work_queue),
+                                         std::ref(done_queue)));
+
+  if (!option.migrate_async)
+    return;
+
+  // migration runs while the walks keep the workers busy
+  for (int i = 0; i < std::max(option.max_threads, 1); ++i)
+    migrate_threads.push_back(std::thread(&GlobalScan::consumer_loop, this,
+                                          std::ref(migrate_queue),
+                                          std::ref(migrate_done_queue)));
 }
 
 void GlobalScan::stop_threads()
@@ -212,9 +265,13 @@ void GlobalScan::stop_threads()
 
   for (unsigned long i = 0; i < worker_threads.size(); ++i)
     work_queue.push(job);
+  for (unsigned long i = 0; i < migrate_threads.size(); ++i)
+    migrate_queue.push(job);
 
   for (auto& th : worker_threads)
     th.join();
+  for (auto& th : migrate_threads)
+    th.join();
 }
 
 void GlobalScan::prepare_walk_multi()
@@ -234,13 +291,19 @@ float GlobalScan::walk_multi()
   std::vector<float> sleep_time_vector;
   nr_acceptable_scans = 0;
 
+  gettimeofday(&ts1, NULL);
+  if (!migrating_ranges.empty())
+    walk_windows.emplace_back(ts1, ts1);
+
   printf("\nStarting page table scans: %s\n", get_current_date().c_str());
   printf("Auto-interval: %s\n",
          should_target_aep_young() ? "aep_young" : "young");
-  printf("%7s  %8s  %23s  %23s  %23s  %15s\n",
-         "nr_scan", "interval", "young", "aep_young", "top hot", "all");
+  printf("%7s  %8s  %23s  %23s  %23s  %15s  %8s  %8s  %8s  %8s\n",
+         "nr_scan", "interval", "young", "aep_young", "top hot", "all",
+         "syscall", "sys_ms", "saved_ms", "skip_MB");
   printf("================================================================="
-         "============================================\n");
+         "============================================"
+         "========================================\n");
 
   sleep_time_vector.reserve(option.nr_scans);
   for (scans = 0; scans < option.nr_scans;) {
@@ -281,26 +344,91 @@ float GlobalScan::walk_multi()
   // must update nr_walks to align with idle_ranges::nr_walks.
   nr_walks += scans;
 
+  for (auto& m: idle_ranges)
+    m->close_session();
+
   printf("End of page table scans: %s\n", get_current_date().c_str());
+  AddrSequence::get_buf_allocator().show();
+
+  if (!migrating_ranges.empty())
+    gettimeofday(&walk_windows.back().second, NULL);
 
   return interval_sum / scans;
 }
 
 void GlobalScan::count_refs()
 {
+  struct timeval ts1, ts2;
+  int nr = 0;
+  Job job;
+
+  job.intent = JOB_COUNT;
+
+  gettimeofday(&ts1, NULL);
   EPTScan::reset_sys_refs_count(nr_walks);
 
+  // each range counts into its own histograms on the workers, ...
+  for (auto& m: idle_ranges) {
+    job.migration = m;
+    if (option.max_threads) {
+      work_queue.push(job);
+      ++nr;
+    } else
+      consumer_job(job);
+  }
+
+  for (; nr; --nr) {
+    printd("wait count job %d\n", nr);
+    job = done_queue.pop();
+  }
+
+  // ... which are then summed up in a fixed order
   for (auto& m: idle_ranges)
-    m->count_refs();
+    m->add_sys_refs();
+  gettimeofday(&ts2, NULL);
 
+  printf("Counted refs of %lu ranges in %.3f seconds with %d threads\n",
+         idle_ranges.size(), tv_secs(ts1, ts2), option.max_threads);
+
+  EPTScan::expire_page_history();
+  ProcMapsCache::expire();
   EPTScan::save_counts(option.output_file);
+
+  if (!option.snapshot_dir.empty())
+    save_snapshots();
+}
+
+void GlobalScan::save_snapshots()
+{
+  struct timeval ts1, ts2;
+  unsigned long total_bytes = 0;
+  int nr = 0;
+  char path[PATH_MAX];
+  long size;
+
+  gettimeofday(&ts1, NULL);
+  for (auto& m: idle_ranges) {
+    snprintf(path, sizeof(path), "%s/%d-%lx.snap", option.snapshot_dir.c_str(),
+             m->get_pid(), m->get_va_start());
+
+    size = m->save_snapshot(path);
+    if (size < 0)
+      continue;
+
+    total_bytes += size;
+    ++nr;
+  }
+  gettimeofday(&ts2, NULL);
+
+  printf("Saved %d snapshots, %'lu KB in %.3f seconds to %s\n",
+         nr, total_bytes >> 10, tv_secs(ts1, ts2), option.snapshot_dir.c_str());
 }
 
-void GlobalScan::count_migrate_stats()
+void GlobalScan::count_migrate_stats(std::vector<EPTMigratePtr>& ranges)
 {
   EPTMigrate::reset_sys_migrate_stats();
 
-  for (auto& m: idle_ranges)
+  for (auto& m: ranges)
     m->count_migrate_stats();
 }
 
@@ -381,8 +509,11 @@ void GlobalScan::walk_once(int scans)
 {
   int nr = 0;
   Job job;
+  IdleReadStats read_stats;
   job.intent = JOB_WALK;
 
+  read_stats.clear();
+
   young_bytes = 0;
   top_bytes = 0;
   pmem_young_bytes = 0;
@@ -410,17 +541,26 @@ void GlobalScan::walk_once(int scans)
     job.migration->gather_walk_stats(young_bytes,
                                      pmem_young_bytes,
                                      top_bytes, all_bytes);
+    read_stats += job.migration->get_read_stats();
   }
 
   update_dram_free_anon_bytes();
 
-  printf("%7d  %8.3f  %'15lu %6.2f%%  %'15lu %6.2f%%  %'15lu %6.2f%%  %'15lu\n",
+  // syscall, sys_ms: idle_pages read/seek calls of all ranges and
+  // the time in them, summed over threads
+  // saved_ms: maps loading and idle_pages opening saved by keeping
+  // them across scans
+  // skip_MB: idle regions not read in skim mode
+  printf("%7d  %8.3f  %'15lu %6.2f%%  %'15lu %6.2f%%  %'15lu %6.2f%%  %'15lu  %'8lu  %8.2f  %8.2f  %'8lu\n",
          scans,
          (double)real_interval,
          young_bytes >> 10, 100.0 * young_bytes / all_bytes,
          pmem_young_bytes >> 10, 100.0 * pmem_young_bytes / all_bytes,
          top_bytes >> 10, 100.0 * top_bytes / all_bytes,
-         all_bytes >> 10);
+         all_bytes >> 10,
+         read_stats.nr_syscalls, read_stats.nsecs / 1e6,
+         read_stats.saved_nsecs / 1e6,
+         read_stats.skipped_bytes >> 20);
 }
 
 int GlobalScan::consumer_job(Job& job)
@@ -433,6 +573,9 @@ int GlobalScan::consumer_job(Job& job)
     case JOB_MIGRATE:
       job.migration->migrate();
       break;
+    case JOB_COUNT:
+      job.migration->count_range_refs();
+      break;
     case JOB_QUIT:
       printd("consumer_loop quit job\n");
       return 1;
@@ -441,17 +584,17 @@ int GlobalScan::consumer_job(Job& job)
     return 0;
 }
 
-void GlobalScan::consumer_loop()
+void GlobalScan::consumer_loop(Queue<Job>& in, Queue<Job>& out)
 {
   printd("consumer_loop started\n");
   for (;;)
   {
-    Job job = work_queue.pop();
+    Job job = in.pop();
     int ret = consumer_job(job);
     if (ret)
       break;
     printd("consumer_loop done job\n");
-    done_queue.push(job);
+    out.push(job);
   }
 }
 
@@ -465,6 +608,7 @@ float GlobalScan::migrate()
   job.intent = JOB_MIGRATE;
 
   printf("\nStarting migration: %s\n", get_current_date().c_str());
+  migrate_scheduler.clear();
   gettimeofday(&ts_begin, NULL);
   for (auto& m: idle_ranges)
   {
@@ -488,11 +632,118 @@ float GlobalScan::migrate()
     proc_vmstat.show_numa_stats(&numa_collection);
 
   time_cost = tv_secs(ts_begin, ts_end);
-  show_migrate_speed(time_cost);
+  show_migrate_speed(time_cost, idle_ranges);
+  show_migrate_timing(idle_ranges, ts_begin, ts_end);
+  migrate_scheduler.show();
+
+  return time_cost;
+}
+
+void GlobalScan::start_migrate()
+{
+  Job job;
+
+  job.intent = JOB_MIGRATE;
+
+  printf("\nStarting migration behind the next scans: %s\n",
+         get_current_date().c_str());
+  migrate_scheduler.clear();
+  gettimeofday(&ts_migrate_start, NULL);
+
+  // The ranges of the next round are new objects, so the migration keeps
+  // reading the page refs and candidates of this round. It holds their
+  // processes, which are dropped by the next collect().
+  migrating_ranges = idle_ranges;
+  migrating_processes = process_collection.get_proccesses();
+  walk_windows.clear();
+
+  for (auto& m: migrating_ranges) {
+    m->set_record_moved(true);
+    job.migration = m;
+    migrate_queue.push(job);
+    ++nr_migrating;
+  }
+}
+
+float GlobalScan::wait_migrate()
+{
+  struct timeval ts_end;
+  float time_cost;
+
+  if (migrating_ranges.empty())
+    return 0;
+
+  for (; nr_migrating; --nr_migrating) {
+    printd("wait migrate job %d\n", nr_migrating);
+    migrate_done_queue.pop();
+  }
+  printf("\nEnd of migration: %s\n", get_current_date().c_str());
+
+  // when the last range finished, not when we came to wait for it
+  ts_end = ts_migrate_start;
+  for (auto& m: migrating_ranges)
+    if (timercmp(&m->ts_migrate_end, &ts_end, >))
+      ts_end = m->ts_migrate_end;
+
+  // the walks of this round may have seen pages before they were moved
+  for (auto& last: migrating_ranges)
+    for (auto& m: idle_ranges)
+      if (m->get_pid() == last->get_pid())
+        m->apply_moved_pages(*last);
+
+  if (option.show_numa_stats)
+    proc_vmstat.show_numa_stats(&numa_collection);
+
+  time_cost = tv_secs(ts_migrate_start, ts_end);
+  show_migrate_speed(time_cost, migrating_ranges);
+  show_migrate_timing(migrating_ranges, ts_migrate_start, ts_end);
+  migrate_scheduler.show();
+  count_migrate_stats(migrating_ranges);
+
+  migrating_ranges.clear();
+  migrating_processes.clear();
 
   return time_cost;
 }
 
+// overlap: the share of the migration time the walks ran meanwhile
+// first: from the end of the scans to the first range starting to migrate
+void GlobalScan::show_migrate_timing(std::vector<EPTMigratePtr>& ranges,
+                                     struct timeval& ts_begin,
+                                     struct timeval& ts_end)
+{
+  struct timeval first = ts_end;
+  struct timeval last = ts_begin;
+  float overlap = 0;
+  float elapsed;
+
+  for (auto& m: ranges) {
+    if (!m->ts_migrate_begin.tv_sec)
+      continue;
+    if (timercmp(&m->ts_migrate_begin, &first, <))
+      first = m->ts_migrate_begin;
+    if (timercmp(&m->ts_migrate_end, &last, >))
+      last = m->ts_migrate_end;
+  }
+
+  if (!timercmp(&first, &last, <))
+    return;
+
+  for (auto& w: walk_windows) {
+    struct timeval& from = timercmp(&w.first, &first, >) ? w.first : first;
+    struct timeval& to = timercmp(&w.second, &last, <) ? w.second : last;
+
+    if (timercmp(&from, &to, <))
+      overlap += tv_secs(from, to);
+  }
+
+  elapsed = tv_secs(first, last);
+  printf("Migration timing: %.2f seconds, %d%% overlapped with scans, "
+         "first migration %.2f seconds after the scans\n",
+         elapsed, percent(overlap, elapsed),
+         ranges.empty() ? 0 : tv_secs(ranges[0]->ts_scan_finish, first));
+}
+
 void GlobalScan::progressive_profile()
 {
   Job job;
@@ -524,9 +775,10 @@ void GlobalScan::progressive_profile()
   }
 }
 
-void GlobalScan::show_migrate_speed(float delta_time)
+void GlobalScan::show_migrate_speed(float delta_time,
+                                    std::vector<EPTMigratePtr>& ranges)
 {
-  unsigned long migrated_kb = calc_migrated_bytes() >> 10;
+  unsigned long migrated_kb = calc_migrated_bytes(ranges) >> 10;
 
   printf("Migration speed: moved %'lu KB in %.2f seconds (%'lu KB/sec)\n",
          migrated_kb, delta_time,
@@ -630,15 +882,18 @@ void GlobalScan::reload_conf()
 void GlobalScan::apply_option()
 {
   throttler.set_bwlimit_mbps(option.bandwidth_mbps);
+  migrate_scheduler.set_limits(option.migrate_pair_jobs,
+                               option.migrate_node_jobs);
+  AddrSequence::get_buf_allocator().set_backing(option.addr_seq_hugepage);
   numa_collection.collect(&option.numa_hw_config,
                           &option.numa_hw_config_v2);
 }
 
-unsigned long GlobalScan::calc_migrated_bytes()
+unsigned long GlobalScan::calc_migrated_bytes(std::vector<EPTMigratePtr>& ranges)
 {
   unsigned long total_moved_bytes = 0;
 
-  for (auto& m : idle_ranges) {
+  for (auto& m : ranges) {
     for (unsigned i = COLD_MIGRATE; i < MAX_MIGRATE; ++i)
       total_moved_bytes += m->get_migrate_stats(i).get_moved_bytes();
   }
@@ -713,7 +968,7 @@ void GlobalScan::calc_memory_size()
          global_dram_ratio, option.dram_percent);
 }
 
-void GlobalScan::calc_hotness_drifting()
+void GlobalScan::calc_hotness_drifting(std::vector<EPTMigratePtr>& ranges)
 {
   bool found;
   size_t i, j;
@@ -731,8 +986,8 @@ void GlobalScan::calc_hotness_drifting()
   for (i = 0; i < idle_ranges_last.size(); ++i) {
     pid_t pid_last = idle_ranges_last[i]->get_pid();
 
-    for (found = false, j = 0; j < idle_ranges.size(); ++j) {
-      if (idle_ranges[j]->get_pid() == pid_last) {
+    for (found = false, j = 0; j < ranges.size(); ++j) {
+      if (ranges[j]->get_pid() == pid_last) {
         found = true;
         break;
       }
@@ -751,9 +1006,9 @@ void GlobalScan::calc_hotness_drifting()
       ret += idle_ranges_last[i]->normalize_page_hotness(page_type,
                                                          global_hot_threshold_last[page_type].value,
                                                          global_hot_threshold_last[page_type].value_max);
-      ret += idle_ranges[j]->normalize_page_hotness(page_type,
-                                                    global_hot_threshold[page_type].value,
-                                                    global_hot_threshold[page_type].value_max);
+      ret += ranges[j]->normalize_page_hotness(page_type,
+                                               global_hot_threshold[page_type].value,
+                                               global_hot_threshold[page_type].value_max);
       if (ret)
         break;
     }
@@ -765,7 +1020,7 @@ void GlobalScan::calc_hotness_drifting()
       continue;
     }
 
-    calc_page_hotness_drifting(idle_ranges_last[i], idle_ranges[j]);
+    calc_page_hotness_drifting(idle_ranges_last[i], ranges[j]);
   }
 
   return;
@@ -784,7 +1039,7 @@ void GlobalScan::calc_page_hotness_drifting(EPTMigratePtr last,
 
   int rc[j_end];
   unsigned long addr[j_end];
-  uint8_t hotness[j_end];
+  payload_t hotness[j_end];
   AddrSequence* addr_seq[j_end];
 
   float elapsed_minute;
@@ -1289,16 +1544,16 @@ bool GlobalScan::is_all_migration_done()
   return true;
 }
 
-bool GlobalScan::exit_on_converged()
+bool GlobalScan::exit_on_converged(std::vector<EPTMigratePtr>& ranges)
 {
   ProcIdlePageType page_type[] = {PTE_ACCESSED, PMD_ACCESSED};
   bool converged;
   int  converged_count = 0;
   int  nr_check_count = sizeof(page_type)/sizeof(page_type[0])
-                        * (int)idle_ranges.size();
+                        * (int)ranges.size();
   int  valid_count;
 
-  for (auto &m : idle_ranges) {
+  for (auto &m : ranges) {
     for (auto &type : page_type) {
       const migrate_parameter& parameter = m->parameter[type];
 
@@ -17,6 +17,7 @@
 #include "Process.h"
 #include "EPTMigrate.h"
 #include "BandwidthLimit.h"
+#include "MigrateScheduler.h"
 #include "Sysfs.h"
 #include "Numa.h"
 #include "IntervalFitting.h"
@@ -25,6 +26,7 @@ enum JobIntent
 {
   JOB_WALK,
   JOB_MIGRATE,
+  JOB_COUNT,
   JOB_QUIT,
 };
 
@@ -54,9 +56,17 @@ class GlobalScan
     int collect();
     float walk_multi();
     float migrate();
+    // option.migrate_async: migrate the ranges of this round on the
+    // migrate threads, behind the walks of the next round
+    void start_migrate();
+    // wait for the migration of the last round, returns its seconds
+    float wait_migrate();
+    // wait_migrate(), then finish_round() the migrated ranges; true to exit
+    bool finish_migrate(float& elapsed);
     void progressive_profile();
     void count_refs();
-    void count_migrate_stats();
+    void save_snapshots();
+    void count_migrate_stats(std::vector<EPTMigratePtr>& ranges);
 #if 0
     void update_interval(bool finished);
 #else
@@ -67,7 +77,7 @@ class GlobalScan
     void prepare_walk_multi();
 
   private:
-    void consumer_loop();
+    void consumer_loop(Queue<Job>& in, Queue<Job>& out);
     int consumer_job(Job& job);
     void walk_once(int scans);
     bool should_stop_walk();
@@ -91,23 +101,28 @@ class GlobalScan
 
     unsigned long get_dram_anon_bytes(bool is_include_free);
 
-    unsigned long calc_migrated_bytes();
-    void show_migrate_speed(float delta_time);
+    unsigned long calc_migrated_bytes(std::vector<EPTMigratePtr>& ranges);
+    void show_migrate_speed(float delta_time,
+                            std::vector<EPTMigratePtr>& ranges);
+    void show_migrate_timing(std::vector<EPTMigratePtr>& ranges,
+                             struct timeval& ts_begin,
+                             struct timeval& ts_end);
     bool is_all_migration_done();
-    bool exit_on_converged();
+    bool exit_on_converged(std::vector<EPTMigratePtr>& ranges);
     void anti_thrashing(EPTMigratePtr range, ProcIdlePageType type,
                         int anti_threshold);
     void init_migration_parameter(EPTMigratePtr range, ProcIdlePageType type);
     void calc_memory_size();
-    void calc_hotness_drifting();
+    void calc_hotness_drifting(std::vector<EPTMigratePtr>& ranges);
     void calc_page_hotness_drifting(EPTMigratePtr last, EPTMigratePtr current);
     void calc_global_threshold();
     bool in_adjust_ratio_stage();
     bool in_unbalanced_stage();
     bool should_target_aep_young();
     void save_scan_finish_ts();
-    void save_context_last() {
-      idle_ranges_last = idle_ranges;
+    bool finish_round(std::vector<EPTMigratePtr>& ranges);
+    void save_context_last(std::vector<EPTMigratePtr>& ranges) {
+      idle_ranges_last = ranges;
 
       for (int i = 0; i < MAX_ACCESSED + 1; ++i)
         global_hot_threshold_last[i] = global_hot_threshold[i];
@@ -137,9 +152,21 @@ class GlobalScan
     Queue<Job> work_queue;
     Queue<Job> done_queue;
 
+    // with option.migrate_async
+    std::vector<std::thread> migrate_threads;
+    Queue<Job> migrate_queue;
+    Queue<Job> migrate_done_queue;
+    std::vector<EPTMigratePtr> migrating_ranges;
+    ProcessHash migrating_processes;    // keeps their PidContext alive
+    int nr_migrating = 0;
+    struct timeval ts_migrate_start;
+    // walk_multi() runs since start_migrate()
+    std::vector<std::pair<struct timeval, struct timeval>> walk_windows;
+
     std::atomic_int conf_reload_flag;
 
     BandwidthLimit throttler;
+    MigrateScheduler migrate_scheduler;
     NumaNodeCollection numa_collection;
     ProcVmstat proc_vmstat;
     Sysfs sysfs;
@@ -0,0 +1,540 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "IdleTrace.h"
+
+IdleTrace* IdleTrace::trace = NULL;
+IdlePagesSource* IdleTrace::source = NULL;
+
+static size_t pad8(size_t size)
+{
+  return (size + 7) & ~7UL;
+}
+
+IdleTrace::IdleTrace()
+{
+  out = NULL;
+  start_nsecs = 0;
+}
+
+IdleTrace::~IdleTrace()
+{
+  close();
+}
+
+int IdleTrace::setup(const std::string& record_path,
+                     const std::string& replay_path)
+{
+  IdleTrace* t;
+  int err;
+
+  if (source == trace)
+    source = NULL;
+  delete trace;
+  trace = NULL;
+
+  if (record_path.empty() && replay_path.empty())
+    return 0;
+
+  if (!record_path.empty() && !replay_path.empty()) {
+    fprintf(stderr, "idle_pages trace: cannot record and replay at once\n");
+    return -EINVAL;
+  }
+
+  t = new IdleTrace;
+  if (replay_path.empty())
+    err = t->open_record(record_path);
+  else
+    err = t->open_replay(replay_path);
+
+  if (err) {
+    delete t;
+    return err;
+  }
+
+  trace = t;
+  if (!replay_path.empty())
+    source = t;
+  return 0;
+}
+
+unsigned long IdleTrace::now_nsecs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec - start_nsecs;
+}
+
+int IdleTrace::open_record(const std::string& filename)
+{
+  IdleTraceHeader header;
+  struct timespec ts;
+
+  close();
+
+  out = fopen(filename.c_str(), "w");
+  if (!out) {
+    perror(filename.c_str());
+    return -errno;
+  }
+
+  path = filename;
+  start_nsecs = 0;
+  start_nsecs = now_nsecs();
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IDLE_TRACE_MAGIC, sizeof(header.magic));
+  header.version = IDLE_TRACE_VERSION;
+  header.header_size = sizeof(header);
+  header.start_time = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+
+  if (fwrite(&header, sizeof(header), 1, out) != 1) {
+    perror(filename.c_str());
+    close();
+    return -EIO;
+  }
+
+  return 0;
+}
+
+void IdleTrace::close()
+{
+  if (out && fclose(out))
+    perror(path.c_str());
+
+  out = NULL;
+  recorded_maps.clear();
+
+  image.clear();
+  walks.clear();
+  reads.clear();
+  maps.clear();
+  ranges.clear();
+}
+
+// mlock held
+void IdleTrace::write_record(IdleTraceRecord& rec, const void* data)
+{
+  static const uint64_t zeros = 0;
+
+  rec.nsecs = now_nsecs();
+
+  fwrite(&rec, sizeof(rec), 1, out);
+  if (data && rec.data_size) {
+    fwrite(data, rec.data_size, 1, out);
+    fwrite(&zeros, pad8(rec.data_size) - rec.data_size, 1, out);
+  }
+}
+
+// mlock held
+void IdleTrace::write_maps(pid_t pid, unsigned long generation,
+                           const std::vector<proc_maps_entry>& vmas)
+{
+  std::vector<uint8_t> buf;
+  IdleTraceRecord rec;
+
+  for (auto& vma: vmas) {
+    IdleTraceVma tv;
+    size_t pos = buf.size();
+
+    memset(&tv, 0, sizeof(tv));
+    tv.start = vma.start;
+    tv.end = vma.end;
+    tv.offset = vma.offset;
+    tv.ino = vma.ino;
+    tv.dev_major = vma.dev_major;
+    tv.dev_minor = vma.dev_minor;
+    memcpy(tv.perms, vma.perms, sizeof(tv.perms));
+    tv.path_len = vma.path.size();
+
+    buf.resize(pos + sizeof(tv) + pad8(tv.path_len));
+    memcpy(&buf[pos], &tv, sizeof(tv));
+    memcpy(&buf[pos + sizeof(tv)], vma.path.data(), tv.path_len);
+  }
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type = TRACE_MAPS;
+  rec.pid = pid;
+  rec.rc = generation;
+  rec.nr = vmas.size();
+  rec.data_size = buf.size();
+  write_record(rec, buf.data());
+}
+
+void IdleTrace::record_walk(pid_t pid, unsigned long start, unsigned long end,
+                            const ProcMapsView& view)
+{
+  std::lock_guard<std::mutex> guard(mlock);
+  WalkMaps& last = recorded_maps[pid];
+  IdleTraceRecord rec;
+
+  if (!out)
+    return;
+
+  // the VMAs only when they changed since the last walk of pid
+  if (last.maps != view) {
+    last.maps = view;
+    write_maps(pid, ++last.generation, *view);
+  }
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type = TRACE_WALK;
+  rec.pid = pid;
+  rec.va = start;
+  rec.end = end;
+  rec.rc = last.generation;
+  write_record(rec, NULL);
+}
+
+void IdleTrace::record_read(pid_t pid, unsigned long va, size_t size,
+                            ssize_t rc, const uint8_t* buf,
+                            unsigned long nsecs)
+{
+  int saved_errno = errno;
+
+  {
+    std::lock_guard<std::mutex> guard(mlock);
+    IdleTraceRecord rec;
+
+    if (!out)
+      return;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = TRACE_READ;
+    rec.pid = pid;
+    rec.va = va;
+    rec.end = size;
+    rec.rc = rc < 0 ? -saved_errno : rc;
+    rec.nr = nsecs;
+    rec.data_size = rc > 0 ? rc : 0;
+    write_record(rec, buf);
+  }
+
+  // the caller checks it after read_idle()
+  errno = saved_errno;
+}
+
+int IdleTrace::open_replay(const std::string& filename)
+{
+  struct stat st;
+  size_t off;
+  ssize_t rc;
+  int fd;
+
+  close();
+
+  fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    perror(filename.c_str());
+    return -errno;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    perror(filename.c_str());
+    ::close(fd);
+    return -errno;
+  }
+
+  image.resize(st.st_size);
+  for (off = 0; off < image.size(); off += rc) {
+    rc = ::read(fd, &image[off], image.size() - off);
+    if (rc <= 0)
+      break;
+  }
+  ::close(fd);
+
+  const IdleTraceHeader* header = (const IdleTraceHeader*)image.data();
+
+  if (off < image.size()
+      || image.size() < sizeof(IdleTraceHeader)
+      || memcmp(header->magic, IDLE_TRACE_MAGIC, sizeof(header->magic))
+      || header->version != IDLE_TRACE_VERSION
+      || header->header_size != sizeof(IdleTraceHeader)) {
+    fprintf(stderr, "%s: invalid idle_pages trace\n", filename.c_str());
+    close();
+    return -EINVAL;
+  }
+
+  path = filename;
+
+  for (off = sizeof(IdleTraceHeader); off < image.size();) {
+    const IdleTraceRecord* rec = (const IdleTraceRecord*)&image[off];
+    const uint8_t* data = (const uint8_t*)(rec + 1);
+
+    if (image.size() - off < sizeof(*rec)
+        || rec->data_size > image.size() - off - sizeof(*rec)
+        || (rec->type == TRACE_READ && rec->rc > (int64_t)rec->data_size)
+        || (rec->type == TRACE_MAPS && load_maps(*rec, data))) {
+      fprintf(stderr, "%s: bad record at offset %lu\n", filename.c_str(), off);
+      close();
+      return -EINVAL;
+    }
+
+    if (rec->type == TRACE_WALK) {
+      auto& q = walks[PidVa(rec->pid, rec->va)];
+
+      if (q.empty())
+        ranges.push_back({rec->pid, rec->va, rec->end});
+      q.push_back(rec->rc);
+    } else if (rec->type == TRACE_READ)
+      reads[PidVa(rec->pid, rec->va)].push_back(rec);
+
+    off += sizeof(*rec) + pad8(rec->data_size);
+  }
+
+  return 0;
+}
+
+int IdleTrace::load_maps(const IdleTraceRecord& rec, const uint8_t* data)
+{
+  auto vmas = std::make_shared<std::vector<proc_maps_entry>>();
+  const uint8_t* end = data + rec.data_size;
+  PidVa key(rec.pid, rec.rc);
+
+  if (rec.nr > rec.data_size / sizeof(IdleTraceVma))
+    return -EINVAL;
+
+  vmas->resize(rec.nr);
+  for (auto& vma: *vmas) {
+    IdleTraceVma tv;
+
+    if ((size_t)(end - data) < sizeof(tv))
+      return -EINVAL;
+
+    memcpy(&tv, data, sizeof(tv));
+    data += sizeof(tv);
+    if ((size_t)(end - data) < tv.path_len)
+      return -EINVAL;
+
+    vma.start = tv.start;
+    vma.end = tv.end;
+    memcpy(vma.perms, tv.perms, sizeof(tv.perms));
+    vma.perms[4] = '\0';
+    vma.read     = (vma.perms[0] == 'r');
+    vma.write    = (vma.perms[1] == 'w');
+    vma.exec     = (vma.perms[2] == 'x');
+    vma.mayshare = (vma.perms[3] != 'p');
+    vma.offset = tv.offset;
+    vma.dev_major = tv.dev_major;
+    vma.dev_minor = tv.dev_minor;
+    vma.ino = tv.ino;
+    vma.path.assign((const char*)data, tv.path_len);
+
+    data += std::min((size_t)(end - data), pad8(tv.path_len));
+  }
+
+  // the first VMAs of each pid serve the scan setup before its first walk
+  if (maps.lower_bound(PidVa(rec.pid, 0)) == maps.upper_bound(PidVa(rec.pid, ~0UL)))
+    ProcMapsCache::pin(rec.pid, vmas);
+
+  maps[key] = vmas;
+  return 0;
+}
+
+// the trace stands in for idle_pages
+int IdleTrace::open_session(pid_t pid)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+
+  if (fd < 0) {
+    perror(path.c_str());
+    return -errno;
+  }
+
+  return fd;
+}
+
+void IdleTrace::start_walk(pid_t pid, unsigned long start)
+{
+  std::lock_guard<std::mutex> guard(mlock);
+  auto it = walks.find(PidVa(pid, start));
+
+  // walks beyond the trace stay with the last VMAs
+  if (it == walks.end() || it->second.empty())
+    return;
+
+  auto m = maps.find(PidVa(pid, it->second.front()));
+  it->second.pop_front();
+
+  if (m != maps.end())
+    ProcMapsCache::pin(pid, m->second);
+}
+
+ssize_t IdleTrace::read(pid_t pid, unsigned long va, uint8_t* buf,
+                        size_t size, unsigned long& nsecs)
+{
+  const IdleTraceRecord* rec;
+
+  {
+    std::lock_guard<std::mutex> guard(mlock);
+    auto it = reads.find(PidVa(pid, va));
+
+    nsecs = 0;
+    if (it == reads.end() || it->second.empty())
+      return 0;
+
+    rec = it->second.front();
+    it->second.pop_front();
+  }
+
+  nsecs = rec->nr;
+  if (rec->rc < 0) {
+    errno = -rec->rc;
+    return -1;
+  }
+
+  if (rec->end != size && rec->rc > (int64_t)size)
+    fprintf(stderr, "idle_pages trace: pid %d read %lu bytes at %lx, recorded %lu\n",
+            pid, size, va, (unsigned long)rec->end);
+
+  size = std::min(size, (size_t)rec->rc);
+  memcpy(buf, rec + 1, size);
+
+  return size;
+}
+
+#ifdef IDLE_TRACE_SELF_TEST
+
+#include "Option.h"
+#include "ProcIdlePages.h"
+
+Option option;
+
+int debug_level()
+{
+  return option.debug_level;
+}
+
+#define IDLE_TRACE_CHECK(cond)                                        \
+  if (!(cond)) {                                                     \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);  \
+    return -1;                                                       \
+  }
+
+class ReplayScan : public ProcIdlePages
+{
+  public:
+    void prepare() {
+      nr_walks = 0;
+      for (int type = 0; type <= MAX_ACCESSED; ++type) {
+        pagetype_refs[type].page_refs.clear();
+        pagetype_refs[type].page_refs.set_pageshift(pagetype_shift[type]);
+      }
+    }
+};
+
+// idle_pages output for a walk of the 2M pages at va, one in 3
+// accessed at 4K granularity
+static void gen_walk(std::vector<uint8_t>& pip, unsigned long va,
+                     int nr_pmds, unsigned int& seed,
+                     std::map<unsigned long, int>& refs)
+{
+  pip.clear();
+  pip.push_back(PIP_CMD_SET_HVA);
+  for (int i = 7; i >= 0; --i)
+    pip.push_back(va >> (i * 8));
+
+  for (int pmd = 0; pmd < nr_pmds; ++pmd) {
+    if (rand_r(&seed) % 3) {
+      pip.push_back(PIP_COMPOSE(PMD_IDLE_PTES, 1));
+      continue;
+    }
+    for (int pte = 0; pte < 512; pte += 8) {
+      bool accessed = rand_r(&seed) & 1;
+
+      pip.push_back(PIP_COMPOSE((accessed ? PTE_ACCESSED : PTE_IDLE), 8));
+      for (int i = 0; i < 8; ++i)
+        refs[va + pmd * PMD_SIZE + (pte + i) * PAGE_SIZE] += accessed;
+    }
+  }
+}
+
+int IdleTrace::self_test()
+{
+  const pid_t pid = 1 << 22;    // beyond pid_max, not a live task
+  const unsigned long va = 0x7f0000000000UL;
+  const int nr_pmds = 32;
+  const int nr_walks = 3;
+  char filename[] = "/tmp/idle-trace-XXXXXX";
+  std::map<unsigned long, int> refs;
+  std::vector<uint8_t> pip;
+  unsigned int seed = 1;
+  int fd;
+
+  fd = mkstemp(filename);
+  IDLE_TRACE_CHECK(fd >= 0);
+  ::close(fd);
+
+  // record what a walk of one anonymous VMA would have read
+  auto vmas = std::make_shared<std::vector<proc_maps_entry>>(1);
+  proc_maps_entry& vma = vmas->front();
+  vma.start = va;
+  vma.end = va + nr_pmds * PMD_SIZE;
+  strcpy(vma.perms, "rw-p");
+  vma.read = vma.write = true;
+  vma.path = "[anon]";
+
+  IDLE_TRACE_CHECK(open_record(filename) == 0);
+  for (int w = 0; w < nr_walks; ++w) {
+    gen_walk(pip, va, nr_pmds, seed, refs);
+    record_walk(pid, 0, TASK_SIZE_MAX, vmas);
+    record_read(pid, va, PAGE_SIZE, pip.size(), pip.data(), 1000);
+  }
+  close();
+
+  // and replay it through ProcIdlePages
+  IDLE_TRACE_CHECK(setup("", filename) == 0);
+  IDLE_TRACE_CHECK(trace->get_ranges().size() == 1);
+  IDLE_TRACE_CHECK(trace->get_ranges()[0].pid == pid);
+
+  ReplayScan scan;
+  scan.set_pid(pid);
+  scan.prepare();
+  for (int w = 0; w < nr_walks; ++w)
+    IDLE_TRACE_CHECK(scan.walk() == 0);
+
+  IDLE_TRACE_CHECK(scan.get_read_stats().nr_reads == 1);
+  IDLE_TRACE_CHECK(scan.get_read_stats().nsecs == 1000);
+
+  AddrSequence& page_refs = scan.get_pagetype_refs(PTE_ACCESSED).page_refs;
+  IDLE_TRACE_CHECK(page_refs.size() == (unsigned long)nr_pmds * 512);
+  for (auto& entry: page_refs)
+    IDLE_TRACE_CHECK(refs[entry.addr] == entry.payload);
+
+  // beyond the trace
+  IDLE_TRACE_CHECK(scan.walk() == 0);
+  IDLE_TRACE_CHECK(scan.get_read_stats().read_bytes == 0);
+
+  ProcMapsView view = ProcMapsCache::get(pid);
+  IDLE_TRACE_CHECK(view->size() == 1 && view->front().path == vma.path);
+
+  scan.close_session();
+  setup("", "");
+  unlink(filename);
+
+  printf("idle trace self test passed\n");
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  IdleTrace t;
+
+  return t.self_test();
+}
+
+#endif
+// vim:set ts=2 sw=2 et:
@@ -0,0 +1,182 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#ifndef AEP_IDLE_TRACE_H
+#define AEP_IDLE_TRACE_H
+
+// record/replay of the idle_pages reads of a scan
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+#include "ProcMaps.h"
+
+// The trace file is the header followed by records, each record by its
+// data padded to 8 bytes. Numbers are in host byte order.
+//
+// TRACE_MAPS   VMAs of pid, data: nr IdleTraceVma, each followed by its path
+// TRACE_WALK   one ProcIdlePages::walk() of [va, end) with VMAs generation
+// TRACE_READ   one read at va, data: the rc bytes returned by the kernel
+#define IDLE_TRACE_MAGIC    "AEPIDLT"
+#define IDLE_TRACE_VERSION  1
+
+struct IdleTraceHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t start_time;          // CLOCK_REALTIME ns
+};
+
+enum IdleTraceType
+{
+  TRACE_MAPS = 1,
+  TRACE_WALK,
+  TRACE_READ,
+};
+
+struct IdleTraceRecord
+{
+  uint32_t type;
+  int32_t  pid;
+  uint64_t nsecs;               // CLOCK_MONOTONIC ns since the trace start
+  uint64_t va;
+  uint64_t end;                 // WALK: va end, READ: requested size
+  int64_t  rc;                  // READ: bytes or -errno, WALK/MAPS: generation
+  uint64_t nr;                  // MAPS: VMAs, READ: syscall ns
+  uint64_t data_size;           // data bytes following, before padding
+};
+
+struct IdleTraceVma
+{
+  uint64_t start;
+  uint64_t end;
+  uint64_t offset;
+  uint64_t ino;
+  int32_t  dev_major;
+  int32_t  dev_minor;
+  char     perms[4];
+  uint32_t path_len;            // path bytes following, padded to 8
+};
+
+// A recorded scan range, as walked
+struct IdleTraceRange
+{
+  pid_t pid;
+  unsigned long start;
+  unsigned long end;
+};
+
+// Stands in for the idle_pages of all tasks, see IdleTrace::set_source()
+class IdlePagesSource
+{
+  public:
+    virtual ~IdlePagesSource() {}
+
+    // an fd for the scan session of pid, closed by the caller
+    virtual int open_session(pid_t pid) = 0;
+    // before each walk of the range at start
+    virtual void start_walk(pid_t pid, unsigned long start) = 0;
+    // Read at va like pread() of idle_pages, setting errno on errors.
+    // nsecs is the kernel time it stands for.
+    virtual ssize_t read(pid_t pid, unsigned long va, uint8_t* buf,
+                         size_t size, unsigned long& nsecs) = 0;
+    // scan ranges of all tasks
+    virtual const std::vector<IdleTraceRange>& get_ranges() = 0;
+};
+
+class IdleTrace : public IdlePagesSource
+{
+  public:
+    IdleTrace();
+    ~IdleTrace();
+
+    // Set up the process wide trace, at most one of the paths non-empty.
+    // A replayed trace becomes the source. Negative errno on failure.
+    static int setup(const std::string& record_path,
+                     const std::string& replay_path);
+    static IdleTrace* get() { return trace; }
+    static bool recording() { return trace && trace->out; }
+
+    // Scan the source instead of the tasks; NULL to scan the tasks.
+    // Migration and node lookups are skipped with a source, for its pids
+    // are not the scanned tasks.
+    static void set_source(IdlePagesSource* s) { source = s; }
+    static IdlePagesSource* get_source() { return source; }
+
+    int open_record(const std::string& path);
+    int open_replay(const std::string& path);
+    void close();
+
+    const std::string& get_path() { return path; }
+
+    // recording, thread safe
+    void record_walk(pid_t pid, unsigned long start, unsigned long end,
+                     const ProcMapsView& maps);
+    void record_read(pid_t pid, unsigned long va, size_t size,
+                     ssize_t rc, const uint8_t* buf, unsigned long nsecs);
+
+    // Replay, thread safe. start_walk() pins the VMAs of the next walk of
+    // the range in ProcMapsCache. read() consumes the next read of pid at
+    // va, returning its rc and errno, or 0 when the trace has no more of
+    // them.
+    int open_session(pid_t pid);
+    void start_walk(pid_t pid, unsigned long start);
+    ssize_t read(pid_t pid, unsigned long va, uint8_t* buf,
+                 size_t size, unsigned long& nsecs);
+
+    // scan ranges in the order first walked
+    const std::vector<IdleTraceRange>& get_ranges() { return ranges; }
+
+#ifdef IDLE_TRACE_SELF_TEST
+    int self_test();
+#endif
+
+  private:
+    void write_record(IdleTraceRecord& rec, const void* data);
+    void write_maps(pid_t pid, unsigned long generation,
+                    const std::vector<proc_maps_entry>& maps);
+    int load_maps(const IdleTraceRecord& rec, const uint8_t* data);
+    unsigned long now_nsecs();
+
+  private:
+    typedef std::pair<pid_t, unsigned long> PidVa;
+
+    struct WalkMaps
+    {
+      ProcMapsView maps;        // keeps the recorded generation alive
+      unsigned long generation = 0;
+    };
+
+    static IdleTrace* trace;
+    static IdlePagesSource* source;
+
+    std::string path;
+    std::mutex mlock;
+    unsigned long start_nsecs;
+
+    // recording
+    FILE* out;
+    std::unordered_map<pid_t, WalkMaps> recorded_maps;
+
+    // replay
+    std::vector<uint8_t> image;
+    std::map<PidVa, std::deque<unsigned long>> walks;   // => generation
+    std::map<PidVa, std::deque<const IdleTraceRecord*>> reads;
+    std::map<PidVa, std::shared_ptr<std::vector<proc_maps_entry>>> maps;
+    std::vector<IdleTraceRange> ranges;
+};
+
+#endif
+// vim:set ts=2 sw=2 et:
@@ -0,0 +1,174 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "MigrateScheduler.h"
+
+static unsigned long now_nsecs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void MigrateScheduler::set_limits(int pair_jobs, int node_jobs)
+{
+  std::lock_guard<std::mutex> guard(mlock);
+
+  max_pair_jobs = pair_jobs;
+  max_node_jobs = node_jobs;
+}
+
+bool MigrateScheduler::can_run(int from, int to)
+{
+  if (max_pair_jobs > 0 && pairs[{from, to}].running >= max_pair_jobs)
+    return false;
+  if (max_node_jobs > 0 && node_running[from] >= max_node_jobs)
+    return false;
+
+  return true;
+}
+
+void MigrateScheduler::acquire(int from, int to)
+{
+  std::unique_lock<std::mutex> lock(mlock);
+  unsigned long t = now_nsecs();
+  unsigned long now;
+
+  while (!can_run(from, to))
+    cond.wait(lock);
+
+  now = now_nsecs();
+
+  PairStats& stats = pairs[{from, to}];
+  stats.wait_nsecs += now - t;
+  if (!stats.running++)
+    stats.busy_since = now;
+  stats.max_running = std::max(stats.max_running, stats.running);
+  ++node_running[from];
+}
+
+void MigrateScheduler::release(int from, int to, unsigned long bytes)
+{
+  {
+    std::lock_guard<std::mutex> guard(mlock);
+    PairStats& stats = pairs[{from, to}];
+
+    ++stats.nr_calls;
+    stats.bytes += bytes;
+    if (!--stats.running)
+      stats.busy_nsecs += now_nsecs() - stats.busy_since;
+    --node_running[from];
+  }
+
+  // the waiters are for different pairs
+  cond.notify_all();
+}
+
+void MigrateScheduler::show()
+{
+  std::lock_guard<std::mutex> guard(mlock);
+
+  if (pairs.empty())
+    return;
+
+  printf("\nMigration by node pair (jobs limit: pair %d, node %d):\n",
+         max_pair_jobs, max_node_jobs);
+  printf("%4s %4s %10s %8s %8s %8s %8s %8s\n",
+         "from", "to", "moved_MB", "calls", "max_jobs",
+         "busy_s", "wait_s", "GB/s");
+  for (auto& kv : pairs) {
+    const PairStats& stats = kv.second;
+
+    printf("%4d %4d %'10lu %'8lu %8d %8.2f %8.2f %8.2f\n",
+           kv.first.first, kv.first.second,
+           stats.bytes >> 20, stats.nr_calls, stats.max_running,
+           stats.busy_nsecs / 1e9, stats.wait_nsecs / 1e9,
+           stats.busy_nsecs ? (double)stats.bytes / stats.busy_nsecs : 0.0);
+  }
+}
+
+void MigrateScheduler::clear()
+{
+  std::lock_guard<std::mutex> guard(mlock);
+
+  // keep the slots of the calls still running
+  for (auto it = pairs.begin(); it != pairs.end();) {
+    PairStats& stats = it->second;
+
+    if (!stats.running) {
+      it = pairs.erase(it);
+      continue;
+    }
+
+    stats.max_running = stats.running;
+    stats.nr_calls = 0;
+    stats.bytes = 0;
+    stats.busy_nsecs = 0;
+    stats.busy_since = now_nsecs();
+    stats.wait_nsecs = 0;
+    ++it;
+  }
+}
+
+#ifdef MIGRATE_SCHEDULER_SELF_TEST
+
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// 8 threads moving between 2 nodes, pairs capped at 2 and nodes at 3
+int main(int argc, char* argv[])
+{
+  MigrateScheduler scheduler;
+  std::vector<std::thread> threads;
+  std::atomic<int> running[2][2] = {};
+  std::atomic<int> node_running[2] = {};
+  std::atomic<int> errors(0);
+
+  scheduler.set_limits(2, 3);
+
+  for (int t = 0; t < 8; ++t) {
+    threads.push_back(std::thread([&, t]() {
+      for (int i = 0; i < 50; ++i) {
+        int from = (t + i) & 1;
+        int to = (t & 2) ? from : !from;
+
+        scheduler.acquire(from, to);
+        int pair_jobs = ++running[from][to];
+        int node_jobs = ++node_running[from];
+        if (pair_jobs > 2 || node_jobs > 3)
+          ++errors;
+        usleep(100);
+        --running[from][to];
+        --node_running[from];
+        scheduler.release(from, to, 1 << 20);
+      }
+    }));
+  }
+
+  for (auto& th : threads)
+    th.join();
+
+  scheduler.show();
+
+  if (errors) {
+    printf("migrate scheduler: %d calls over the limits\n", (int)errors);
+    return -1;
+  }
+
+  printf("migrate scheduler self test passed\n");
+  return 0;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#ifndef AEP_MIGRATE_SCHEDULER_H
+#define AEP_MIGRATE_SCHEDULER_H
+
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+
+// Admits the move calls of the migrating ranges, at most max_pair_jobs
+// at a time from one node to another, and max_node_jobs at a time from
+// one source node, so that the ranges of different tasks and node pairs
+// migrate in parallel without saturating a single node. Thread safe.
+class MigrateScheduler
+{
+  public:
+    // 0: no limit
+    void set_limits(int pair_jobs, int node_jobs);
+
+    // wait for a slot to move pages from node from to node to
+    void acquire(int from, int to);
+    // give the slot back, having moved bytes
+    void release(int from, int to, unsigned long bytes);
+
+    // per node pair moved GB, busy seconds and GB/s since clear()
+    void show();
+    void clear();
+
+  private:
+    struct PairStats
+    {
+      int running = 0;
+      int max_running = 0;
+      unsigned long nr_calls = 0;
+      unsigned long bytes = 0;
+      unsigned long busy_nsecs = 0;     // with any calls running
+      unsigned long busy_since = 0;
+      unsigned long wait_nsecs = 0;     // in acquire()
+    };
+
+    bool can_run(int from, int to);
+
+  private:
+    int max_pair_jobs = 0;
+    int max_node_jobs = 0;
+
+    std::mutex mlock;
+    std::condition_variable cond;
+
+    std::map<std::pair<int, int>, PairStats> pairs;
+    std::map<int, int> node_running;
+};
+
+#endif
+// vim:set ts=2 sw=2 et:
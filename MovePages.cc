@@ -12,7 +12,10 @@
 #include <numaif.h>
 #include <limits.h>
 #include <sys/user.h>
+#include <time.h>
 #include <utility>
+#include <algorithm>
+#include <numeric>
 
 #include "lib/stats.h"
 #include "MovePages.h"
@@ -23,12 +26,57 @@
 
 int MoveStats::default_failed = -128;
 
+static unsigned long now_nsecs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void MoveCallStats::clear()
+{
+  nr_calls = 0;
+  nr_pages = 0;
+  kb = 0;
+  nsecs = 0;
+}
+
+void MoveCallStats::add(const MoveCallStats& s)
+{
+  nr_calls += s.nr_calls;
+  nr_pages += s.nr_pages;
+  kb += s.kb;
+  nsecs += s.nsecs;
+}
+
+void MoveCallStats::account(unsigned long npages, unsigned long page_shift,
+                            unsigned long ns)
+{
+  ++nr_calls;
+  nr_pages += npages;
+  kb += npages << (page_shift - 10);
+  nsecs += ns;
+}
+
+void MoveCallStats::show(Formatter& fmt, const char* name)
+{
+  if (!nr_calls)
+    return;
+
+  // throughput of the pages asked to move, moved or not
+  fmt.print("%-12s %'10lu calls %'8lu pages/call %'10.1f MB/s\n",
+            name, nr_calls, nr_pages / nr_calls,
+            nsecs ? (kb >> 10) * 1e9 / nsecs : 0.0);
+}
+
 void MoveStats::clear()
 {
   to_move_kb = 0;
   skip_kb = 0;
   move_kb = 0;
   move_page_status.clear();
+  page_calls.clear();
 }
 
 void MoveStats::add(MoveStats* s)
@@ -36,6 +84,7 @@ void MoveStats::add(MoveStats* s)
   to_move_kb += s->to_move_kb;
   skip_kb += s->skip_kb;
   move_kb += s->move_kb;
+  page_calls.add(s->page_calls);
 }
 
 void MoveStats::save_move_states(int status,
@@ -158,7 +207,7 @@ long MovePages::move_pages(void **addrs, std::vector<int> &move_status,
   if (!is_locate) {
     // move pages
     pnodes = &target_nodes[0];
-    move_status.resize(count, MoveStats::default_failed);
+    move_status.assign(count, MoveStats::default_failed);
     ret = ::move_pages(pid, count, addrs, pnodes, &move_status[0], flags);
   } else {
     // locate pages
@@ -177,17 +226,19 @@ long MovePages::move_pages(void **addrs, std::vector<int> &move_status,
 
 long MovePages::move_pages(void **addrs, int* target_nid, unsigned long size)
 {
+  unsigned long t = now_nsecs();
   long ret;
 
-  status_after_move.resize(size, MoveStats::default_failed);
+  status_after_move.assign(size, MoveStats::default_failed);
   ret = ::move_pages(pid, size, addrs, target_nid, &status_after_move[0], flags);
+  page_calls.account(size, page_shift, now_nsecs() - t);
   if (ret > 0) {
    /*
     * Get page location again because move_pages() API leave "status"
     * array untouched but the pages actually moved successfully when
     * return value > 0 (for example 1 and 2).
     */
-    move_pages(addrs, status_after_move, size, true);
+    locate_failed(addrs, status_after_move, size);
     fprintf(stderr, "WARNING: move_pages return: %ld\n", ret);
   } else if (ret < 0) {
     perror("WARNING: move_pages failed");
@@ -196,6 +247,88 @@ long MovePages::move_pages(void **addrs, int* target_nid, unsigned long size)
   return ret;
 }
 
+// Order of the pages grouped by target node, in their order within each
+// node; false when they are grouped already.
+static bool order_by_node(const int* target_nid, unsigned long size,
+                          std::vector<unsigned long>& order)
+{
+  order.resize(size);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [target_nid](unsigned long a, unsigned long b) {
+                     return target_nid[a] < target_nid[b];
+                   });
+
+  return !std::is_sorted(order.begin(), order.end());
+}
+
+long MovePages::move_pages_by_node(void **addrs, int* target_nid,
+                                   unsigned long size)
+{
+  std::vector<unsigned long> order;
+  std::vector<void*> node_addrs;
+  std::vector<int> node_nids;
+  std::vector<int> result;
+  long ret;
+
+  if (!order_by_node(target_nid, size, order))
+    return move_pages(addrs, target_nid, size);
+
+  node_addrs.reserve(size);
+  node_nids.reserve(size);
+  for (auto i: order) {
+    node_addrs.push_back(addrs[i]);
+    node_nids.push_back(target_nid[i]);
+  }
+
+  ret = move_pages(&node_addrs[0], &node_nids[0], size);
+
+  result.resize(size);
+  for (unsigned long i = 0; i < size; ++i)
+    result[order[i]] = status_after_move[i];
+  status_after_move.swap(result);
+
+  return ret;
+}
+
+void MovePages::take_call_stats(MoveStats* stats)
+{
+  stats->page_calls.add(page_calls);
+  page_calls.clear();
+}
+
+long MovePages::locate_failed(void **addrs, std::vector<int>& node_status,
+                              unsigned long count)
+{
+  std::vector<void*> failed_addrs;
+  std::vector<unsigned long> index;
+  std::vector<int> nids;
+  long ret;
+
+  for (unsigned long i = 0; i < count; ++i) {
+    if (node_status[i] < 0) {
+      failed_addrs.push_back(addrs[i]);
+      index.push_back(i);
+    }
+  }
+
+  if (failed_addrs.empty())
+    return 0;
+
+  nids.resize(failed_addrs.size());
+  ret = ::move_pages(pid, failed_addrs.size(), &failed_addrs[0], NULL,
+                     &nids[0], 0);
+  if (ret < 0) {
+    perror("WARNING: locate pages failed");
+    return ret;
+  }
+
+  for (unsigned long i = 0; i < index.size(); ++i)
+    node_status[index[i]] = nids[i];
+
+  return 0;
+}
+
 long MovePages::locate_move_pages(PidContext *pid_context,
                                   std::vector<void *>& addrs,
                                   MoveStats *stats)
@@ -488,3 +621,84 @@ long MovePages::calc_and_save_state(MoveStats* stats,
 
   return moved_bytes;
 }
+
+#ifdef MOVE_PAGES_SELF_TEST
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MOVE_PAGES_CHECK(cond)                                       \
+  if (!(cond)) {                                                     \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);  \
+    return -1;                                                       \
+  }
+
+int debug_level()
+{
+  return 0;
+}
+
+// Move our own pages grouped by target node; pages to another node
+// only move when there is one.
+static int self_test()
+{
+  const int nr_pages = 64;
+  const int nids_in[] = {1, 0, 1, 2, 0};
+  const unsigned long grouped[] = {1, 4, 0, 2, 3};
+  MovePages migrator;
+  MoveStats stats;
+  std::vector<unsigned long> order;
+  std::vector<void*> addrs;
+  std::vector<int> nids;
+  std::vector<int> status(1);
+  char* buf;
+  void* addr;
+  int nid;
+  int other_nid = -1;
+
+  MOVE_PAGES_CHECK(order_by_node(nids_in, 5, order));
+  MOVE_PAGES_CHECK(std::equal(order.begin(), order.end(), grouped));
+  MOVE_PAGES_CHECK(!order_by_node(nids_in + 1, 2, order));
+
+  buf = (char*)mmap(NULL, nr_pages << PAGE_SHIFT, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  MOVE_PAGES_CHECK(buf != MAP_FAILED);
+  for (int i = 0; i < nr_pages; ++i)
+    buf[i << PAGE_SHIFT] = i;
+
+  addr = buf;
+  MOVE_PAGES_CHECK(!::move_pages(0, 1, &addr, NULL, &status[0], 0));
+  nid = status[0];
+  MOVE_PAGES_CHECK(nid >= 0);
+
+  for (int n = 0; n <= numa_max_node(); ++n)
+    if (n != nid && numa_bitmask_isbitset(numa_all_nodes_ptr, n))
+      other_nid = n;
+
+  for (int i = 0; i < nr_pages; ++i) {
+    addrs.push_back(buf + (i << PAGE_SHIFT));
+    nids.push_back(other_nid >= 0 && i % 3 ? other_nid : nid);
+  }
+
+  migrator.set_pid(getpid());
+  migrator.move_pages_by_node(&addrs[0], &nids[0], addrs.size());
+  migrator.take_call_stats(&stats);
+
+  MOVE_PAGES_CHECK(migrator.get_migration_result().size() == addrs.size());
+  for (int i = 0; i < nr_pages; ++i)
+    MOVE_PAGES_CHECK(migrator.get_migration_result()[i] == nids[i]);
+  MOVE_PAGES_CHECK(stats.page_calls.nr_calls == 1);
+  MOVE_PAGES_CHECK(stats.page_calls.nr_pages == (unsigned long)nr_pages);
+
+  munmap(buf, nr_pages << PAGE_SHIFT);
+
+  printf("move pages self test passed\n");
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  return self_test();
+}
+
+#endif
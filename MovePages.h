@@ -27,6 +27,22 @@ typedef std::unordered_map<int, unsigned long> MovePagesStatusCount;
 class NumaNodeCollection;
 class PidContext;
 
+// the move_pages() calls of a migration
+struct MoveCallStats
+{
+    unsigned long nr_calls;
+    unsigned long nr_pages;
+    unsigned long kb;
+    unsigned long nsecs;
+
+    MoveCallStats() { clear(); }
+    void clear();
+    void add(const MoveCallStats& s);
+    void account(unsigned long npages, unsigned long page_shift,
+                 unsigned long ns);
+    void show(Formatter& fmt, const char* name);
+};
+
 struct MoveStats
 {
     unsigned long to_move_kb;
@@ -38,6 +54,8 @@ struct MoveStats
     const unsigned int result_shift = 16;
     MovePagesStatusCount move_page_status;
 
+    MoveCallStats page_calls;   // move_pages()
+
     MoveStats() { clear(); }
     void clear();
     void add(MoveStats *s);
@@ -85,6 +103,14 @@ class MovePages
     long move_pages(void **addrs, std::vector<int> &move_status,
                     unsigned long count, bool is_locate);
     long move_pages(void **addrs, int* target_nid, unsigned long size);
+    // Like above, with the same results in get_migration_result(), but
+    // the pages are passed to the kernel grouped by target node. The
+    // kernel migrates the pages collected so far each time the target
+    // node changes, so address sorted pages to interleaved nodes would
+    // go in many small migrations.
+    long move_pages_by_node(void **addrs, int* target_nid, unsigned long size);
+    // add the syscall stats since the last call to stats
+    void take_call_stats(MoveStats* stats);
     long locate_move_pages(PidContext* pid_context, std::vector<void *>& addrs,
                            MoveStats *stats);
     void set_numacollection(NumaNodeCollection* new_collection)
@@ -109,6 +135,10 @@ class MovePages
                            unsigned long &total_dram_kb,
                            unsigned long &total_pmem_kb);
   private:
+    // locate the pages of negative node_status, in place
+    long locate_failed(void **addrs, std::vector<int>& node_status,
+                       unsigned long count);
+
     bool is_exceed_dram_quota(PidContext* pid_context);
     void dec_dram_quota(PidContext* pid_context, long dec_value);
 
@@ -123,6 +153,8 @@ class MovePages
     unsigned long page_shift;
     unsigned long batch_size; // used by locate_move_pages()
 
+    MoveCallStats page_calls;
+
     // Get the status after migration
     std::vector<int> status;
     std::vector<int> status_after_move;
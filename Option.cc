@@ -31,6 +31,11 @@ std::unordered_map<std::string, Placement> Option::placement_name_map = {
   {"pmem", PLACEMENT_PMEM},
 };
 
+std::unordered_map<std::string, HistoryScore> Option::history_score_name_map = {
+  {"ewma",   HISTORY_SCORE_EWMA},
+  {"last_n", HISTORY_SCORE_LAST_N},
+};
+
 int Option::set_dram_percent(int dp)
 {
   if (dp < 0 || dp > 100) {
@@ -62,6 +67,12 @@ void Option::dump()
   printf("dump_processes = %d\n", (int)dump_processes);
   printf("hot_min_refs = %d\n", hot_min_refs);
   printf("cold_max_refs = %d\n", cold_max_refs);
+  printf("dirty_min_refs = %d\n", dirty_min_refs);
+  printf("migrate_nid_max_age = %g\n", migrate_nid_max_age);
+  printf("migrate_by_hotness = %d\n", (int)migrate_by_hotness);
+  printf("migrate_async = %d\n", (int)migrate_async);
+  printf("migrate_pair_jobs = %d\n", migrate_pair_jobs);
+  printf("migrate_node_jobs = %d\n", migrate_node_jobs);
   printf("max_threads = %d\n", max_threads);
   printf("split_rss_size = %s\n", split_rss_size.c_str());
   printf("bandwidth_mbps = %g\n", bandwidth_mbps);
@@ -75,6 +86,17 @@ void Option::dump()
   printf("interval_scale = %d\n", interval_scale);
   printf("progressive_profile = %s\n", progressive_profile.c_str());
   printf("max_stable_page_sleep = %d\n", max_stable_page_sleep);
+  printf("addr_seq_soa = %d\n", (int)addr_seq_soa);
+  printf("addr_seq_hugepage = %d\n", addr_seq_hugepage);
+  printf("addr_seq_payload_bits = %d\n", addr_seq_payload_bits);
+  printf("skim_idle_walks = %d\n", skim_idle_walks);
+  printf("page_history = %d\n", page_history);
+  printf("page_history_score = %d\n", page_history_score);
+  printf("page_history_ewma = %d\n", page_history_ewma);
+  printf("snapshot_dir = %s\n", snapshot_dir.c_str());
+  printf("idle_trace_record = %s\n", idle_trace_record.c_str());
+  printf("idle_trace_replay = %s\n", idle_trace_replay.c_str());
+  printf("idle_pages_synth = %s\n", idle_pages_synth.c_str());
 
   for (size_t i = 0; i < policies.size(); ++i) {
       printf("policy %ld:\n", i);
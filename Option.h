@@ -32,6 +32,13 @@ typedef enum {
 } Placement;
 
 
+typedef enum {
+  HISTORY_SCORE_EWMA,     // exponentially weighted moving average
+  HISTORY_SCORE_LAST_N,   // plain average of the last page_history rounds
+  HISTORY_SCORE_END,
+} HistoryScore;
+
+
 struct Policy
 {
   Policy() {
@@ -118,6 +125,7 @@ public:
   static std::unordered_map<std::string, bool> bool_name_map;
   static std::unordered_map<std::string, MigrateWhat> migrate_name_map;
   static std::unordered_map<std::string, Placement> placement_name_map;
+  static std::unordered_map<std::string, HistoryScore> history_score_name_map;
 
   pid_t pid = -1;
 
@@ -149,6 +157,11 @@ public:
   int hot_min_refs = -1;
   int cold_max_refs = -1;
 
+  // also scan the dirty bits and count the walks each page was written in,
+  // 0 disables. Pages written in this many walks of a round are write-hot:
+  // promoted first among those at the hot threshold, and never demoted.
+  int dirty_min_refs = 0;
+
   int exit_on_stabilized = 0; // percent moved
   bool exit_on_exceeded = false; // when exceed dram_percent
   bool dump_options = false;
@@ -171,6 +184,26 @@ public:
 
   int debug_move_pages = 0;
 
+  // seconds the page nids found by the first walk of a round are trusted
+  // at migration, 0 disables. Past it, migrate() looks up the nids again
+  // before picking the pages to move by them.
+  float migrate_nid_max_age = 0;
+
+  // migrate the hottest PMEM pages and the coldest DRAM pages first, so a
+  // round cut short by the bandwidth or the DRAM quota moves what matters
+  // most; pages of the same refs still go in address order
+  bool migrate_by_hotness = false;
+
+  // migrate the pages selected by a round on their own threads while the
+  // next round walks, instead of between the rounds
+  bool migrate_async = false;
+
+  // max move calls at a time from one node to another, and from one
+  // source node, over all migrating ranges; 0: no limit. Either one set
+  // moves each batch by node pair and reports the GB/s of each pair.
+  int migrate_pair_jobs = 0;
+  int migrate_node_jobs = 0;
+
   bool show_numa_stats = false;
   // Not used for now, so current sys-refs behavior is to ignore all processes
   // w/o a policy defined. In future, may consider applying this to all
@@ -188,6 +221,40 @@ public:
 
   std::string progressive_profile;
 
+  // store AddrSequence fields in separate arrays, which speeds up
+  // passes reading only payload and nid
+  bool addr_seq_soa = false;
+
+  // backing of the AddrSequence buffer pool regions:
+  // 0: normal pages, 1: THP, 2: hugetlb (falls back to THP)
+  int addr_seq_hugepage = 0;
+
+  // bits of the per page refs counter, 8 or 16; 16 allows nr_walks
+  // beyond 255 at 1 more byte per page
+  int addr_seq_payload_bits = 8;
+
+  // skim mode for the walks after the first one of a round, 0 disables:
+  // idle PMDs are read as a whole without their PTEs, and 1G regions idle
+  // for this many walks are skipped for as many walks before a re-read
+  int skim_idle_walks = 0;
+
+  // rounds of per page access history kept across scan rounds and blended
+  // into the refs of each round, 0 disables, max 64
+  int page_history = 0;
+  HistoryScore page_history_score = HISTORY_SCORE_EWMA;
+  int page_history_ewma = 50; // percent weight of the latest round
+
+  // save per page refs of each range to <snapshot_dir>/<pid>-<va_start>.snap
+  // after each round, see EPTScan::save_snapshot()
+  std::string snapshot_dir;
+
+  // record the idle_pages reads and VMAs of the scans to a trace file,
+  // or scan a recorded trace instead of the tasks, see IdleTrace
+  std::string idle_trace_record;
+  std::string idle_trace_replay;
+  // scan made up tasks instead, see SyntheticIdlePages::parse()
+  std::string idle_pages_synth;
+
 private:
   PolicySet  policies;
 };
@@ -120,6 +120,19 @@ int OptionParser::parse_option(YAML::Node &&option_node)
       OP_GET_VALUE("interval_scale", interval_scale);
       OP_GET_VALUE("progressive_profile", progressive_profile);
       OP_GET_VALUE("max_stable_page_sleep", max_stable_page_sleep);
+      OP_GET_VALUE("addr_seq_hugepage", addr_seq_hugepage);
+      OP_GET_VALUE("addr_seq_payload_bits", addr_seq_payload_bits);
+      OP_GET_VALUE("dirty_min_refs", dirty_min_refs);
+      OP_GET_VALUE("migrate_nid_max_age", migrate_nid_max_age);
+      OP_GET_VALUE("migrate_pair_jobs", migrate_pair_jobs);
+      OP_GET_VALUE("migrate_node_jobs", migrate_node_jobs);
+      OP_GET_VALUE("skim_idle_walks", skim_idle_walks);
+      OP_GET_VALUE("page_history", page_history);
+      OP_GET_VALUE("page_history_ewma", page_history_ewma);
+      OP_GET_VALUE("snapshot_dir", snapshot_dir);
+      OP_GET_VALUE("idle_trace_record", idle_trace_record);
+      OP_GET_VALUE("idle_trace_replay", idle_trace_replay);
+      OP_GET_VALUE("idle_pages_synth", idle_pages_synth);
 #undef OP_GET_VALUE
 
       std::string str_val;
@@ -135,8 +148,17 @@ int OptionParser::parse_option(YAML::Node &&option_node)
       OP_GET_BOOL_VALUE("show_numa_stats", show_numa_stats, 2);
       OP_GET_BOOL_VALUE("exit_on_converged", exit_on_converged, 2);
       OP_GET_BOOL_VALUE("use_free_dram_first", use_free_dram_first, 2);
+      OP_GET_BOOL_VALUE("migrate_by_hotness", migrate_by_hotness, 2);
+      OP_GET_BOOL_VALUE("migrate_async", migrate_async, 2);
+      OP_GET_BOOL_VALUE("addr_seq_soa", addr_seq_soa, 2);
 #undef OP_GET_BOOL_VALUE
 
+      if (get_value(iter, "page_history_score", str_val)) {
+        Option::parse_name_map(history_score_name_map, str_val,
+                               page_history_score, HISTORY_SCORE_END);
+        continue;
+      }
+
       YAML::Node sub_node;
       if (get_value(iter, "numa_nodes", sub_node)) {
         parse_numa_nodes(sub_node);
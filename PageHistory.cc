@@ -0,0 +1,317 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "PageHistory.h"
+
+PageHistory::PageHistory()
+{
+  touched = false;
+  ewma_percent = 0;
+  set_rounds(8);
+  set_score(HISTORY_SCORE_EWMA, 50);
+}
+
+void PageHistory::set_rounds(int rounds)
+{
+  nr_rounds = std::max(1, std::min(rounds, (int)MAX_ROUNDS));
+  mask = nr_rounds == MAX_ROUNDS ? ~0UL : (1UL << nr_rounds) - 1;
+}
+
+void PageHistory::set_score(HistoryScore type, int percent)
+{
+  float a;
+  float w;
+
+  score_type = type;
+  if (percent == ewma_percent)
+    return;
+
+  ewma_percent = std::max(1, std::min(percent, 100));
+  a = ewma_percent / 100.0;
+  w = a;
+  for (int i = 0; i < MAX_ROUNDS; ++i) {
+    ewma_weight[i] = w;
+    w *= 1 - a;
+  }
+}
+
+void PageHistory::clear()
+{
+  segments.clear();
+}
+
+// Move the pages in [start, end) out of the segments into addrs/bits.
+// Segments partly inside the range are cut at its boundaries.
+void PageHistory::take_range(unsigned long start, unsigned long end,
+                             std::vector<unsigned long>& addrs,
+                             std::vector<uint64_t>& bits)
+{
+  auto it = segments.upper_bound(start);
+
+  if (it != segments.begin())
+    --it;
+
+  while (it != segments.end() && it->first < end) {
+    Segment& seg = it->second;
+
+    if (seg.end <= start) {
+      ++it;
+      continue;
+    }
+
+    size_t lo = std::lower_bound(seg.addrs.begin(), seg.addrs.end(), start)
+                - seg.addrs.begin();
+    size_t hi = std::lower_bound(seg.addrs.begin(), seg.addrs.end(), end)
+                - seg.addrs.begin();
+
+    addrs.insert(addrs.end(), seg.addrs.begin() + lo, seg.addrs.begin() + hi);
+    bits.insert(bits.end(), seg.bits.begin() + lo, seg.bits.begin() + hi);
+
+    if (seg.end > end) {
+      Segment& tail = segments[end];
+
+      tail.end = seg.end;
+      tail.addrs.assign(seg.addrs.begin() + hi, seg.addrs.end());
+      tail.bits.assign(seg.bits.begin() + hi, seg.bits.end());
+    }
+
+    if (it->first < start) {
+      seg.end = start;
+      seg.addrs.resize(lo);
+      seg.bits.resize(lo);
+      ++it;
+    } else {
+      it = segments.erase(it);
+    }
+  }
+}
+
+void PageHistory::update(AddrSequence& refs, int nr_walks,
+                         unsigned long start, unsigned long end)
+{
+  std::vector<unsigned long> old_addrs;
+  std::vector<uint64_t> old_bits;
+  std::vector<unsigned long> new_addrs;
+  std::vector<uint64_t> new_bits;
+  size_t i = 0;
+
+  take_range(start, end, old_addrs, old_bits);
+  new_addrs.reserve(old_addrs.size());
+  new_bits.reserve(old_bits.size());
+
+  auto save = [&](unsigned long addr, uint64_t bits) {
+    if (bits) {
+      new_addrs.push_back(addr);
+      new_bits.push_back(bits);
+    }
+  };
+
+  refs.update_payloads([&](unsigned long addr, payload_t& payload) {
+    uint64_t bits = 0;
+
+    if (addr < start || addr >= end)
+      return;
+
+    // not seen in this round
+    for (; i < old_addrs.size() && old_addrs[i] < addr; ++i)
+      save(old_addrs[i], (old_bits[i] << 1) & mask);
+
+    if (i < old_addrs.size() && old_addrs[i] == addr)
+      bits = old_bits[i++];
+
+    bits = ((bits << 1) | (payload && payload * 2 >= nr_walks)) & mask;
+    save(addr, bits);
+
+    payload = score(bits, payload, nr_walks);
+  });
+
+  for (; i < old_addrs.size(); ++i)
+    save(old_addrs[i], (old_bits[i] << 1) & mask);
+
+  if (!new_addrs.empty()) {
+    Segment& seg = segments[start];
+
+    seg.end = end;
+    seg.addrs.swap(new_addrs);
+    seg.bits.swap(new_bits);
+  }
+
+  touched = true;
+}
+
+// refs stands for the latest round, bits >> 1 for the earlier ones
+int PageHistory::score(uint64_t bits, int refs, int nr_walks)
+{
+  float sum;
+
+  bits >>= 1;
+
+  if (score_type == HISTORY_SCORE_LAST_N)
+    return (refs + nr_walks * __builtin_popcountl(bits) + nr_rounds / 2)
+           / nr_rounds;
+
+  sum = ewma_weight[0] * refs;
+  while (bits) {
+    int i = __builtin_ctzl(bits);
+
+    sum += ewma_weight[i + 1] * nr_walks;
+    bits &= bits - 1;
+  }
+
+  return std::min(nr_walks, (int)(sum + 0.5));
+}
+
+void PageHistory::forget(unsigned long start, unsigned long end)
+{
+  std::vector<unsigned long> addrs;
+  std::vector<uint64_t> bits;
+
+  take_range(start, end, addrs, bits);
+}
+
+uint64_t PageHistory::get_bits(unsigned long addr)
+{
+  auto it = segments.upper_bound(addr);
+
+  if (it == segments.begin())
+    return 0;
+  --it;
+
+  Segment& seg = it->second;
+  auto pos = std::lower_bound(seg.addrs.begin(), seg.addrs.end(), addr);
+
+  if (pos == seg.addrs.end() || *pos != addr)
+    return 0;
+
+  return seg.bits[pos - seg.addrs.begin()];
+}
+
+unsigned long PageHistory::size()
+{
+  unsigned long sum = 0;
+
+  for (auto& kv: segments)
+    sum += kv.second.addrs.size();
+
+  return sum;
+}
+
+#ifdef PAGE_HISTORY_SELF_TEST
+
+#define PAGE_HISTORY_CHECK(cond)                                     \
+  if (!(cond)) {                                                     \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);  \
+    return -1;                                                       \
+  }
+
+// pages 0..nr-1 at 4K, page i accessed in refs_fn(round, i) of nr_walks scans
+template<class F>
+static void fill_round(AddrSequence& refs, int nr, int nr_walks, F refs_fn)
+{
+  refs.clear();
+  refs.set_pageshift(12);
+
+  for (int w = 0; w < nr_walks; ++w) {
+    refs.rewind();
+    for (int i = 0; i < nr; ++i)
+      refs.inc_payload(0x100000 + ((unsigned long)i << 12), w < refs_fn(i));
+  }
+}
+
+static int payload_of(AddrSequence& refs, int i)
+{
+  for (auto& entry: refs)
+    if (entry.addr == 0x100000 + ((unsigned long)i << 12))
+      return entry.payload;
+
+  return -1;
+}
+
+int PageHistory::self_test()
+{
+  const int nr_walks = 4;
+  const unsigned long start = 0x100000;
+  const unsigned long end = start + (64UL << 12);
+  const unsigned long mid = start + (32UL << 12);
+  AddrSequence refs;
+
+  // LAST_N over 4 rounds
+  clear();
+  set_rounds(4);
+  set_score(HISTORY_SCORE_LAST_N, 50);
+
+  // page 0 always hot, page 1 hot in the first round only, page 2 warm
+  fill_round(refs, 64, nr_walks, [](int i) { return i == 0 || i == 1 ? 4 : i == 2 ? 2 : 0; });
+  update(refs, nr_walks, start, end);
+  PAGE_HISTORY_CHECK(get_bits(start) == 1);
+  PAGE_HISTORY_CHECK(get_bits(start + (1 << 12)) == 1);
+  PAGE_HISTORY_CHECK(get_bits(start + (2 << 12)) == 1);
+  PAGE_HISTORY_CHECK(size() == 3);
+  PAGE_HISTORY_CHECK(payload_of(refs, 0) == 1);  // (4 + 0 + 2) / 4
+
+  for (int round = 1; round < 4; ++round) {
+    fill_round(refs, 64, nr_walks, [](int i) { return i == 0 ? 4 : 0; });
+    update(refs, nr_walks, start, end);
+  }
+  PAGE_HISTORY_CHECK(get_bits(start) == 0xf);
+  PAGE_HISTORY_CHECK(payload_of(refs, 0) == 4);  // (4 + 4 * 3 + 2) / 4
+  PAGE_HISTORY_CHECK(get_bits(start + (1 << 12)) == 0x8);
+  PAGE_HISTORY_CHECK(payload_of(refs, 1) == 1);  // (0 + 4 + 2) / 4
+
+  // page 1 expires after 4 idle rounds
+  fill_round(refs, 64, nr_walks, [](int i) { return i == 0 ? 4 : 0; });
+  update(refs, nr_walks, start, end);
+  PAGE_HISTORY_CHECK(get_bits(start + (1 << 12)) == 0);
+  PAGE_HISTORY_CHECK(size() == 1);
+
+  // the same pages scanned as 2 ranges keep their history
+  fill_round(refs, 64, nr_walks, [](int i) { return i == 0 || i == 40 ? 4 : 0; });
+  update(refs, nr_walks, start, mid);
+  update(refs, nr_walks, mid, end);
+  PAGE_HISTORY_CHECK(get_bits(start) == 0xf);
+  PAGE_HISTORY_CHECK(get_bits(start + (40 << 12)) == 1);
+  PAGE_HISTORY_CHECK(segments.size() == 2);
+
+  // and back to 1 range
+  fill_round(refs, 64, nr_walks, [](int i) { return i == 40 ? 4 : 0; });
+  update(refs, nr_walks, start, end);
+  PAGE_HISTORY_CHECK(get_bits(start) == 0xe);
+  PAGE_HISTORY_CHECK(get_bits(start + (40 << 12)) == 3);
+  PAGE_HISTORY_CHECK(segments.size() == 1);
+
+  // page 40 unmapped
+  forget(start + (40 << 12), start + (41 << 12));
+  PAGE_HISTORY_CHECK(get_bits(start + (40 << 12)) == 0);
+  PAGE_HISTORY_CHECK(get_bits(start) == 0xe);
+  PAGE_HISTORY_CHECK(size() == 1);
+
+  // EWMA: a page hot in all rounds approaches nr_walks,
+  // a new hot page starts at ewma_percent of it
+  clear();
+  set_rounds(16);
+  set_score(HISTORY_SCORE_EWMA, 50);
+  for (int round = 0; round < 16; ++round) {
+    fill_round(refs, 64, nr_walks, [round](int i) { return i == 0 || (i == 1 && round == 15) ? 4 : 0; });
+    update(refs, nr_walks, start, end);
+  }
+  PAGE_HISTORY_CHECK(payload_of(refs, 0) == 4);
+  PAGE_HISTORY_CHECK(payload_of(refs, 1) == 2);
+
+  printf("page history self test passed\n");
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  PageHistory history;
+
+  return history.self_test();
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#ifndef AEP_PAGE_HISTORY_H
+#define AEP_PAGE_HISTORY_H
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#include "Option.h"
+#include "AddrSequence.h"
+
+// Per page access history of one task across scan rounds.
+//
+// Each page keeps a shift register with one bit per round, bit 0 being the
+// latest round. A round sets the bit when the page was accessed in at least
+// half of its scans. Only pages with some bit set are kept, in address
+// order, one segment per scanned VA range.
+class PageHistory
+{
+  public:
+    PageHistory();
+
+    // number of rounds remembered, 1..MAX_ROUNDS
+    void set_rounds(int rounds);
+    void set_score(HistoryScore type, int ewma_percent);
+    void clear();
+
+    // Shift in the round just scanned into refs for pages in [start, end),
+    // and replace the refs payloads with the recency weighted score, which
+    // stays in the same [0, nr_walks] range.
+    void update(AddrSequence& refs, int nr_walks,
+                unsigned long start, unsigned long end);
+
+    // drop the history of pages in [start, end), e.g. after munmap()
+    void forget(unsigned long start, unsigned long end);
+
+    uint64_t get_bits(unsigned long addr);
+    unsigned long size();
+
+    bool is_touched() { return touched; }
+    void clear_touched() { touched = false; }
+
+#ifdef PAGE_HISTORY_SELF_TEST
+    int self_test();
+#endif
+
+  private:
+    struct Segment
+    {
+      unsigned long end;
+      std::vector<unsigned long> addrs;
+      std::vector<uint64_t> bits;
+    };
+
+    void take_range(unsigned long start, unsigned long end,
+                    std::vector<unsigned long>& addrs,
+                    std::vector<uint64_t>& bits);
+    int score(uint64_t bits, int refs, int nr_walks);
+
+  private:
+    static const int MAX_ROUNDS = 64;
+
+    int nr_rounds;
+    uint64_t mask;
+    HistoryScore score_type;
+    int ewma_percent;
+    // ewma_weight[i]: weight of the round i rounds before the latest one
+    float ewma_weight[MAX_ROUNDS];
+    bool touched;
+
+    std::map<unsigned long, Segment> segments;
+};
+
+#endif
+// vim:set ts=2 sw=2 et:
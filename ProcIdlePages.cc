@@ -18,10 +18,15 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #include "Option.h"
 #include "ProcIdlePages.h"
+#include "IdleTrace.h"
 #include "lib/debug.h"
 
 extern Option option;
@@ -108,9 +113,157 @@ ProcIdlePages::ProcIdlePages()
   va_start = 0;
   va_end = TASK_SIZE_MAX;
   io_error = 0;
+  pid = 0;
+  idle_fd = -1;
+  read_buf = NULL;
+  use_pread = true;
+  read_stats.clear();
+  open_nsecs = 0;
+  skim_walks = 0;
+  skim_fd = false;
+  skim_last_region = NULL;
+  skim_last_index = 0;
+  bytes_per_gb = 0;
+  walk_read_bytes = 0;
+  walk_read_va = 0;
 }
 
-int ProcIdlePages::walk_vma(proc_maps_entry& vma)
+ProcIdlePages::~ProcIdlePages()
+{
+  close_session();
+}
+
+std::atomic<int> ProcIdlePages::nr_sessions(0);
+
+void ProcIdlePages::close_session()
+{
+  if (idle_fd >= 0) {
+    close(idle_fd);
+    idle_fd = -1;
+    --nr_sessions;
+  }
+
+  address_map.reset();
+}
+
+static unsigned long now_nsecs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+off_t ProcIdlePages::seek_idle(unsigned long va, int whence)
+{
+  unsigned long t = now_nsecs();
+  off_t pos;
+
+  pos = lseek(idle_fd, va_to_offset(va), whence);
+
+  read_stats.nsecs += now_nsecs() - t;
+  ++read_stats.nr_syscalls;
+
+  return pos;
+}
+
+// Read size for [va, end). The kernel walks size * 8 pages of VA, which
+// the records of a sparse range fit in easily. A dense range may take
+// more, so make room for it at the density of the last walk, to be read
+// in one go rather than as many partial reads.
+unsigned long ProcIdlePages::read_size(unsigned long va, unsigned long end)
+{
+  unsigned long size = (end - va + (7 << PAGE_SHIFT)) >> (3 + PAGE_SHIFT);
+
+  if (bytes_per_gb) {
+    unsigned long expect = (((end - va) >> 20) * bytes_per_gb) >> 10;
+
+    size = std::max(size, expect + expect / 4);
+  }
+
+  return std::min(std::max(size, min_read_size), (unsigned long)MAX_READ_SIZE);
+}
+
+// Scratch buffers are per thread rather than per range, as a daemon may
+// have thousands of ranges but only walks max_threads of them at a time.
+// Left uninitialized, the part of a large read never written by the
+// kernel doesn't take RSS.
+struct ReadBuffer
+{
+  std::unique_ptr<uint8_t[]> buf;
+  size_t size = 0;
+};
+static thread_local ReadBuffer thread_read_buf;
+
+ssize_t ProcIdlePages::read_idle(unsigned long va, size_t size)
+{
+  unsigned long t = now_nsecs();
+  unsigned long nsecs;
+  ssize_t rc;
+
+  // plus slack for u8_to_u64() on a truncated SET_HVA at the end
+  if (thread_read_buf.size < size) {
+    thread_read_buf.buf.reset(new uint8_t[size + sizeof(uint64_t)]);
+    thread_read_buf.size = size;
+  }
+  read_buf = thread_read_buf.buf.get();
+
+  // a source accounts the kernel time it stands for
+  if (IdleTrace::get_source())
+    rc = IdleTrace::get_source()->read(pid, va, read_buf, size, nsecs);
+  else if (use_pread)
+    rc = pread(idle_fd, read_buf, size, va_to_offset(va));
+  else
+    rc = read(idle_fd, read_buf, size);
+
+  if (!IdleTrace::get_source())
+    nsecs = now_nsecs() - t;
+  if (IdleTrace::recording())
+    IdleTrace::get()->record_read(pid, va, size, rc, read_buf, nsecs);
+
+  read_stats.nsecs += nsecs;
+  ++read_stats.nr_syscalls;
+  ++read_stats.nr_reads;
+  if (rc > 0)
+    read_stats.read_bytes += rc;
+
+  return rc;
+}
+
+// Skip the region of va in this walk when it has been idle for skim_walks
+// walks, until it has been skipped for as many walks. An access in the
+// skipped walks still shows up, though as one, when it is read again.
+bool ProcIdlePages::skim_skip_region(unsigned long va)
+{
+  SkimRegion& region = skim_regions[va / SKIM_REGION_SIZE];
+
+  // new regions start with 0s, and are always read, as are the rest of
+  // the regions being read in this walk
+  if (nr_walks > 1 && region.last_scan != nr_walks &&
+      nr_walks - region.last_access > skim_walks &&
+      nr_walks - region.last_scan <= skim_walks)
+    return true;
+
+  region.last_scan = nr_walks;
+  return false;
+}
+
+// pages in [va, end) accessed
+void ProcIdlePages::skim_mark_accessed(unsigned long va, unsigned long end)
+{
+  unsigned long index = va / SKIM_REGION_SIZE;
+  unsigned long last = (end - 1) / SKIM_REGION_SIZE;
+
+  for (; index <= last; ++index) {
+    if (!skim_last_region || index != skim_last_index) {
+      skim_last_region = &skim_regions[index];
+      skim_last_index = index;
+    }
+    skim_last_region->last_access = nr_walks;
+  }
+}
+
+int ProcIdlePages::walk_vma(const proc_maps_entry& vma)
 {
   unsigned long va = vma.start;
   unsigned long end = vma.end;
@@ -140,7 +293,7 @@ int ProcIdlePages::walk_vma(proc_maps_entry& vma)
   if (end > va_end)
     end = va_end;
 
-  if (lseek(idle_fd, va_to_offset(va), SEEK_SET) == (off_t) -1)
+  if (!use_pread && seek_idle(va, SEEK_SET) == (off_t) -1)
   {
     printf(" error: seek for addr %lx failed, skip.\n", va);
     perror("lseek error");
@@ -150,39 +303,66 @@ int ProcIdlePages::walk_vma(proc_maps_entry& vma)
 
   for (; va < end;)
   {
-    off_t pos = lseek(idle_fd, 0, SEEK_CUR);
-    if (pos == (off_t) -1) {
-      perror("SEEK_CUR error");
-      io_error = -1;
-      return -1;
-    }
-    if ((unsigned long)pos != va) {
-      fprintf(stderr, "error va-pos != 0: %lx-%lx=%lx\n", va, pos, va - pos);
-
-      if (va > (unsigned long)pos)
-        if (lseek(idle_fd, va_to_offset(va), SEEK_SET) == (off_t) -1)
-        {
-          printf(" error: seek for addr %lx failed, skip.\n", va);
-          perror("lseek error");
+    unsigned long read_end = end;
+
+    // one region per read, so that the next one can be skipped
+    if (skim_walks) {
+      read_end = std::min(end, (va | (SKIM_REGION_SIZE - 1)) + 1);
+      if (skim_skip_region(va)) {
+        read_stats.skipped_bytes += read_end - va;
+        va = read_end;
+        if (!use_pread && va < end && seek_idle(va, SEEK_SET) == (off_t) -1) {
+          perror("skim lseek error");
           io_error = -1;
-          return -2;
+          return -1;
         }
+        continue;
+      }
     }
 
-    size = (end - va + (7 << PAGE_SHIFT)) >> (3 + PAGE_SHIFT);
-    if (size < min_read_size)
-      size = min_read_size;
-    if (size > read_buf.size())
-      size = read_buf.size();
+    // parse_idlepages() leaves va at the kernel's next read position,
+    // which pread() takes as is
+    if (!use_pread) {
+      off_t pos = seek_idle(0, SEEK_CUR);
+      if (pos == (off_t) -1) {
+        perror("SEEK_CUR error");
+        io_error = -1;
+        return -1;
+      }
+      if ((unsigned long)pos != va) {
+        // reads spilling over a skim region end are parsed up to it only
+        if (!skim_walks)
+          fprintf(stderr, "error va-pos != 0: %lx-%lx=%lx\n", va, pos, va - pos);
+
+        if (va > (unsigned long)pos || skim_walks)
+          if (seek_idle(va, SEEK_SET) == (off_t) -1)
+          {
+            printf(" error: seek for addr %lx failed, skip.\n", va);
+            perror("lseek error");
+            io_error = -1;
+            return -2;
+          }
+      }
+    }
 
-    rc = read(idle_fd, read_buf.data(), size);
+    size = read_size(va, read_end);
+    rc = read_idle(va, size);
     if (rc < 0) {
+      if (errno == ESPIPE && use_pread) {
+        printd("idle_pages has no pread, fall back to lseek + read\n");
+        use_pread = false;
+        if (seek_idle(va, SEEK_SET) == (off_t) -1) {
+          perror("lseek error");
+          io_error = -1;
+          return -1;
+        }
+        continue;
+      }
       if (errno == ENXIO)
         return 0;
       if (errno == ERANGE) {
         va += size << (3 + PAGE_SHIFT);
-        pos = lseek(idle_fd, va_to_offset(va), SEEK_SET);
-        if (pos == (off_t) -1) {
+        if (!use_pread && seek_idle(va, SEEK_SET) == (off_t) -1) {
           perror("skip ERANGE");
           io_error = -1;
           return -1;
@@ -204,7 +384,12 @@ int ProcIdlePages::walk_vma(proc_maps_entry& vma)
       return 0;
     }
 
-    parse_idlepages(vma, va, end, rc);
+    unsigned long read_va = va;
+
+    // A read may spill into the next region, which may be skipped, and
+    // into the next VMAs: only the part up to read_end tells the density.
+    walk_read_bytes += parse_idlepages(vma, va, read_end, rc);
+    walk_read_va += va - read_va;
   }
 
   next_va = va;
@@ -220,25 +405,58 @@ int ProcIdlePages::walk()
     return 0;
   }
 
-  std::vector<proc_maps_entry> address_map = proc_maps.load(pid);
+  unsigned long t0 = now_nsecs();
+  unsigned long t1;
   int err = -1;
 
-  if (address_map.empty()) {
+  read_stats.clear();
+
+  // The first walk of a round adds all pages to page_refs,
+  // the later ones may skim
+  skim_walks = std::max(0, option.skim_idle_walks);
+  if (idle_fd >= 0 && skim_fd != (skim_walks && nr_walks > 0))
+    close_session();
+
+  if (IdleTrace::get_source())
+    IdleTrace::get_source()->start_walk(pid, va_start);
+
+  if (load_maps().empty()) {
+    close_session();
     io_error = -ESRCH;
     return -ESRCH;
   }
 
-  idle_fd = open_file();
-  if (idle_fd < 0)
-    return idle_fd;
+  if (IdleTrace::recording())
+    IdleTrace::get()->record_walk(pid, va_start, va_end, address_map);
+
+  t1 = now_nsecs();
+  if (idle_fd < 0) {
+    skim_fd = skim_walks && nr_walks > 0;
+    idle_fd = open_file();
+    if (idle_fd < 0)
+      return idle_fd;
+    ++nr_sessions;
+    open_nsecs = now_nsecs() - t1;
+  } else
+    read_stats.saved_nsecs += open_nsecs;
+
+  read_stats.setup_nsecs = now_nsecs() - t0;
 
   ++nr_walks;
-  read_buf.resize(READ_BUF_SIZE);
 
-  if (option.max_threads <= 1)
-    min_read_size = PAGE_SIZE;        // typical deployment
+  if (nr_walks == 1) {
+    skim_regions.clear();
+    skim_last_region = NULL;
+  }
+
+  // Until the density is known, the first walk of a range reads at least
+  // a page when single threaded, or the least not to step on each other
+  if (bytes_per_gb || option.max_threads > 1)
+    min_read_size = EPT_IDLE_BUF_MIN;
   else
-    min_read_size = EPT_IDLE_BUF_MIN; // avoid stepping on each other
+    min_read_size = PAGE_SIZE;
+  walk_read_bytes = 0;
+  walk_read_va = 0;
 
   // must do rewind() before a walk() start.
   for (auto& prc: pagetype_refs)
@@ -246,23 +464,69 @@ int ProcIdlePages::walk()
 
   next_va = 0;
 
-  for (auto &vma: address_map) {
+  for (auto &vma: *address_map) {
     err = walk_vma(vma);
     if (err)
       break;
   }
 
-  close(idle_fd);
+  // at least 1 for a known density
+  if (walk_read_va >= PMD_SIZE)
+    bytes_per_gb = std::max(1UL, (walk_read_bytes << 10) / (walk_read_va >> 20));
+
+  // reopen on next walk after errors, and don't run out of fds
+  // when scanning lots of ranges
+  if (err < 0 || nr_sessions > MAX_SESSIONS)
+    close_session();
 
   return err;
 }
 
+const std::vector<proc_maps_entry>& ProcIdlePages::load_maps()
+{
+  unsigned long t = now_nsecs();
+  ProcMapsInfo info;
+  ProcMapsView maps = ProcMapsCache::get(pid, &info);
+  unsigned long elapsed = now_nsecs() - t;
+
+  // saved the maps parsing, at the cost of the statm check
+  if (!info.reloaded && info.load_nsecs > elapsed)
+    read_stats.saved_nsecs += info.load_nsecs - elapsed;
+
+  if (debug_level() >= 1 && address_map && address_map != maps) {
+    ProcMapsDiff diff;
+
+    ProcMaps::diff(*address_map, *maps, diff);
+    printf("pid %d maps changed: %lu added, %lu removed, %lu resized\n",
+           pid, diff.added.size(), diff.removed.size(), diff.resized.size());
+  }
+
+  address_map = maps;
+
+  return *address_map;
+}
+
 int ProcIdlePages::open_file()
 {
   unsigned int flags = O_RDWR;
   char filepath[PATH_MAX];
   const char* idle_page_path="/proc/idle_pages";
 
+  // see read_idle()
+  if (IdleTrace::get_source()) {
+    idle_fd = IdleTrace::get_source()->open_session(pid);
+    if (idle_fd < 0)
+      io_error = idle_fd;
+    return idle_fd;
+  }
+
+  // idle PMDs as a whole, see skim_skip_region() for the rest
+  if (skim_fd)
+    flags |= SCAN_SKIM_IDLE;
+  // PTE_DIRTY/PMD_DIRTY for accessed pages with the dirty bit set
+  if (option.dirty_min_refs > 0)
+    flags |= SCAN_DIRTY_PAGE;
+
   idle_fd = open(idle_page_path, flags);
   if (idle_fd >= 0) {
     // ignore the ret value to allow close fd properly
@@ -270,11 +534,6 @@ int ProcIdlePages::open_file()
     return idle_fd;
   }
 
-  /*
-   *  disable for we considering to do this smart thing in future.
-   *  if (nr_walks > 0)
-   *    flags |= SCAN_SKIM_IDLE;
-   */
   memset(filepath, 0, sizeof(filepath));
   snprintf(filepath, sizeof(filepath), "/proc/%d/idle_pages", pid);
 
@@ -289,38 +548,38 @@ int ProcIdlePages::open_file()
   return idle_fd;
 }
 
-void ProcIdlePages::inc_page_refs(ProcIdlePageType type, int nr,
+void ProcIdlePages::inc_page_refs(ProcIdlePageType type, unsigned long nr,
                                   unsigned long va, unsigned long end)
 {
   unsigned long page_size = pagetype_size[type];
   AddrSequence& page_refs = pagetype_refs[pagetype_index[type]].page_refs;
 
+#ifdef PROC_IDLE_PAGES_SELF_TEST
+  if (skip_page_refs)
+    return;
+#endif
+
   if (va & (page_size - 1)) {
-    printf("ignore unaligned addr: %d %lx+%d %lx\n", type, va, nr, page_size);
+    printf("ignore unaligned addr: %d %lx+%lu %lx\n", type, va, nr, page_size);
     return;
   }
 
-  for (int i = 0; i < nr; ++i)
-  {
-    if (type >= PTE_IDLE)
-      page_refs.inc_payload(va, 0);
-    else if (type >= PTE_DIRTY)
-      page_refs.inc_payload(va, 3);
-    else // accessed
-      page_refs.inc_payload(va, 1);
-
-    //AddrSequence is not easy to random access, consider move
-    //this checking into AddrSequence.
-    //if (page_refs[va] > nr_walks)
-    //  printf("error counted duplicate va: %lx\n", va);
-
-    va += page_size;
-    if (va >= end)
-      break;
-  }
+  // stop at end, however always account the first page
+  unsigned long nr_pages = 1;
+  if (end > va)
+    nr_pages = (end - va + page_size - 1) / page_size;
+  nr_pages = std::min(nr_pages, nr);
+
+  if (skim_walks && type < PTE_IDLE)
+    skim_mark_accessed(va, va + nr_pages * page_size);
+
+  if (type >= PTE_IDLE)
+    page_refs.inc_payload_range(va, nr_pages, 0);
+  else // accessed, and written for PTE_DIRTY/PMD_DIRTY
+    page_refs.inc_payload_range(va, nr_pages, 1, type >= PTE_DIRTY);
 }
 
-void ProcIdlePages::dump_idlepages(proc_maps_entry& vma, int bytes)
+void ProcIdlePages::dump_idlepages(const proc_maps_entry& vma, int bytes)
 {
   proc_maps.show(vma);
   for (int j = 0; j < bytes; ++j)
@@ -369,14 +628,139 @@ uint64_t ProcIdlePages::u8_to_u64(uint8_t a[])
   return n;
 }
 
-void ProcIdlePages::parse_idlepages(proc_maps_entry& vma,
-                                    unsigned long& va,
-                                    unsigned long end,
-                                    int bytes)
+int ProcIdlePages::parse_idlepages(const proc_maps_entry& vma,
+                                   unsigned long& va,
+                                   unsigned long end,
+                                   int bytes)
+{
+  if (debug_level() >= 2)
+    return parse_idlepages_slow(vma, va, end, bytes);
+  else
+    return parse_idlepages_fast(vma, va, end, bytes);
+}
+
+// Length of the run of bytes equal to p[0], at most n. Also stops at
+// PIP_CMD_SET_HVA markers, which never repeat.
+static int pip_run_length(const uint8_t* p, int n)
+{
+  int len = 1;
+
+#ifdef __x86_64__
+  __m128i first = _mm_set1_epi8(p[0]);
+
+  for (; len + 16 <= n; len += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + len));
+    unsigned int diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, first)) & 0xffff;
+
+    if (diff)
+      return len + __builtin_ctz(diff);
+  }
+#endif
+
+  while (len < n && p[len] == p[0])
+    ++len;
+
+  return len;
+}
+
+// Same results as parse_idlepages_slow(). The kernel emits long idle or
+// accessed areas as repeated bytes of up to 15 pages each, which are
+// decoded here as one run, and consecutive runs of the same refs type are
+// passed to AddrSequence::inc_payload_range() as one span.
+int ProcIdlePages::parse_idlepages_fast(const proc_maps_entry& vma,
+                                        unsigned long& va,
+                                        unsigned long end,
+                                        int bytes)
+{
+  const uint8_t* buf = read_buf;
+  ProcIdlePageType span_type = PTE_ACCESSED;
+  unsigned long span_va = 0;
+  unsigned long span_nr = 0;
+  int dumped = 0;
+  int i;
+
+  for (i = 0; i < bytes;)
+  {
+    if (buf[i] == PIP_CMD_SET_HVA) {
+      unsigned long new_va = u8_to_u64(&read_buf[i + 1]);
+      if (new_va < va && i) {
+        printf("WARNING: va goes backward: %lx - %lx = %lx\n",
+               va, new_va, va - new_va);
+        if (!dumped++)
+          dump_idlepages(vma, bytes);
+      }
+      va = new_va;
+      i += 1 + sizeof(uint64_t);
+      continue;
+    }
+
+    int run = pip_run_length(buf + i, bytes - i);
+    ProcIdlePageType type = (ProcIdlePageType)PIP_TYPE(buf[i]);
+    unsigned long nr = PIP_SIZE(buf[i]);
+    unsigned long record_size;
+    unsigned long nr_records = run;
+    bool stop = false;
+
+    i += run;
+
+    if (type >= IDLE_PAGE_TYPE_MAX) {
+      printf("WARNING: skip wrong page type from kernel: %d\n",
+             (int)type);
+      continue;
+    }
+
+    // records starting at or after end are ignored, see slow path
+    if (va >= end) {
+      i -= run;
+      break;
+    }
+
+    record_size = pagetype_size[type] * nr;
+    if (record_size && nr_records > (end - va + record_size - 1) / record_size) {
+      nr_records = (end - va + record_size - 1) / record_size;
+      stop = true;
+    }
+
+    if (type == PMD_IDLE_PTES) {
+      type = PTE_IDLE;
+      nr *= 512;
+    }
+
+    if (type <= PMD_IDLE_PTES && nr) {
+      if (span_nr && (type != span_type ||
+                      va != span_va + span_nr * pagetype_size[type])) {
+        inc_page_refs(span_type, span_nr, span_va, end);
+        span_nr = 0;
+      }
+      if (!span_nr) {
+        span_type = type;
+        span_va = va;
+      }
+      span_nr += nr * nr_records;
+    }
+
+    va += record_size * nr_records;
+    if (stop) {
+      i -= run - nr_records;
+      break;
+    }
+  }
+
+  if (span_nr)
+    inc_page_refs(span_type, span_nr, span_va, end);
+
+  return i;
+}
+
+int ProcIdlePages::parse_idlepages_slow(const proc_maps_entry& vma,
+                                        unsigned long& va,
+                                        unsigned long end,
+                                        int bytes)
 {
   int dumped = 0;
+  int i;
 
-  for (int i = 0; i < bytes;)
+  for (i = 0; i < bytes;)
   {
     if (read_buf[i] == PIP_CMD_SET_HVA) {
       unsigned long new_va = u8_to_u64(&read_buf[++i]);
@@ -397,6 +781,7 @@ void ProcIdlePages::parse_idlepages(proc_maps_entry& vma,
     if (type >= IDLE_PAGE_TYPE_MAX) {
       printf("WARNING: skip wrong page type from kernel: %d\n",
              (int)type);
+      ++i;
       continue;
     }
 
@@ -409,7 +794,7 @@ void ProcIdlePages::parse_idlepages(proc_maps_entry& vma,
         if (debug_level() >= 3 && !dumped++)
           dump_idlepages(vma, bytes);
       }
-      return;
+      return i;
     }
 
     if (debug_level() >= 2) {
@@ -431,6 +816,8 @@ void ProcIdlePages::parse_idlepages(proc_maps_entry& vma,
     va += pagetype_size[type] * nr;
     ++i;
   }
+
+  return i;
 }
 
 unsigned long ProcIdlePages::va_to_offset(unsigned long va)
@@ -453,3 +840,356 @@ void ProcIdlePages::set_policy(Policy &pol)
 {
   policy = pol;
 }
+
+#ifdef PROC_IDLE_PAGES_SELF_TEST
+
+#include <sys/time.h>
+
+Option option;
+
+int debug_level()
+{
+  return option.debug_level;
+}
+
+// A walk over a small VMA as read from /proc/PID/idle_pages: long idle
+// and accessed PTE runs, a PMD with all PTEs idle, holes, and a second
+// SET_HVA jumping over an unmapped area.
+static const uint8_t recorded_pip[] = {
+  0xa0, 0x00, 0x00, 0x7f, 0x12, 0x34, 0x40, 0x00, 0x00,
+  0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+  0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+  0x53, 0x0f, 0x0f, 0x04, 0x5c, 0x3f, 0x31, 0x8f, 0x8f,
+  0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+  0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+  0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f,
+  0x5d, 0x72, 0x11, 0x61, 0x91, 0x12,
+  0xa0, 0x00, 0x00, 0x7f, 0x12, 0x38, 0x00, 0x00, 0x00,
+  0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+  0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+  0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+  0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+  0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+  0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f, 0x0f,
+  0x0f, 0x02, 0x51, 0x22, 0x71, 0x71, 0x71, 0x61,
+};
+
+static void emit_set_hva(std::vector<uint8_t>& buf, unsigned long va)
+{
+  buf.push_back(PIP_CMD_SET_HVA);
+  for (int shift = 56; shift >= 0; shift -= 8)
+    buf.push_back(va >> shift);
+}
+
+// kernel like stream of random runs, with some junk if bad_types
+static unsigned long gen_pip(std::vector<uint8_t>& buf, unsigned int& seed,
+                             unsigned long va, int bytes, bool bad_types)
+{
+  static const ProcIdlePageType pte_types[] = {
+    PTE_ACCESSED, PTE_DIRTY, PTE_IDLE, PTE_IDLE, PTE_HOLE,
+  };
+  static const ProcIdlePageType pmd_types[] = {
+    PMD_ACCESSED, PMD_DIRTY, PMD_IDLE, PMD_IDLE_PTES, PMD_HOLE,
+  };
+
+  buf.clear();
+  emit_set_hva(buf, va);
+
+  while ((int)buf.size() < bytes) {
+    int r = rand_r(&seed) % 100;
+    ProcIdlePageType type;
+    int nr;
+    int run;
+
+    if (r < 3) {
+      va = (va + ((unsigned long)(rand_r(&seed) % 64 + 1) << 21)) & ~(PMD_SIZE - 1);
+      emit_set_hva(buf, va);
+      continue;
+    }
+    if (r < 4 && bad_types) {
+      buf.push_back(PIP_COMPOSE((IDLE_PAGE_TYPE_MAX + rand_r(&seed) % 5), 1));
+      continue;
+    }
+
+    if (!(va & (PMD_SIZE - 1)) && r % 3 == 0)
+      type = pmd_types[rand_r(&seed) % 5];
+    else
+      type = pte_types[rand_r(&seed) % 5];
+    nr = r & 1 ? 15 : rand_r(&seed) % 15 + 1;
+    run = r & 2 ? rand_r(&seed) % 300 + 1 : rand_r(&seed) % 4 + 1;
+
+    for (int i = 0; i < run; ++i)
+      buf.push_back(PIP_COMPOSE(type, nr));
+    va += pagetype_size[type] * nr * run;
+  }
+
+  return va;
+}
+
+// Adjacent dense VMAs, read the way the kernel does: a read goes on
+// into the next VMAs until the buffer is full.
+class SpillIdlePages : public IdlePagesSource
+{
+  public:
+    static const pid_t PID = 1 << 22;
+    static const unsigned long VA_BASE = 1UL << 44;
+    static const unsigned long VMA_SIZE = 64UL << 20;
+    static const int NR_VMAS = 16;
+
+    SpillIdlePages() {
+      auto maps = std::make_shared<std::vector<proc_maps_entry>>(NR_VMAS);
+
+      for (int i = 0; i < NR_VMAS; ++i) {
+        proc_maps_entry& vma = (*maps)[i];
+
+        vma = proc_maps_entry();
+        vma.start = VA_BASE + i * VMA_SIZE;
+        vma.end = vma.start + VMA_SIZE;
+        strcpy(vma.perms, "rw-p");
+        vma.read = true;
+        vma.write = true;
+      }
+      ProcMapsCache::pin(PID, maps);
+      ranges.push_back({PID, 0, TASK_SIZE_MAX});
+    }
+
+    int open_session(pid_t pid) {
+      int fd = open("/dev/null", O_RDONLY);
+
+      return fd < 0 ? -errno : fd;
+    }
+    void start_walk(pid_t pid, unsigned long start) {}
+
+    // one accessed 4K record per page, up to the last VMA end
+    ssize_t read(pid_t pid, unsigned long va, uint8_t* buf,
+                 size_t size, unsigned long& nsecs) {
+      unsigned long end = VA_BASE + NR_VMAS * VMA_SIZE;
+      size_t n = std::min(size, (end - va) >> PAGE_SHIFT);
+
+      memset(buf, PIP_COMPOSE(PTE_ACCESSED, 1), n);
+      nsecs = 0;
+      return n;
+    }
+
+    const std::vector<IdleTraceRange>& get_ranges() { return ranges; }
+
+  private:
+    std::vector<IdleTraceRange> ranges;
+};
+
+static int compare_refs(AddrSequence& a, AddrSequence& b)
+{
+  auto it = b.begin();
+
+  if (a.size() != b.size())
+    return -1;
+
+  for (auto& entry: a) {
+    if (it == b.end() || it->addr != entry.addr || it->payload != entry.payload)
+      return -1;
+    ++it;
+  }
+
+  return 0;
+}
+
+// decode the same buffers with both decoders and compare the outcome
+int ProcIdlePages::self_test()
+{
+  const unsigned long va_base = 0x7f0000000000UL;
+  ProcIdlePages fast;
+  proc_maps_entry vma = proc_maps_entry();
+  std::vector<uint8_t> buf;
+  std::vector<uint8_t> padded;
+  unsigned int seed = 1;
+  struct timeval ts1, ts2, ts3;
+
+  for (int trial = 0; trial < 300; ++trial) {
+    for (auto* p: {this, &fast})
+      for (int t = 0; t <= MAX_ACCESSED; ++t) {
+        p->pagetype_refs[t].page_refs.clear();
+        p->pagetype_refs[t].page_refs.set_pageshift(pagetype_shift[t]);
+      }
+
+    for (int walk = 0; walk < 3; ++walk) {
+      unsigned long va = va_base;
+      unsigned long fast_va = va_base;
+      unsigned long end;
+      unsigned int walk_seed = trial * 3 + walk / 2;
+
+      if (trial)
+        end = gen_pip(buf, walk_seed, va_base,
+                      rand_r(&seed) % 4096 + 16, trial % 50 == 1);
+      else {
+        buf.assign(recorded_pip, recorded_pip + sizeof(recorded_pip));
+        va = fast_va = 0;
+        end = 0x7f1238000000UL + ((unsigned long)(rand_r(&seed) % 64) << 12);
+      }
+      // stop somewhere before the stream end at times
+      if (rand_r(&seed) & 1)
+        end = va_base + (end - va_base) * (rand_r(&seed) % 100) / 100;
+
+      padded.assign(buf.begin(), buf.end());
+      padded.resize(buf.size() + sizeof(uint64_t));
+      for (auto* p: {this, &fast}) {
+        p->read_buf = padded.data();
+        for (auto& prc: p->pagetype_refs)
+          prc.page_refs.rewind();
+      }
+
+      int slow_bytes = parse_idlepages_slow(vma, va, end, buf.size());
+      int fast_bytes = fast.parse_idlepages_fast(vma, fast_va, end, buf.size());
+
+      if (va != fast_va) {
+        printf("trial %d walk %d: va mismatch %lx %lx\n",
+               trial, walk, va, fast_va);
+        return -1;
+      }
+      if (slow_bytes != fast_bytes) {
+        printf("trial %d walk %d: parsed bytes mismatch %d %d\n",
+               trial, walk, slow_bytes, fast_bytes);
+        return -1;
+      }
+      for (int t = 0; t <= MAX_ACCESSED; ++t)
+        if (compare_refs(pagetype_refs[t].page_refs,
+                         fast.pagetype_refs[t].page_refs)) {
+          printf("trial %d walk %d: %s refs mismatch\n",
+                 trial, walk, pagetype_name[t]);
+          return -1;
+        }
+    }
+  }
+
+  // speed over a 1MB buffer, of the decoding alone and of the whole
+  // parse, which the AddrSequence updates take most of
+  gen_pip(buf, seed, va_base, 1 << 20, false);
+  padded.assign(buf.begin(), buf.end());
+  padded.resize(buf.size() + sizeof(uint64_t));
+  for (bool decode_only: {true, false}) {
+    for (auto* p: {this, &fast}) {
+      p->read_buf = padded.data();
+      p->skip_page_refs = decode_only;
+      for (auto& prc: p->pagetype_refs) {
+        prc.page_refs.clear();
+        prc.page_refs.set_pageshift(12);
+        prc.page_refs.rewind();
+      }
+    }
+
+    unsigned long va = va_base;
+    gettimeofday(&ts1, NULL);
+    parse_idlepages_slow(vma, va, ~0UL, buf.size());
+    gettimeofday(&ts2, NULL);
+    va = va_base;
+    fast.parse_idlepages_fast(vma, va, ~0UL, buf.size());
+    gettimeofday(&ts3, NULL);
+
+    printf("%s %lu bytes: slow %.3f ms, fast %.3f ms\n",
+           decode_only ? "decode" : "parse", buf.size(),
+           (ts2.tv_sec - ts1.tv_sec) * 1e3 + (ts2.tv_usec - ts1.tv_usec) / 1e3,
+           (ts3.tv_sec - ts2.tv_sec) * 1e3 + (ts3.tv_usec - ts2.tv_usec) / 1e3);
+  }
+  skip_page_refs = fast.skip_page_refs = false;
+
+  // read sizes: VA coverage, density of the last walk, and the limits
+  struct {
+    unsigned long bytes_per_gb;
+    unsigned long min_read_size;
+    unsigned long len;
+    unsigned long size;
+  } read_sizes[] = {
+    {0,         PAGE_SIZE,        PAGE_SIZE,  PAGE_SIZE},
+    {0,         EPT_IDLE_BUF_MIN, PAGE_SIZE,  EPT_IDLE_BUF_MIN},
+    {0,         PAGE_SIZE,        1UL << 30,  32 << 10},
+    {0,         PAGE_SIZE,        1UL << 40,  MAX_READ_SIZE},
+    {100,       EPT_IDLE_BUF_MIN, 1UL << 30,  32 << 10},
+    {256 << 10, EPT_IDLE_BUF_MIN, 1UL << 30,  320 << 10},
+    {256 << 10, EPT_IDLE_BUF_MIN, 1UL << 40,  MAX_READ_SIZE},
+  };
+  for (auto& r: read_sizes) {
+    bytes_per_gb = r.bytes_per_gb;
+    min_read_size = r.min_read_size;
+    if (read_size(va_base, va_base + r.len) != r.size) {
+      printf("read_size(%lu) = %lu, expect %lu\n",
+             r.len, read_size(va_base, va_base + r.len), r.size);
+      return -1;
+    }
+  }
+  bytes_per_gb = 0;
+
+  // Reads spilling into the next VMAs don't add to the density, or the
+  // read sizes would grow by the 1/4 slack each walk.
+  {
+    SpillIdlePages spill;
+    ProcIdlePages walker;
+    unsigned long last_bytes = 0;
+
+    IdleTrace::set_source(&spill);
+    walker.set_pid(SpillIdlePages::PID);
+    for (int walk = 1; walk <= 5; ++walk) {
+      if (walker.walk()) {
+        printf("spill walk %d failed\n", walk);
+        return -1;
+      }
+      unsigned long read_bytes = walker.get_read_stats().read_bytes;
+      printd("spill walk %d: %lu reads of %lu bytes, %lu bytes/GB\n", walk,
+             walker.get_read_stats().nr_reads, read_bytes, walker.bytes_per_gb);
+      if (walker.bytes_per_gb != (1UL << 30 >> PAGE_SHIFT) ||
+          (walk > 2 && read_bytes != last_bytes)) {
+        printf("spill walk %d: %lu bytes/GB, read %lu bytes after %lu\n",
+               walk, walker.bytes_per_gb, read_bytes, last_bytes);
+        return -1;
+      }
+      last_bytes = read_bytes;
+    }
+    IdleTrace::set_source(NULL);
+  }
+
+  // skim schedule of 2 idle walks: region 0 hot in walk 1 only,
+  // region 1 always hot, region 2 hot in walk 8, region 3 never;
+  // 'r' for read, 's' for skipped
+  const char* expect[] = {
+    "rrrr", "rrrr", "rrss", "srss", "srrr", "rrss",
+    "srss", "srrr", "rrrs", "srrs", "srsr", "rrss",
+  };
+  skim_walks = 2;
+  skim_regions.clear();
+  skim_last_region = NULL;
+  for (nr_walks = 1; nr_walks <= 12; ++nr_walks) {
+    char got[5] = "";
+
+    for (int r = 0; r < 4; ++r) {
+      unsigned long va = va_base + r * SKIM_REGION_SIZE;
+
+      got[r] = skim_skip_region(va) ? 's' : 'r';
+      if (got[r] == 'r' && ((r == 0 && nr_walks == 1) || r == 1 ||
+                            (r == 2 && nr_walks == 8)))
+        skim_mark_accessed(va, va + PMD_SIZE);
+    }
+    if (strcmp(got, expect[nr_walks - 1])) {
+      printf("skim walk %d: read %s, expect %s\n",
+             nr_walks, got, expect[nr_walks - 1]);
+      return -1;
+    }
+
+    // short reads come back for the rest of the region
+    for (int r = 0; r < 4; ++r)
+      if (got[r] == 'r' &&
+          skim_skip_region(va_base + r * SKIM_REGION_SIZE + PMD_SIZE)) {
+        printf("skim walk %d: region %d skipped halfway\n", nr_walks, r);
+        return -1;
+      }
+  }
+
+  printf("idle pages self test passed\n");
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  ProcIdlePages pip;
+
+  return pip.self_test();
+}
+
+#endif
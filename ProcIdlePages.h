@@ -14,6 +14,7 @@
 // interface to /proc/PID/idle_pages
 
 #include <string>
+#include <atomic>
 #include <sys/user.h>
 #include <sys/types.h>
 #include <unordered_map>
@@ -30,6 +31,7 @@ static const unsigned long TASK_SIZE_MAX = (1UL << 47) - PAGE_SIZE;
 
 #define SCAN_HUGE_PAGE      O_NONBLOCK
 #define SCAN_SKIM_IDLE      O_NOFOLLOW
+#define SCAN_DIRTY_PAGE     O_NOATIME
 #define IDLE_PAGE_SET_PID   _IOW(0x1, 0x1, pid_t)
 
 enum ProcIdlePageType
@@ -78,6 +80,33 @@ extern int pagetype_index[];
 extern int pagetype_batchsize[IDLE_PAGE_TYPE_MAX];
 
 typedef std::unordered_map<unsigned long, uint8_t> page_refs_map;
+
+// read/seek syscalls on idle_pages in one walk()
+struct IdleReadStats
+{
+  unsigned long nr_syscalls;
+  unsigned long nr_reads;
+  unsigned long read_bytes;
+  unsigned long nsecs;          // time spent in the syscalls
+  unsigned long setup_nsecs;    // loading maps and opening idle_pages
+  unsigned long saved_nsecs;    // setup time saved by the scan session
+  unsigned long skipped_bytes;  // VA not read in skim mode
+
+  void clear() {
+    nr_syscalls = nr_reads = read_bytes = nsecs = 0;
+    setup_nsecs = saved_nsecs = skipped_bytes = 0;
+  }
+  IdleReadStats& operator+=(const IdleReadStats& s) {
+    nr_syscalls += s.nr_syscalls;
+    nr_reads += s.nr_reads;
+    read_bytes += s.read_bytes;
+    nsecs += s.nsecs;
+    setup_nsecs += s.setup_nsecs;
+    saved_nsecs += s.saved_nsecs;
+    skipped_bytes += s.skipped_bytes;
+    return *this;
+  }
+};
 typedef std::vector<unsigned long>  histogram_type;
 typedef histogram_type  histogram_2d_type[REF_LOC_MAX];
 
@@ -91,15 +120,24 @@ struct ProcIdleRefs
   // refs => page count
   // accumulated by count_refs()
   histogram_2d_type histogram_2d;
+  // dirty score => page count, with dirty tracking
+  histogram_type dirty_count;
 };
 
 class ProcIdlePages
 {
   public:
     ProcIdlePages();
+    ~ProcIdlePages();
 
-    void set_pid(pid_t i) { pid = i; }
+    void set_pid(pid_t i) {
+      if (i != pid)
+        close_session();
+      pid = i;
+    }
     pid_t get_pid() { return pid; }
+    unsigned long get_va_start() { return va_start; }
+    unsigned long get_va_end() { return va_end; }
 
     void set_va_range(unsigned long start, unsigned long end);
     void set_policy(Policy &pol);
@@ -107,29 +145,64 @@ class ProcIdlePages
     int walk();
     int has_io_error() const { return io_error; }
 
+    // The idle_pages fd and VMA list are kept open across walk() calls.
+    // Call me when done with the walks of a round.
+    void close_session();
+
     ProcIdleRefs& get_pagetype_refs(ProcIdlePageType type)
                    { return pagetype_refs[pagetype_index[type]]; }
 
     int get_nr_walks() { return nr_walks; }
+    const IdleReadStats& get_read_stats() { return read_stats; }
 
     void dump_histogram(ProcIdlePageType type);
+
+#ifdef PROC_IDLE_PAGES_SELF_TEST
+    int self_test();
+  private:
+    // time the decoders without the AddrSequence updates
+    bool skip_page_refs = false;
+#endif
   private:
-    int walk_vma(proc_maps_entry& vma);
+    int walk_vma(const proc_maps_entry& vma);
 
     int open_file(void);
+    off_t seek_idle(unsigned long va, int whence);
+    unsigned long read_size(unsigned long va, unsigned long end);
+    ssize_t read_idle(unsigned long va, size_t size);
 
     uint64_t u8_to_u64(uint8_t a[]);
-    void parse_idlepages(proc_maps_entry& vma,
-                         unsigned long& va,
-                         unsigned long end,
-                         int bytes);
-    void dump_idlepages(proc_maps_entry& vma, int bytes);
-    void inc_page_refs(ProcIdlePageType type, int nr,
+    // Returns the bytes of the buffer up to the first record at or after
+    // end. The kernel fills the buffer from the VMAs after end, too.
+    int parse_idlepages(const proc_maps_entry& vma,
+                        unsigned long& va,
+                        unsigned long end,
+                        int bytes);
+    // byte by byte decoder with the debug checks
+    int parse_idlepages_slow(const proc_maps_entry& vma,
+                             unsigned long& va,
+                             unsigned long end,
+                             int bytes);
+    // decodes runs of same records at once and merges adjacent
+    // records into one inc_page_refs() span
+    int parse_idlepages_fast(const proc_maps_entry& vma,
+                             unsigned long& va,
+                             unsigned long end,
+                             int bytes);
+    void dump_idlepages(const proc_maps_entry& vma, int bytes);
+    void inc_page_refs(ProcIdlePageType type, unsigned long nr,
                        unsigned long va, unsigned long end);
 
+    bool skim_skip_region(unsigned long va);
+    void skim_mark_accessed(unsigned long va, unsigned long end);
+
     unsigned long va_to_offset(unsigned long va);
     unsigned long offset_to_va(unsigned long offset);
 
+  protected:
+    // the VMA list shared with the other ranges of pid
+    const std::vector<proc_maps_entry>& load_maps();
+
   protected:
     pid_t pid;
     Policy policy;
@@ -147,13 +220,52 @@ class ProcIdlePages
     ProcIdleRefs pagetype_refs[MAX_ACCESSED + 1];
 
   private:
-    static const int READ_BUF_SIZE = 1 << 20;
+    // the largest read, covering 256GB of VA
+    static const unsigned long MAX_READ_SIZE = 8UL << 20;
+    // sessions kept open between walks, beyond which fds are closed
+    // after each walk
+    static const int MAX_SESSIONS = 256;
 
     int idle_fd;
-    std::vector<uint8_t> read_buf;
+    // scratch buffer of the walking thread, set by read_idle()
+    uint8_t* read_buf;
+
+    // Read at the va tracked in walk_vma() with pread(), saving the lseek()
+    // calls around each read(). Cleared when idle_pages is not seekable.
+    bool use_pread;
+    IdleReadStats read_stats;
+
+    // scan session, see close_session()
+    ProcMapsView address_map;
+    unsigned long open_nsecs;         // cost of the last open_file()
+    static std::atomic<int> nr_sessions;
 
     unsigned long min_read_size;
     unsigned long next_va;
+
+    // PIP bytes per GB of VA in the reads of the last walk, 0 before the
+    // first one, and the sums of the current walk, see read_size()
+    unsigned long bytes_per_gb;
+    unsigned long walk_read_bytes;
+    unsigned long walk_read_va;
+
+    // Skim mode, see option skim_idle_walks. The walks of a round after
+    // the first one open idle_pages with SCAN_SKIM_IDLE, which has the
+    // kernel report PMDs with the accessed bit clear as PMD_IDLE_PTES and
+    // only walk the PTEs of the others. On top of it, the access history
+    // of each SKIM_REGION_SIZE region decides whether to read it at all.
+    struct SkimRegion
+    {
+      int last_access;    // last walk that saw accessed pages in it
+      int last_scan;      // last walk that read it
+    };
+    static const unsigned long SKIM_REGION_SIZE = PUD_SIZE;
+
+    int skim_walks;
+    bool skim_fd;                     // idle_fd opened with SCAN_SKIM_IDLE
+    std::unordered_map<unsigned long, SkimRegion> skim_regions;
+    SkimRegion* skim_last_region;     // cache for skim_mark_accessed()
+    unsigned long skim_last_index;
 };
 
 #endif
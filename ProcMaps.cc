@@ -8,141 +8,173 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 #include <linux/limits.h>
-#include <fstream>
-#include <iostream>
+#include <algorithm>
 #include <string>
 #include <string.h>
 #include "ProcMaps.h"
 
 
-#if 1
-static int parse_proc_maps(pid_t pid, std::vector<proc_maps_entry>& maps)
+static const char* parse_hex(const char* p, unsigned long& val)
+{
+  unsigned long v = 0;
+
+  for (;; ++p) {
+    unsigned int c = *p;
+
+    if (c - '0' < 10)
+      v = (v << 4) | (c - '0');
+    else if ((c | 0x20) - 'a' < 6)
+      v = (v << 4) | ((c | 0x20) - 'a' + 10);
+    else
+      break;
+  }
+
+  val = v;
+  return p;
+}
+
+static const char* parse_dec(const char* p, unsigned long& val)
+{
+  unsigned long v = 0;
+
+  for (; (unsigned int)(*p - '0') < 10; ++p)
+    v = v * 10 + (*p - '0');
+
+  val = v;
+  return p;
+}
+
+// Parse one line
+//   start-end perms offset major:minor inode      path
+// Returns the line end, or NULL if malformed.
+static const char* parse_maps_line(const char* p, const char* end,
+                                   proc_maps_entry& e)
+{
+  const char* eol = (const char*)memchr(p, '\n', end - p);
+  unsigned long val;
+
+  if (!eol)
+    return NULL;
+
+  p = parse_hex(p, e.start);
+  if (*p++ != '-')
+    return NULL;
+  p = parse_hex(p, e.end);
+  if (*p++ != ' ' || eol - p < 5)
+    return NULL;
+
+  memcpy(e.perms, p, 4);
+  e.perms[4] = '\0';
+  p += 4;
+  if (*p++ != ' ')
+    return NULL;
+
+  p = parse_hex(p, e.offset);
+  if (*p++ != ' ')
+    return NULL;
+  p = parse_hex(p, val);
+  e.dev_major = val;
+  if (*p++ != ':')
+    return NULL;
+  p = parse_hex(p, val);
+  e.dev_minor = val;
+  if (*p++ != ' ')
+    return NULL;
+  p = parse_dec(p, e.ino);
+  if (p > eol)
+    return NULL;
+
+  while (p < eol && *p == ' ')
+    ++p;
+
+  e.read     = (e.perms[0] == 'r');
+  e.write    = (e.perms[1] == 'w');
+  e.exec     = (e.perms[2] == 'x');
+  e.mayshare = (e.perms[3] != 'p');
+
+  // reuses the string buffer of a recycled entry
+  e.path.assign(p, eol - p);
+
+  return eol + 1;
+}
+
+// Read the whole maps file into buf, then parse it into maps, reusing the
+// entries already there. Once buf and maps are large enough, reloading
+// the same process does no memory allocation.
+int ProcMaps::parse(pid_t pid, std::vector<proc_maps_entry>& maps,
+                    std::vector<char>& buf)
 {
   char filename[PATH_MAX];
-  proc_maps_entry e;
-  char line[4096];
-  int path_index;
-  FILE *f;
-  int ret = 0;
+  size_t len = 0;
+  size_t nr = 0;
+  ssize_t ret;
+  int fd;
 
   snprintf(filename, sizeof(filename), "/proc/%d/maps", pid);
 
-  f = fopen(filename, "r");
-  if (!f) {
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
     perror(filename);
+    maps.clear();
     return -1;
   }
 
-  while (fgets(line, sizeof(line), f))
-  {
-    ret = sscanf(line, "%lx-%lx %4s %lx %x:%x %lu%*[ ]%n",
-                 &e.start,
-                 &e.end,
-                 e.perms,
-                 &e.offset,
-                 (unsigned int*)&e.dev_major,
-                 (unsigned int*)&e.dev_minor,
-                 &e.ino,
-                 &path_index);
-
-    if (ret < 7)
-    {
-      fprintf(stderr, "parse failed: %d %s\n%s", ret, filename, line);
-      ret = -EINVAL;
-			break;
-    }
-
-    e.read     = (e.perms[0] == 'r');
-    e.write    = (e.perms[1] == 'w');
-    e.exec     = (e.perms[2] == 'x');
-    e.mayshare = (e.perms[3] != 'p');
+  if (buf.size() < 4096)
+    buf.resize(4096);
 
-    e.path = line + path_index;
-    e.path.pop_back();      // trim trailing '\n'
+  for (;;) {
+    if (len == buf.size())
+      buf.resize(buf.size() * 2);
 
-    maps.push_back(e);
+    ret = read(fd, &buf[len], buf.size() - len);
+    if (ret <= 0)
+      break;
+    len += ret;
   }
+  close(fd);
 
-  fclose(f);
-
-  return ret;
-}
+  if (ret < 0) {
+    perror(filename);
+    maps.clear();
+    return -1;
+  }
 
-#else
-/*
-  reimplement this because the it can not handle heap area before
-*/
-static int parse_proc_maps(pid_t pid, std::vector<proc_maps_entry>& maps)
-{
-  std::ifstream input_file;
-  std::string each_line, str_value[6];
-  size_t each_split, split_array[7];
-  int i, ret;
-  char filename[PATH_MAX];
-  proc_maps_entry e;
+  const char* p = buf.data();
+  const char* end = p + len;
 
-  ret = -1;
+  while (p < end) {
+    if (nr == maps.size())
+      maps.emplace_back();
 
-  snprintf(filename, sizeof(filename), "/proc/%d/maps", pid);
+    const char* next = parse_maps_line(p, end, maps[nr]);
+    if (!next) {
+      fprintf(stderr, "parse failed: %s\n%.*s\n", filename,
+              (int)(std::find(p, end, '\n') - p), p);
+      maps.resize(nr);
+      return -EINVAL;
+    }
 
-  input_file.open(filename, std::ios_base::in);
-  while (std::getline(input_file, each_line))
-  {
-      split_array[0] = 0;
-
-      for (i = 1; i < 6; ++i)
-      {
-          each_split = each_line.find_first_of(" ", split_array[i-1]);
-
-          if (std::string::npos == each_split)
-          {break;}
-
-          //+1 for begin from next non-space item
-          split_array[i] = each_split + 1;
-
-          //-1 because we have +1 above
-          str_value[i-1] = each_line.substr(split_array[i-1], split_array[i] - split_array[i-1] - 1);
-      }
-
-      split_array[i] = each_line.find_first_not_of(" ", split_array[i-1]);
-      if (std::string::npos != split_array[i])
-      {
-          str_value[i-1] = each_line.substr(split_array[i], std::string::npos);
-      }
-      else
-      {
-          str_value[i-1] = "Anonymous";
-      }
-
-      sscanf(str_value[0].c_str(), "%lx-%lx", &e.start, &e.end);
-      sscanf(str_value[2].c_str(), "%lx", &e.offset);
-      sscanf(str_value[3].c_str(), "%d:%d", &e.dev_major, &e.dev_minor);
-      sscanf(str_value[4].c_str(), "%lu", &e.ino);
-
-      e.read     = (str_value[1][0] == 'r');
-      e.write    = (str_value[1][1] == 'w');
-      e.exec     = (str_value[1][2] == 'x');
-      e.mayshare = (str_value[1][3] != 'p');
-      e.path     = str_value[5];
-
-      maps.push_back(e);
-
-      ret = 0;
+    p = next;
+    ++nr;
   }
 
-  input_file.close();
+  maps.resize(nr);
 
-  return ret;
+  return 0;
 }
 
-#endif
-
 std::vector<proc_maps_entry> ProcMaps::load(pid_t pid)
 {
   std::vector<proc_maps_entry> maps;
+  std::vector<char> buf;
 
-  parse_proc_maps(pid, maps);
+  parse(pid, maps, buf);
 
   return maps;
 }
@@ -166,7 +198,7 @@ void ProcMaps::show(const std::vector<proc_maps_entry>& maps)
     show(vma);
 }
 
-bool ProcMaps::is_anonymous(proc_maps_entry& vma)
+bool ProcMaps::is_anonymous(const proc_maps_entry& vma)
 {
   if (vma.mayshare)
     return false;
@@ -185,3 +217,308 @@ bool ProcMaps::is_anonymous(proc_maps_entry& vma)
 
   return false;
 }
+
+static bool same_mapping(const proc_maps_entry& a, const proc_maps_entry& b)
+{
+  return !memcmp(a.perms, b.perms, sizeof(a.perms))
+         && a.dev_major == b.dev_major
+         && a.dev_minor == b.dev_minor
+         && a.ino == b.ino
+         && a.path == b.path;
+}
+
+// Both lists are sorted and non-overlapping, as read from the kernel.
+// An old and a new VMA that overlap with the same mapping are taken as
+// resized, e.g. a heap growing by brk() or a stack growing down.
+void ProcMaps::diff(const std::vector<proc_maps_entry>& old_maps,
+                    const std::vector<proc_maps_entry>& new_maps,
+                    ProcMapsDiff& d)
+{
+  size_t i = 0;
+  size_t j = 0;
+
+  d.clear();
+
+  while (i < old_maps.size() || j < new_maps.size()) {
+    if (j == new_maps.size()) {
+      d.removed.push_back({old_maps[i].start, old_maps[i].end});
+      ++i;
+      continue;
+    }
+    if (i == old_maps.size()) {
+      d.added.push_back({new_maps[j].start, new_maps[j].end});
+      ++j;
+      continue;
+    }
+
+    const proc_maps_entry& o = old_maps[i];
+    const proc_maps_entry& n = new_maps[j];
+
+    if (o.start == n.start && o.end == n.end && same_mapping(o, n)) {
+      ++i;
+      ++j;
+    } else if (o.start < n.end && n.start < o.end && same_mapping(o, n)) {
+      d.resized.push_back({{o.start, o.end}, {n.start, n.end}});
+      ++i;
+      ++j;
+    } else if (o.start < n.start || (o.start == n.start && o.end <= n.end)) {
+      d.removed.push_back({o.start, o.end});
+      ++i;
+    } else {
+      d.added.push_back({n.start, n.end});
+      ++j;
+    }
+  }
+}
+
+std::mutex ProcMapsCache::cache_lock;
+std::unordered_map<pid_t, ProcMapsCache::EntryPtr> ProcMapsCache::cache;
+
+static unsigned long now_nsecs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// total program size in pages, 0 if the process is gone
+static unsigned long read_statm_size(pid_t pid)
+{
+  char path[PATH_MAX];
+  char buf[64];
+  ssize_t len;
+  int fd;
+
+  snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return 0;
+
+  buf[len] = '\0';
+  return strtoul(buf, NULL, 10);
+}
+
+ProcMapsCache::EntryPtr ProcMapsCache::get_entry(pid_t pid)
+{
+  std::lock_guard<std::mutex> guard(cache_lock);
+  EntryPtr& e = cache[pid];
+
+  if (!e)
+    e = std::make_shared<Entry>();
+
+  return e;
+}
+
+ProcMapsView ProcMapsCache::get(pid_t pid, ProcMapsInfo* info)
+{
+  EntryPtr e = get_entry(pid);
+
+  std::lock_guard<std::mutex> guard(e->mlock);
+  unsigned long t = now_nsecs();
+  unsigned long vm_pages = e->pinned ? e->vm_pages : read_statm_size(pid);
+  bool reload = !e->pinned &&
+                (!vm_pages || vm_pages != e->vm_pages || !e->current ||
+                 e->stale);
+
+  e->touched = true;
+  e->stale = false;
+
+  if (reload) {
+    std::shared_ptr<std::vector<proc_maps_entry>> next;
+
+    // recycle the entries of the previous generation if no one uses it
+    if (e->previous && e->previous.use_count() == 1)
+      next.swap(e->previous);
+    else
+      next = std::make_shared<std::vector<proc_maps_entry>>();
+
+    ProcMaps::parse(pid, *next, e->buf);
+
+    e->previous = e->current;
+    e->current = next;
+    e->vm_pages = vm_pages;
+    e->load_nsecs = now_nsecs() - t;
+    ++e->generation;
+  }
+
+  if (info) {
+    info->generation = e->generation;
+    info->load_nsecs = e->load_nsecs;
+    info->reloaded = reload;
+  }
+
+  return e->current;
+}
+
+void ProcMapsCache::expire()
+{
+  std::lock_guard<std::mutex> guard(cache_lock);
+
+  for (auto it = cache.begin(); it != cache.end();) {
+    Entry& e = *it->second;
+    std::lock_guard<std::mutex> guard(e.mlock);
+
+    if (e.touched || e.pinned) {
+      e.touched = false;
+      e.stale = true;
+      ++it;
+    } else {
+      it = cache.erase(it);
+    }
+  }
+}
+
+void ProcMapsCache::pin(pid_t pid, std::shared_ptr<std::vector<proc_maps_entry>> maps)
+{
+  EntryPtr e = get_entry(pid);
+
+  std::lock_guard<std::mutex> guard(e->mlock);
+
+  if (e->current == maps)
+    return;
+
+  e->previous.reset();
+  e->current = maps;
+  e->pinned = true;
+  e->load_nsecs = 0;
+  ++e->generation;
+}
+
+#ifdef PROC_MAPS_SELF_TEST
+
+#include <limits.h>
+#include <sys/mman.h>
+
+#define PROC_MAPS_CHECK(cond)                                        \
+  if (!(cond)) {                                                     \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);  \
+    return -1;                                                       \
+  }
+
+static proc_maps_entry vma(unsigned long start, unsigned long end,
+                           const char* path = "")
+{
+  proc_maps_entry e = proc_maps_entry();
+
+  e.start = start;
+  e.end = end;
+  memcpy(e.perms, "rw-p", 5);
+  e.path = path;
+  return e;
+}
+
+static int self_test_diff()
+{
+  std::vector<proc_maps_entry> a = {
+    vma(0x1000, 0x3000, "[heap]"),
+    vma(0x5000, 0x6000),
+    vma(0x8000, 0x9000),
+    vma(0xa000, 0xc000, "[stack]"),
+  };
+  std::vector<proc_maps_entry> b = {
+    vma(0x1000, 0x4000, "[heap]"),    // grown
+    vma(0x5000, 0x6000),              // same
+    vma(0x6000, 0x7000),              // new
+    vma(0x9000, 0xc000, "[stack]"),   // grown down; 0x8000 gone
+  };
+  ProcMapsDiff d;
+
+  ProcMaps::diff(a, a, d);
+  PROC_MAPS_CHECK(d.empty());
+
+  ProcMaps::diff(a, b, d);
+  PROC_MAPS_CHECK(d.added.size() == 1 && d.added[0].start == 0x6000);
+  PROC_MAPS_CHECK(d.removed.size() == 1 && d.removed[0].start == 0x8000);
+  PROC_MAPS_CHECK(d.resized.size() == 2);
+  PROC_MAPS_CHECK(d.resized[0].from.end == 0x3000 && d.resized[0].to.end == 0x4000);
+  PROC_MAPS_CHECK(d.resized[1].from.start == 0xa000 && d.resized[1].to.start == 0x9000);
+
+  ProcMaps::diff(b, a, d);
+  PROC_MAPS_CHECK(d.added.size() == 1 && d.added[0].start == 0x8000);
+  PROC_MAPS_CHECK(d.removed.size() == 1 && d.removed[0].start == 0x6000);
+  PROC_MAPS_CHECK(d.resized.size() == 2);
+
+  // same range, another file
+  b = a;
+  b[1].path = "/tmp/x";
+  ProcMaps::diff(a, b, d);
+  PROC_MAPS_CHECK(d.added.size() == 1 && d.removed.size() == 1 && d.resized.empty());
+
+  return 0;
+}
+
+static int self_test_cache()
+{
+  const unsigned long size = 64 << 20;
+  pid_t pid = getpid();
+  ProcMapsInfo info;
+  ProcMapsDiff d;
+  ProcMaps proc_maps;
+
+  ProcMapsView v1 = ProcMapsCache::get(pid, &info);
+  unsigned long gen = info.generation;
+  PROC_MAPS_CHECK(!v1->empty());
+
+  // the parser agrees with a fresh load
+  std::vector<proc_maps_entry> fresh = proc_maps.load(pid);
+  ProcMaps::diff(*v1, fresh, d);
+  PROC_MAPS_CHECK(d.empty());
+
+  ProcMapsView v2 = ProcMapsCache::get(pid, &info);
+  PROC_MAPS_CHECK(v2 == v1 && !info.reloaded && info.generation == gen);
+
+  void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  PROC_MAPS_CHECK(p != MAP_FAILED);
+
+  ProcMapsView v3 = ProcMapsCache::get(pid, &info);
+  PROC_MAPS_CHECK(v3 != v1 && info.reloaded && info.generation == gen + 1);
+  ProcMaps::diff(*v1, *v3, d);
+  PROC_MAPS_CHECK(d.added.size() + d.resized.size() >= 1);
+
+  munmap(p, size);
+  ProcMapsView v4 = ProcMapsCache::get(pid, &info);
+  ProcMaps::diff(*v3, *v4, d);
+  PROC_MAPS_CHECK(d.removed.size() + d.resized.size() >= 1);
+
+  printf("parsed %lu vmas in %lu ns\n", v4->size(), info.load_nsecs);
+
+  // same program size, seen only in the next round
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  PROC_MAPS_CHECK(p != MAP_FAILED);
+  ProcMapsView v5 = ProcMapsCache::get(pid, &info);
+  PROC_MAPS_CHECK(info.reloaded);
+
+  PROC_MAPS_CHECK(!mprotect(p, size / 2, PROT_READ));
+  PROC_MAPS_CHECK(ProcMapsCache::get(pid, &info) == v5 && !info.reloaded);
+
+  ProcMapsCache::expire();
+  ProcMapsView v6 = ProcMapsCache::get(pid, &info);
+  PROC_MAPS_CHECK(info.reloaded && v6->size() == v5->size() + 1);
+  munmap(p, size);
+
+  // pinned maps of a pid that does not exist
+  auto pinned = std::make_shared<std::vector<proc_maps_entry>>(*v4);
+  ProcMapsCache::pin(INT_MAX, pinned);
+  ProcMapsCache::expire();
+  ProcMapsCache::expire();
+  PROC_MAPS_CHECK(ProcMapsCache::get(INT_MAX, &info) == pinned && !info.reloaded);
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  if (self_test_diff() || self_test_cache())
+    return -1;
+
+  printf("proc maps self test passed\n");
+  return 0;
+}
+
+#endif
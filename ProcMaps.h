@@ -16,6 +16,9 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 struct proc_maps_entry
 {
@@ -36,13 +39,100 @@ struct proc_maps_entry
   std::string path;
 };
 
+struct VmaRange
+{
+  unsigned long start;
+  unsigned long end;
+};
+
+// VMA changes between 2 loads of the same pid
+struct ProcMapsDiff
+{
+  struct Resize
+  {
+    VmaRange from;
+    VmaRange to;
+  };
+
+  std::vector<VmaRange> added;
+  std::vector<VmaRange> removed;
+  std::vector<Resize>   resized;
+
+  void clear() {
+    added.clear();
+    removed.clear();
+    resized.clear();
+  }
+  bool empty() const {
+    return added.empty() && removed.empty() && resized.empty();
+  }
+};
+
 class ProcMaps
 {
   public:
     std::vector<proc_maps_entry> load(pid_t pid);
+    static int parse(pid_t pid, std::vector<proc_maps_entry>& maps,
+                     std::vector<char>& buf);
+    static void diff(const std::vector<proc_maps_entry>& old_maps,
+                     const std::vector<proc_maps_entry>& new_maps,
+                     ProcMapsDiff& d);
     void show(const std::vector<proc_maps_entry>& maps);
     void show(const proc_maps_entry &vma);
-    bool is_anonymous(proc_maps_entry& vma);
+    bool is_anonymous(const proc_maps_entry& vma);
+};
+
+typedef std::shared_ptr<const std::vector<proc_maps_entry>> ProcMapsView;
+
+struct ProcMapsInfo
+{
+  unsigned long generation;   // increased on each reload
+  unsigned long load_nsecs;   // time of the latest reload
+  bool reloaded;              // by this get()
+};
+
+// The latest /proc/PID/maps of each pid, shared by all its scan ranges
+// and reloaded once per scan round. A view stays valid as long as it is
+// held; diff a held view against a newer one to find the changed VMAs.
+class ProcMapsCache
+{
+  public:
+    // Reloads on the first call after expire(), and then only when the
+    // program size in /proc/PID/statm changed. Thread safe.
+    static ProcMapsView get(pid_t pid, ProcMapsInfo* info = NULL);
+
+    // Call once per scan round: drop pids not used since the last call,
+    // and make the others reload, so that VMA changes which keep the
+    // program size (mprotect, munmap+mmap of the same length) are seen
+    // in the next round.
+    static void expire();
+
+    // Serve maps for pid from now on instead of /proc/PID/maps, e.g. when
+    // replaying a trace. Pinned pids never reload nor expire.
+    static void pin(pid_t pid, std::shared_ptr<std::vector<proc_maps_entry>> maps);
+
+  private:
+    struct Entry
+    {
+      std::mutex mlock;
+      std::shared_ptr<std::vector<proc_maps_entry>> current;
+      std::shared_ptr<std::vector<proc_maps_entry>> previous;
+      std::vector<char> buf;
+      unsigned long vm_pages = 0;
+      unsigned long generation = 0;
+      unsigned long load_nsecs = 0;
+      bool touched = false;
+      bool stale = false;
+      bool pinned = false;
+    };
+    typedef std::shared_ptr<Entry> EntryPtr;
+
+    static EntryPtr get_entry(pid_t pid);
+
+    // entries are shared, so that expire() can drop them while get() of
+    // the same pid works on its own reference outside cache_lock
+    static std::mutex cache_lock;
+    static std::unordered_map<pid_t, EntryPtr> cache;
 };
 
 #endif
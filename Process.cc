@@ -13,6 +13,7 @@
 #include "ProcMaps.h"
 #include "ProcStatus.h"
 #include "EPTMigrate.h"
+#include "IdleTrace.h"
 
 extern Option option;
 
@@ -60,9 +61,9 @@ int Process::split_ranges()
   unsigned long sum = 0;
   unsigned long start = 0;
   unsigned long end;
-  auto vmas = proc_maps.load(pid);
+  auto vmas = ProcMapsCache::get(pid);
 
-  for (auto& vma: vmas) {
+  for (auto& vma: *vmas) {
 
     if (vma.start >= TASK_SIZE_MAX)
       continue;
@@ -91,6 +92,12 @@ int Process::split_ranges()
   return 0;
 }
 
+void Process::load_trace_range(pid_t n, unsigned long start, unsigned long end)
+{
+  pid = n;
+  add_range(start, end);
+}
+
 void Process::set_policy(Policy* pol)
 {
   policy = *pol;
@@ -190,6 +197,23 @@ int ProcessCollection::collect(PolicySet& policies)
   return 0;
 }
 
+int ProcessCollection::collect_trace()
+{
+  proccess_hash.clear();
+
+  for (auto& r: IdleTrace::get_source()->get_ranges()) {
+    auto& p = proccess_hash[r.pid];
+
+    if (!p) {
+      p = std::make_shared<Process>();
+      p->context.set_pid(r.pid);
+    }
+    p->load_trace_range(r.pid, r.start, r.end);
+  }
+
+  return 0;
+}
+
 void ProcessCollection::dump()
 {
     printf("dump process collection start:\n");
@@ -32,6 +32,8 @@ class Process
     void set_policy(Policy* pol);
     bool match_policy(Policy& policy);
     Policy* match_policies(PolicySet& policies);
+    // a traced task, see IdleTrace
+    void load_trace_range(pid_t n, unsigned long start, unsigned long end);
 
   private:
     void add_range(unsigned long start, unsigned long end);
@@ -40,7 +42,6 @@ class Process
     pid_t      pid;
     Policy     policy;
     ProcStatus proc_status;
-    ProcMaps   proc_maps;
     IdleRanges idle_ranges;
     PidContext context;
 };
@@ -52,6 +53,8 @@ class ProcessCollection
   public:
     int collect();
     int collect(PolicySet& policies);
+    // the tasks and ranges of IdleTrace::get_source()
+    int collect_trace();
     ProcessHash& get_proccesses() { return proccess_hash; }
     void dump();
 
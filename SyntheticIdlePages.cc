@@ -0,0 +1,549 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "SyntheticIdlePages.h"
+#include "ProcIdlePages.h"
+#include "lib/memparse.h"
+
+static unsigned long now_nsecs()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// splitmix64
+static uint64_t mix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15UL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+  return x ^ (x >> 31);
+}
+
+static unsigned long gcd(unsigned long a, unsigned long b)
+{
+  while (b) {
+    unsigned long t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Fills a read buffer with PIP records, merging pages of the same type
+// into records of up to 15. Stops short of a record that doesn't fit.
+struct SyntheticIdlePages::PipWriter
+{
+  uint8_t* buf;
+  size_t size;
+  size_t pos = 0;
+  long last = -1;                       // the record to merge into
+  unsigned long pages = 0;              // in 4K
+
+  bool set_hva(unsigned long va)
+  {
+    // and room for 1 record after it
+    if (pos + 2 + sizeof(uint64_t) > size)
+      return false;
+
+    buf[pos++] = PIP_CMD_SET_HVA;
+    for (int i = 7; i >= 0; --i)
+      buf[pos++] = va >> (i * 8);
+    last = -1;
+    return true;
+  }
+
+  // nr pages of type, returns the number that fit
+  unsigned long put(ProcIdlePageType type, unsigned long nr)
+  {
+    unsigned long done = 0;
+    unsigned long n;
+
+    if (last >= 0 && PIP_TYPE(buf[last]) == type && PIP_SIZE(buf[last]) < 15) {
+      n = std::min(nr, 15UL - PIP_SIZE(buf[last]));
+      buf[last] += n;
+      done = n;
+    }
+
+    for (; done < nr && pos < size; done += n) {
+      n = std::min(nr - done, 15UL);
+      last = pos;
+      buf[pos++] = PIP_COMPOSE(type, n);
+    }
+
+    pages += done * (pagetype_size[type] >> PAGE_SHIFT);
+    return done;
+  }
+};
+
+SyntheticIdlePages::SyntheticIdlePages() : read_nsecs(0), read_pages(0)
+{
+  vma_size = 0;
+  vma_stride = 0;
+  nr_blocks = 0;
+  hot_blocks = 0;
+}
+
+int SyntheticIdlePages::parse(const std::string& spec)
+{
+  size_t pos = 0;
+
+  while (pos < spec.size()) {
+    size_t comma = spec.find(',', pos);
+    std::string kv = spec.substr(pos, comma == std::string::npos ?
+                                      std::string::npos : comma - pos);
+    size_t eq = kv.find('=');
+
+    pos = comma == std::string::npos ? spec.size() : comma + 1;
+    if (kv.empty())
+      continue;
+    if (eq == std::string::npos) {
+      fprintf(stderr, "synthetic idle pages: no value for %s\n", kv.c_str());
+      return -EINVAL;
+    }
+
+    std::string key = kv.substr(0, eq);
+    const char* value = kv.c_str() + eq + 1;
+
+    if (key == "pids")
+      params.nr_pids = atoi(value);
+    else if (key == "size")
+      params.size = memparse(value, NULL);
+    else if (key == "vmas")
+      params.nr_vmas = memparse(value, NULL);
+    else if (key == "thp")
+      params.thp_percent = atoi(value);
+    else if (key == "holes")
+      params.hole_percent = atoi(value);
+    else if (key == "dirty")
+      params.dirty_percent = atoi(value);
+    else if (key == "zipf")
+      params.zipf = atof(value);
+    else if (key == "hot")
+      params.hot_percent = atof(value);
+    else if (key == "drift")
+      params.drift = strtoul(value, NULL, 0);
+    else if (key == "phase")
+      params.phase_walks = atoi(value);
+    else if (key == "seed")
+      params.seed = strtoul(value, NULL, 0);
+    else {
+      fprintf(stderr, "synthetic idle pages: unknown key %s\n", key.c_str());
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+int SyntheticIdlePages::setup()
+{
+  if (params.nr_pids < 1 || params.nr_vmas < 1 || params.size < PMD_SIZE
+      || params.thp_percent < 0 || params.thp_percent > 100
+      || params.hole_percent < 0 || params.hole_percent > 100
+      || params.dirty_percent < 0 || params.dirty_percent > 100) {
+    fprintf(stderr, "synthetic idle pages: invalid parameters\n");
+    return -EINVAL;
+  }
+
+  vma_size = (params.size / params.nr_vmas + PMD_SIZE - 1) & ~(PMD_SIZE - 1);
+  vma_size = std::max(vma_size, PMD_SIZE);
+  vma_stride = vma_size + PMD_SIZE;
+
+  if (params.nr_vmas > (TASK_SIZE_MAX - VA_BASE) / vma_stride) {
+    fprintf(stderr, "synthetic idle pages: %lu VMAs of %lu bytes don't fit\n",
+            params.nr_vmas, vma_size);
+    return -EINVAL;
+  }
+
+  nr_blocks = params.nr_vmas * vma_stride / PMD_SIZE;
+  hot_blocks = nr_blocks * std::max(0.0, params.hot_percent) / 100;
+
+  auto maps = std::make_shared<std::vector<proc_maps_entry>>(params.nr_vmas);
+
+  vma_thp.resize(params.nr_vmas);
+  for (unsigned long i = 0; i < params.nr_vmas; ++i) {
+    proc_maps_entry& vma = (*maps)[i];
+
+    vma.start = VA_BASE + i * vma_stride;
+    vma.end = vma.start + vma_size;
+    strcpy(vma.perms, "rw-p");
+    vma.read = true;
+    vma.write = true;
+    vma.exec = false;
+    vma.mayshare = false;
+    vma.offset = 0;
+    vma.dev_major = 0;
+    vma.dev_minor = 0;
+    vma.ino = 0;
+
+    vma_thp[i] = mix64(params.seed ^ (i << 20)) % 100 < (unsigned)params.thp_percent;
+  }
+
+  walks.assign(params.nr_pids, 0);
+  ranges.clear();
+  for (int i = 0; i < params.nr_pids; ++i) {
+    ranges.push_back({PID_BASE + i, 0, TASK_SIZE_MAX});
+    ProcMapsCache::pin(PID_BASE + i, maps);
+  }
+
+  return 0;
+}
+
+int SyntheticIdlePages::setup(const std::string& spec)
+{
+  static SyntheticIdlePages* synth;
+  int err;
+
+  if (IdleTrace::get_source()) {
+    fprintf(stderr, "synthetic idle pages: cannot replay at the same time\n");
+    return -EINVAL;
+  }
+
+  delete synth;
+  synth = new SyntheticIdlePages;
+
+  err = synth->parse(spec);
+  if (!err)
+    err = synth->setup();
+  if (err)
+    return err;
+
+  IdleTrace::set_source(synth);
+  return 0;
+}
+
+int SyntheticIdlePages::open_session(pid_t pid)
+{
+  int fd = open("/dev/null", O_RDONLY);
+
+  return fd < 0 ? -errno : fd;
+}
+
+void SyntheticIdlePages::start_walk(pid_t pid, unsigned long start)
+{
+  unsigned long i = pid - PID_BASE;
+
+  // one range per task, each walked by one thread at a time
+  if (i < walks.size())
+    ++walks[i];
+}
+
+double SyntheticIdlePages::access_prob(unsigned long block, int walk)
+{
+  int phase = params.phase_walks ? (walk - 1) / params.phase_walks : 0;
+  uint64_t h = mix64(params.seed * 1000003 + phase);
+  unsigned long a = (h % nr_blocks) | 1;
+  unsigned long b = (h >> 32) % nr_blocks;
+  unsigned long rank;
+
+  // a permutation of the blocks when a is coprime to nr_blocks
+  while (gcd(a, nr_blocks) != 1)
+    a += 2;
+
+  block = (block + params.drift * (walk - 1)) % nr_blocks;
+  rank = (block * a + b) % nr_blocks + 1;
+
+  if (rank <= hot_blocks)
+    return 1;
+
+  return pow((double)hot_blocks / rank, params.zipf);
+}
+
+unsigned long SyntheticIdlePages::hole_pages(unsigned long block)
+{
+  unsigned long avg = 512 * params.hole_percent / 100;
+
+  if (!avg)
+    return 0;
+
+  return std::min(512UL, mix64(params.seed ^ (block << 24)) % (2 * avg + 1));
+}
+
+// The pages in [va, end) of one 2M block. Returns false when the buffer
+// is full.
+bool SyntheticIdlePages::gen_block(PipWriter& w, pid_t pid, int walk,
+                                   unsigned long va, unsigned long end,
+                                   bool thp)
+{
+  unsigned long block = (va - VA_BASE) / PMD_SIZE;
+  double p = access_prob(block, walk);
+  uint64_t state = mix64(params.seed ^ ((uint64_t)pid << 40) ^ ((uint64_t)walk << 32) ^ block);
+  uint64_t dirty_seed = state;
+
+  // uniform in [0, 1)
+  auto uniform = [&state]() {
+    state = mix64(state);
+    return (state >> 11) * (1.0 / (1UL << 53));
+  };
+  // whether accessed page i of the block is also written
+  auto dirty = [&](unsigned long i) {
+    return mix64(dirty_seed + i + 1) % 100 < (unsigned)params.dirty_percent;
+  };
+
+  if (thp) {
+    ProcIdlePageType type = uniform() < p ? PMD_ACCESSED : PMD_IDLE;
+
+    if (type == PMD_ACCESSED && dirty(0))
+      type = PMD_DIRTY;
+
+    return w.put(type, 1) == 1;
+  }
+
+  unsigned long first = (va & (PMD_SIZE - 1)) >> PAGE_SHIFT;
+  unsigned long last = first + ((end - va) >> PAGE_SHIFT);
+  unsigned long populated = 512 - hole_pages(block);
+  unsigned long limit = std::min(last, populated);
+  double log_idle = p < 1 ? log1p(-p) : 0;
+
+  // next accessed page at or after i, 512 for none; the pages are
+  // drawn from the block start to stay the same on partial reads
+  auto next_access = [&](unsigned long i) {
+    if (p >= 1)
+      return i;
+    if (p <= 0)
+      return 512UL;
+    return std::min(512UL, i + (unsigned long)(log1p(-uniform()) / log_idle));
+  };
+
+  unsigned long acc = next_access(0);
+
+  if (!first && last == 512 && populated == 512 && acc >= 512)
+    return w.put(PMD_IDLE_PTES, 1) == 1;
+
+  for (unsigned long i = first; i < limit;) {
+    unsigned long n;
+
+    while (acc < i)
+      acc = next_access(acc + 1);
+
+    if (acc > i) {
+      n = std::min(acc, limit) - i;
+      if (w.put(PTE_IDLE, n) != n)
+        return false;
+      i += n;
+    } else {
+      if (w.put(dirty(i) ? PTE_DIRTY : PTE_ACCESSED, 1) != 1)
+        return false;
+      ++i;
+    }
+  }
+
+  if (last > populated) {
+    unsigned long n = last - std::max(first, populated);
+
+    if (w.put(PTE_HOLE, n) != n)
+      return false;
+  }
+
+  return true;
+}
+
+ssize_t SyntheticIdlePages::read(pid_t pid, unsigned long va, uint8_t* buf,
+                                 size_t size, unsigned long& nsecs)
+{
+  unsigned long t = now_nsecs();
+  unsigned long i = pid - PID_BASE;
+  unsigned long range_end = va + (size << (3 + PAGE_SHIFT));
+  unsigned long vi;
+  unsigned long end;
+  PipWriter w;
+  int walk;
+
+  nsecs = 0;
+  if (i >= walks.size()) {
+    errno = ESRCH;
+    return -1;
+  }
+  walk = std::max(1, walks[i]);
+
+  // from the first VMA at or after va, and like the kernel only up to
+  // range_end, but then also stop at the VMA end where walk_vma() stops
+  if (va < VA_BASE)
+    va = VA_BASE;
+  vi = (va - VA_BASE) / vma_stride;
+  if (va - VA_BASE - vi * vma_stride >= vma_size)
+    va = VA_BASE + ++vi * vma_stride;
+  if (vi >= params.nr_vmas || va >= range_end)
+    return 0;
+
+  end = std::min(range_end, VA_BASE + vi * vma_stride + vma_size);
+
+  w.buf = buf;
+  w.size = size;
+  if (!w.set_hva(va)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  while (va < end) {
+    unsigned long block_end = std::min(end, (va | (PMD_SIZE - 1)) + 1);
+
+    // a huge page is reported in whole
+    if (vma_thp[vi])
+      block_end = (va | (PMD_SIZE - 1)) + 1;
+
+    if (!gen_block(w, pid, walk, va, block_end, vma_thp[vi]))
+      break;
+    va = block_end;
+  }
+
+  nsecs = now_nsecs() - t;
+  read_nsecs += nsecs;
+  read_pages += w.pages;
+
+  return w.pos;
+}
+
+#ifdef IDLE_SYNTH_BENCH
+
+#include <locale.h>
+
+#include "Option.h"
+#include "EPTScan.h"
+#include "Numa.h"
+
+Option option;
+
+int debug_level()
+{
+  return option.debug_level;
+}
+
+// the populated pages of a task
+static unsigned long expect_pages(const std::vector<proc_maps_entry>& vmas)
+{
+  unsigned long sum = 0;
+
+  for (auto& vma: vmas)
+    sum += (vma.end - vma.start) >> PAGE_SHIFT;
+
+  return sum;
+}
+
+// Walk, count and threshold speed of a task of the spec size and of each
+// 4th smaller size down to 1G. Also checks that the walks saw all pages.
+int main(int argc, char* argv[])
+{
+  const char* spec = argc > 1 ? argv[1] : "size=16G";
+  int nr_walks = argc > 2 ? atoi(argv[2]) : 4;
+  NumaNodeCollection numa;
+  SyntheticIdlePages synth;
+  std::vector<unsigned long> sizes;
+
+  setlocale(LC_NUMERIC, "");
+
+  if (synth.parse(spec))
+    return -1;
+
+  for (unsigned long size = synth.get_params().size; size >= (1UL << 30); size /= 4)
+    sizes.insert(sizes.begin(), size);
+  if (sizes.empty())
+    sizes.push_back(synth.get_params().size);
+
+  numa.collect(NULL, NULL);
+  IdleTrace::set_source(&synth);
+
+  printf("%8s  %14s  %10s  %10s  %10s  %10s  %10s\n",
+         "size_GB", "pages", "walk_Mpps", "gen_ms", "walk_ms",
+         "count_Mpps", "thres_Mpps");
+
+  for (unsigned long size: sizes) {
+    SynthParams params = synth.get_params();
+    struct timespec ts[4];
+    unsigned long nr_pages = 0;
+    unsigned long nr_hot = 0;
+    unsigned long gen_nsecs;
+    double secs[3];
+    EPTScan scan;
+
+    params.nr_pids = 1;
+    params.size = size;
+    synth.set_params(params);
+    if (synth.setup())
+      return -1;
+
+    scan.set_pid(SyntheticIdlePages::PID_BASE);
+    scan.set_numacollection(&numa);
+
+    gen_nsecs = synth.get_read_nsecs();
+    clock_gettime(CLOCK_MONOTONIC, &ts[0]);
+    if (scan.walk_multi(nr_walks, 0))
+      return -1;
+    clock_gettime(CLOCK_MONOTONIC, &ts[1]);
+    gen_nsecs = synth.get_read_nsecs() - gen_nsecs;
+
+    EPTScan::reset_sys_refs_count(scan.get_nr_walks());
+    scan.count_refs();
+    clock_gettime(CLOCK_MONOTONIC, &ts[2]);
+
+    // the top 10% pages by refs, as EPTMigrate::select_top_pages() does
+    for (int type = 0; type <= MAX_ACCESSED; ++type) {
+      ProcIdleRefs& prc = scan.get_pagetype_refs((ProcIdlePageType)type);
+      histogram_type& hist = prc.histogram_2d[REF_LOC_ALL];
+      std::vector<void*> addrs;
+      long quota = prc.page_refs.size() / 10;
+      int min_refs = scan.get_nr_walks();
+      unsigned long addr;
+      payload_t refs;
+      int8_t nid;
+
+      for (; min_refs > 1 && quota > 0; --min_refs)
+        quota -= hist[min_refs];
+
+      int ret = prc.page_refs.get_first(addr, refs, nid);
+      while (!ret) {
+        if (refs >= min_refs)
+          addrs.push_back((void*)addr);
+        ret = prc.page_refs.get_next(addr, refs, nid);
+      }
+
+      nr_pages += prc.page_refs.size() << (prc.page_refs.get_pageshift() - PAGE_SHIFT);
+      nr_hot += addrs.size();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts[3]);
+
+    for (int i = 0; i < 3; ++i)
+      secs[i] = (ts[i + 1].tv_sec - ts[i].tv_sec) +
+                (ts[i + 1].tv_nsec - ts[i].tv_nsec) / 1e9;
+
+    printf("%8lu  %'14lu  %10.2f  %10.1f  %10.1f  %10.2f  %10.2f\n",
+           size >> 30, nr_pages,
+           nr_pages * nr_walks / (secs[0] - gen_nsecs / 1e9) / 1e6,
+           gen_nsecs / 1e6, secs[0] * 1e3,
+           nr_pages / secs[1] / 1e6,
+           nr_pages / secs[2] / 1e6);
+
+    // holes are the only pages not reported
+    unsigned long expect = expect_pages(*ProcMapsCache::get(SyntheticIdlePages::PID_BASE));
+    if (nr_pages > expect || nr_pages < expect * (100 - 2 * params.hole_percent) / 100) {
+      printf("pages mismatch: %lu walked, %lu mapped\n", nr_pages, expect);
+      return -1;
+    }
+    if (!nr_hot && params.hot_percent > 0) {
+      printf("no hot pages\n");
+      return -1;
+    }
+  }
+
+  IdleTrace::set_source(NULL);
+  return 0;
+}
+
+#endif
+// vim:set ts=2 sw=2 et:
@@ -0,0 +1,98 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (c) 2018 Intel Corporation
+ */
+
+#ifndef AEP_SYNTHETIC_IDLE_PAGES_H
+#define AEP_SYNTHETIC_IDLE_PAGES_H
+
+// idle_pages output of made up tasks, for scaling benchmarks
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "IdleTrace.h"
+
+// The access model. Each 2M block of a task has a rank in 1..N; per walk
+// the pages of the block of rank r are accessed with probability
+// min(1, (hot_blocks / r) ^ zipf), hot_blocks being hot_percent of N.
+// The ranks shift by drift blocks each walk, and are shuffled afresh
+// every phase_walks walks.
+struct SynthParams
+{
+  int nr_pids = 1;
+  unsigned long size = 16UL << 30;      // VMA bytes per task
+  unsigned long nr_vmas = 64;
+  int thp_percent = 50;                 // VMAs mapped by 2M pages
+  int hole_percent = 5;                 // 4K pages never faulted in
+  int dirty_percent = 0;                // accessed pages also written
+  double zipf = 1.0;
+  double hot_percent = 5;
+  unsigned long drift = 0;
+  int phase_walks = 0;                  // 0: no phase changes
+  unsigned long seed = 1;
+};
+
+class SyntheticIdlePages : public IdlePagesSource
+{
+  public:
+    SyntheticIdlePages();
+
+    // Comma separated key=value of the SynthParams fields:
+    // pids, size, vmas, thp, holes, dirty, zipf, hot, drift, phase, seed.
+    // Sizes take K/M/G/T suffixes. Negative errno on failure.
+    int parse(const std::string& spec);
+    void set_params(const SynthParams& p) { params = p; }
+    const SynthParams& get_params() { return params; }
+
+    // lay out the VMAs of the tasks and pin them in ProcMapsCache
+    int setup();
+    // a process wide source from spec, see IdleTrace::set_source()
+    static int setup(const std::string& spec);
+
+    int open_session(pid_t pid);
+    void start_walk(pid_t pid, unsigned long start);
+    ssize_t read(pid_t pid, unsigned long va, uint8_t* buf,
+                 size_t size, unsigned long& nsecs);
+    const std::vector<IdleTraceRange>& get_ranges() { return ranges; }
+
+    // first pid, beyond the kernel's PID_MAX_LIMIT
+    static const pid_t PID_BASE = 1 << 22;
+    // where the VMAs of each task start
+    static const unsigned long VA_BASE = 1UL << 44;
+
+    // time spent in read(), and the pages it reported
+    unsigned long get_read_nsecs() { return read_nsecs; }
+    unsigned long get_read_pages() { return read_pages; }
+
+  private:
+    struct PipWriter;
+
+    double access_prob(unsigned long block, int walk);
+    bool gen_block(PipWriter& w, pid_t pid, int walk,
+                   unsigned long va, unsigned long end, bool thp);
+    unsigned long hole_pages(unsigned long block);
+
+  private:
+    SynthParams params;
+
+    unsigned long vma_size;
+    unsigned long vma_stride;           // VMA and the hole after it
+    unsigned long nr_blocks;            // per task, holes included
+    unsigned long hot_blocks;
+
+    std::vector<uint8_t> vma_thp;       // per VMA, same for all tasks
+    std::vector<int> walks;             // per task
+    std::vector<IdleTraceRange> ranges;
+
+    std::atomic<unsigned long> read_nsecs;
+    std::atomic<unsigned long> read_pages;
+};
+
+#endif
+// vim:set ts=2 sw=2 et:
@@ -50,7 +50,7 @@ void VMAInspect::dump_node_percent(Formatter* fmt, int slot)
 }
 
 int VMAInspect::dump_vma_nodes(Formatter* fmt, int is_split_vma,
-                               proc_maps_entry& vma, MovePagesStatusCount& status_sum)
+                               const proc_maps_entry& vma, MovePagesStatusCount& status_sum)
 {
   unsigned long nr_pages;
   int err = 0;
@@ -100,13 +100,12 @@ int VMAInspect::dump_vma_nodes(Formatter* fmt, int is_split_vma,
 
 int VMAInspect::dump_task_nodes(pid_t i, Formatter* m)
 {
-  ProcMaps proc_maps;
   int err = 0;
   MovePagesStatusCount status_sum;
-  auto maps = proc_maps.load(i);
+  auto maps = ProcMapsCache::get(i);
 
   pid = i;
-  for (auto &vma: maps) {
+  for (auto &vma: *maps) {
     err = dump_vma_nodes(m, true, vma, status_sum);
     if (err)
       break;
@@ -127,13 +126,12 @@ int VMAInspect::calc_memory_state(pid_t i,
                                   unsigned long &total_dram_kb,
                                   unsigned long &total_pmem_kb)
 {
-  ProcMaps proc_maps;
   int err = 0;
   MovePagesStatusCount status_sum;
-  auto maps = proc_maps.load(i);
+  auto maps = ProcMapsCache::get(i);
 
   pid = i;
-  for (auto &vma: maps) {
+  for (auto &vma: *maps) {
     err = dump_vma_nodes(NULL, false, vma, status_sum);
     if (err)
       break;
@@ -26,7 +26,7 @@ class VMAInspect
 
     int dump_task_nodes(pid_t i, Formatter* m);
     int dump_vma_nodes(Formatter* m, int is_split_vma,
-                       proc_maps_entry& vma, MovePagesStatusCount& status_sum);
+                       const proc_maps_entry& vma, MovePagesStatusCount& status_sum);
     void set_numa_collection(NumaNodeCollection* new_numa_collection) {
       numa_collection = new_numa_collection;
       locator.set_numacollection(new_numa_collection);
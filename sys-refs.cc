@@ -26,6 +26,8 @@
 #include "EPTScan.h"
 #include "EPTMigrate.h"
 #include "GlobalScan.h"
+#include "IdleTrace.h"
+#include "SyntheticIdlePages.h"
 #include "version.h"
 #include "OptionParser.h"
 
@@ -49,6 +51,9 @@ static const struct option opts[] = {
   {"verbose",             required_argument,  NULL, 'v'},
   {"config",              required_argument,  NULL, 'c'},
   {"progressive-profile", required_argument,  NULL, 'p'},
+  {"record",              required_argument,  NULL, 'R'},
+  {"replay",              required_argument,  NULL, 'P'},
+  {"synth",               required_argument,  NULL, 'S'},
   {"help",                no_argument,        NULL, 'h'},
   {"version",             no_argument,        NULL, 'r'},
 
@@ -70,6 +75,9 @@ static void usage(char *prog)
           "    -p|--progressive-profile   The script path and name.\n"
           "                               Group pages by refcount,\n"
           "                               migrate and call script to profile each group.\n"
+          "    -R|--record     Record the idle_pages reads to a trace file\n"
+          "    -P|--replay     Scan the tasks in a recorded trace file, no migration\n"
+          "    -S|--synth      Scan made up tasks, e.g. pids=4,size=1T,zipf=1.2; no migration\n"
           "    -v|--verbose    Show debug info\n"
           "    -r|--version    Show version info\n"
           "    -c|--config     config file path name\n",
@@ -82,7 +90,7 @@ static void parse_cmdline(int argc, char *argv[])
 {
   int options_index = 0;
   int opt = 0;
-  const char *optstr = "hvri:s:l:o:d:m:c:p:";
+  const char *optstr = "hvri:s:l:o:d:m:c:p:R:P:S:";
 
   optind = 1;
   while ((opt = getopt_long(argc, argv, optstr, opts, &options_index)) != EOF) {
@@ -112,6 +120,15 @@ static void parse_cmdline(int argc, char *argv[])
     case 'p':
       option.progressive_profile = optarg;
       break;
+    case 'R':
+      option.idle_trace_record = optarg;
+      break;
+    case 'P':
+      option.idle_trace_replay = optarg;
+      break;
+    case 'S':
+      option.idle_pages_synth = optarg;
+      break;
     case 'v':
       ++option.debug_level;
       break;
@@ -150,6 +167,13 @@ int main(int argc, char *argv[])
 
   register_signal_handler();
 
+  if (IdleTrace::setup(option.idle_trace_record, option.idle_trace_replay))
+    return -1;
+
+  if (!option.idle_pages_synth.empty() &&
+      SyntheticIdlePages::setup(option.idle_pages_synth))
+    return -1;
+
   gscan.apply_option();
   gscan.main_loop();
 
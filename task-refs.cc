@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <getopt.h>
+#include <errno.h>
 
 #include <iostream>
 #include <string>
@@ -24,6 +25,9 @@
 #include "ProcIdlePages.h"
 #include "EPTScan.h"
 #include "EPTMigrate.h"
+#include "Numa.h"
+#include "IdleTrace.h"
+#include "SyntheticIdlePages.h"
 #include "lib/debug.h"
 #include "version.h"
 
@@ -44,7 +48,11 @@ static const struct option opts[] = {
   {"dram",      required_argument,  NULL, 'd'},
   {"hot-refs",  required_argument,  NULL, 'H'},
   {"cold-refs", required_argument,  NULL, 'c'},
+  {"dirty-refs", required_argument, NULL, 'D'},
   {"migrate",   required_argument,  NULL, 'm'},
+  {"record",    required_argument,  NULL, 'R'},
+  {"replay",    required_argument,  NULL, 'P'},
+  {"synth",     required_argument,  NULL, 'S'},
   {"verbose",   required_argument,  NULL, 'v'},
   {"help",      no_argument,        NULL, 'h'},
   {"changes",   no_argument,        NULL, 'g'},
@@ -64,7 +72,11 @@ static void usage(char *prog)
           "    -d|--dram       The DRAM percent, wrt. DRAM+PMEM total size\n"
           "    -H|--hot-refs   min_refs threshold for hot pages\n"
           "    -c|--cold-refs  max_refs threshold for cold pages\n"
+          "    -D|--dirty-refs Track dirty pages, min dirty refs of write-hot pages\n"
           "    -m|--migrate    Migrate what: 0|none, 1|hot, 2|cold, 3|both\n"
+          "    -R|--record     Record the idle_pages reads to a trace file\n"
+          "    -P|--replay     Scan a recorded trace file, PID defaults to its first one\n"
+          "    -S|--synth      Scan made up tasks, e.g. size=1T,zipf=1.2; PID defaults to the first\n"
           "    -v|--verbose    Show debug info\n"
           "    -r|--version    Show version info\n",
           prog);
@@ -76,7 +88,7 @@ static void parse_cmdline(int argc, char *argv[])
 {
   int options_index = 0;
 	int opt = 0;
-	const char *optstr = "hvrp:i:l:o:d:H:c:m:";
+	const char *optstr = "hvrp:i:l:o:d:H:c:D:m:R:P:S:";
 
   while ((opt = getopt_long(argc, argv, optstr, opts, &options_index)) != EOF) {
     switch (opt) {
@@ -103,9 +115,21 @@ static void parse_cmdline(int argc, char *argv[])
     case 'c':
       option.cold_max_refs = atoi(optarg);
       break;
+    case 'D':
+      option.dirty_min_refs = atoi(optarg);
+      break;
     case 'm':
       option.migrate_what = Option::parse_migrate_name(optarg);
       break;
+    case 'R':
+      option.idle_trace_record = optarg;
+      break;
+    case 'P':
+      option.idle_trace_replay = optarg;
+      break;
+    case 'S':
+      option.idle_pages_synth = optarg;
+      break;
     case 'v':
       ++option.debug_level;
       break;
@@ -119,11 +143,9 @@ static void parse_cmdline(int argc, char *argv[])
     }
   }
 
-  if (!option.pid)
+  if (option.pid <= 0 && option.idle_trace_replay.empty() &&
+      option.idle_pages_synth.empty())
     usage(argv[0]);
-
-  if (option.output_file.empty())
-    option.output_file = "refs-count-" + std::to_string(option.pid);
 }
 
 int account_refs(EPTMigrate& migration)
@@ -161,9 +183,34 @@ int main(int argc, char *argv[])
 
   parse_cmdline(argc, argv);
 
+  err = IdleTrace::setup(option.idle_trace_record, option.idle_trace_replay);
+  if (err)
+    return err;
+
+  if (!option.idle_pages_synth.empty()) {
+    err = SyntheticIdlePages::setup(option.idle_pages_synth);
+    if (err)
+      return err;
+  }
+
+  if (option.pid <= 0) {
+    if (IdleTrace::get_source()->get_ranges().empty()) {
+      fprintf(stderr, "no walks in %s\n", option.idle_trace_replay.c_str());
+      return -ENOENT;
+    }
+    option.pid = IdleTrace::get_source()->get_ranges()[0].pid;
+  }
+
+  if (option.output_file.empty())
+    option.output_file = "refs-count-" + std::to_string(option.pid);
+
+  NumaNodeCollection numa_collection;
   EPTMigrate migration;
 
+  numa_collection.collect(&option.numa_hw_config,
+                          &option.numa_hw_config_v2);
   migration.set_pid(option.pid);
+  migration.set_numacollection(&numa_collection);
 
   err = account_refs(migration);
   if (err) {
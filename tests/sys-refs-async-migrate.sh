@@ -0,0 +1,45 @@
+#!/bin/bash
+# Run rounds of sys-refs with migrate_async on made up tasks, and check
+# each round is compared with the last one only after its migration ended.
+#
+# usage: tests/sys-refs-async-migrate.sh [path/to/sys-refs]
+
+SYS_REFS=${1:-./sys-refs}
+
+config=$(mktemp)
+log=$(mktemp)
+trap "rm -f $config $log" EXIT
+
+cat > $config <<EOF
+options:
+    max_threads: 2
+    migrate_async: 1
+EOF
+
+# 3 loops: 2 async migrations, the 2nd round compared with the 1st
+if ! $SYS_REFS -c $config -S pids=2,size=256M -l 3 -i 0.1 -s 0 -m 3 -d 50 > $log 2>&1; then
+	tail -20 $log
+	echo "sys-refs failed"
+	exit 1
+fi
+
+awk '
+/^Starting migration behind/	{ ++started; running = 1 }
+/^End of migration/		{ ++ended; running = 0 }
+/^Page hotness drifting/	{
+	++drifts
+	if (running) {
+		print "drifting calculated while migrating, line " NR
+		bad = 1
+	}
+}
+END {
+	if (started < 2 || ended < 1 || !drifts) {
+		printf "expect 2+ migrations and a drift, got %d started %d ended %d drifts\n",
+		       started, ended, drifts
+		bad = 1
+	}
+	exit bad
+}' $log || exit 1
+
+echo "async migrate test passed"